@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lispy.h"
+
+/**
+ * The native map, filter, foldl, len, nth and reverse against the same
+ * functions written in Lisp the way a prelude would, over a list of 5000
+ * numbers.
+ *
+ * builtins [repeats]
+ */
+
+char *prelude[] = {
+    "def {lmap} (\\ {f l} {if (== l {}) {{}} "
+    "{join (list (f (eval (head l)))) (lmap f (tail l))}})",
+    "def {lfilter} (\\ {f l} {if (== l {}) {{}} "
+    "{join (if (f (eval (head l))) {head l} {{}}) (lfilter f (tail l))}})",
+    "def {lfoldl} (\\ {f z l} {if (== l {}) {z} "
+    "{lfoldl f (f z (eval (head l))) (tail l)}})",
+    "def {llen} (\\ {l} {if (== l {}) {0} {+ 1 (llen (tail l))}})",
+    "def {lnth} (\\ {n l} {if (== n 0) {eval (head l)} "
+    "{lnth (- n 1) (tail l)}})",
+    "def {lreverse} (\\ {l} {if (== l {}) {{}} "
+    "{join (lreverse (tail l)) (head l)}})",
+};
+
+// Each call, with the native function first and then the Lisp one.
+char *calls[][2] = {
+    {"map (\\ {x} {* x 2}) l", "lmap (\\ {x} {* x 2}) l"},
+    {"filter (\\ {x} {> x 2500}) l", "lfilter (\\ {x} {> x 2500}) l"},
+    {"foldl + 0 l", "lfoldl + 0 l"},
+    {"len l", "llen l"},
+    {"nth 4999 l", "lnth 4999 l"},
+    {"reverse l", "lreverse l"},
+};
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+double run(linterp *interp, char *input, int repeats) {
+  double start = now();
+  for (int i = 0; i < repeats; i++) {
+    lval *r = linterp_eval(interp, input);
+    if (lval_type(r) == LVAL_ERR) {
+      printf("%s: %s\n", input, lval_err_of(r));
+      exit(1);
+    }
+    lval_del(r);
+  }
+  return (now() - start) / repeats;
+}
+
+int main(int argc, char **argv) {
+  int repeats = argc > 1 ? atoi(argv[1]) : 20;
+  int n = 5000;
+  char *def = malloc(n * 8 + 32);
+  int len = sprintf(def, "def {l} {");
+  for (int i = 0; i < n; i++) {
+    len += sprintf(def + len, "%d ", i);
+  }
+  sprintf(def + len, "}");
+
+  linterp *interp = linterp_new();
+  lval_del(linterp_eval(interp, def));
+  for (size_t i = 0; i < sizeof(prelude) / sizeof(prelude[0]); i++) {
+    lval_del(linterp_eval(interp, prelude[i]));
+  }
+  for (size_t i = 0; i < sizeof(calls) / sizeof(calls[0]); i++) {
+    double native = run(interp, calls[i][0], repeats);
+    double lisp = run(interp, calls[i][1], repeats);
+    printf("%-30s native %8.3fms lisp %8.3fms %6.1fx\n", calls[i][0],
+           native * 1e3, lisp * 1e3, lisp / native);
+  }
+  linterp_del(interp);
+  free(def);
+  return 0;
+}
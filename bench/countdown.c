@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lispy.h"
+
+/**
+ * Tail calls per second, from a lambda that counts down from n by calling
+ * itself in tail position, and from two that call each other.
+ *
+ * countdown [n]
+ */
+
+char *prelude[] = {
+    "def {countdown} (\\ {n} {if (== n 0) {0} {countdown (- n 1)}})",
+    "def {even} (\\ {n} {if (== n 0) {1} {odd (- n 1)}})",
+    "def {odd} (\\ {n} {if (== n 0) {0} {even (- n 1)}})",
+};
+
+char *calls[] = {"countdown", "even"};
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : 10000000;
+  linterp *interp = linterp_new();
+  for (size_t i = 0; i < sizeof(prelude) / sizeof(prelude[0]); i++) {
+    lval_del(linterp_eval(interp, prelude[i]));
+  }
+  for (size_t i = 0; i < sizeof(calls) / sizeof(calls[0]); i++) {
+    char input[64];
+    snprintf(input, sizeof(input), "%s %ld", calls[i], n);
+    double start = now();
+    lval *r = linterp_eval(interp, input);
+    double took = now() - start;
+    if (lval_type(r) == LVAL_ERR) {
+      printf("%s: %s\n", input, lval_err_of(r));
+      exit(1);
+    }
+    lval_del(r);
+    printf("%-10s %ld calls in %7.3fs %12.0f calls/s\n", calls[i], n, took,
+           n / took);
+  }
+  linterp_del(interp);
+  return 0;
+}
@@ -0,0 +1,64 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lispy.h"
+
+/**
+ * Compares evaluating a request in an interpreter linked into the process
+ * with running the lispy binary once per request, as a host did before the
+ * interpreter was a library.
+ *
+ * embed path/to/lispy [requests]
+ */
+
+char *request = "foldl + 0 (map (\\ {x} {* x x}) {1 2 3 4 5 6 7 8 9 10})";
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fputs("usage: embed path/to/lispy [requests]\n", stderr);
+    return 1;
+  }
+  int n = argc > 2 ? atoi(argv[2]) : 2000;
+
+  // In process, one interpreter for every request.
+  double start = now();
+  linterp *interp = linterp_new();
+  for (int i = 0; i < n; i++) {
+    lval_del(linterp_eval(interp, request));
+  }
+  linterp_del(interp);
+  double embedded = now() - start;
+
+  // A process per request, given the request as a file.
+  char path[] = "/tmp/embed-XXXXXX";
+  int fd = mkstemp(path);
+  dprintf(fd, "%s\n", request);
+  close(fd);
+  start = now();
+  for (int i = 0; i < n; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      dup2(open("/dev/null", O_WRONLY), 1);
+      execl(argv[1], argv[1], path, (char *)NULL);
+      _exit(1);
+    }
+    waitpid(pid, NULL, 0);
+  }
+  double spawned = now() - start;
+  unlink(path);
+
+  printf("%d requests\n", n);
+  printf("in process:   %.4fs %.1fus/request\n", embedded, embedded / n * 1e6);
+  printf("exec per run: %.4fs %.1fus/request\n", spawned, spawned / n * 1e6);
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lispy.h"
+
+/**
+ * The cost of looking up a global as the global environment grows from 10
+ * to 10,000 definitions. Each size defines that many globals, then times a
+ * lambda that adds up 1000 of them spread over the whole environment.
+ *
+ * env [calls]
+ */
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  int calls = argc > 1 ? atoi(argv[1]) : 2000;
+  int lookups = 1000;
+  int sizes[] = {10, 100, 1000, 10000};
+  char *body = malloc(lookups * 16 + 64);
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    int size = sizes[s];
+    linterp *interp = linterp_new();
+    char def[64];
+    for (int i = 0; i < size; i++) {
+      snprintf(def, sizeof(def), "def {g%d} %d", i, i);
+      lval_del(linterp_eval(interp, def));
+    }
+
+    // The formal is unused, it is there so that (sum 0) is a call.
+    int n = sprintf(body, "def {sum} (\\ {x} {+");
+    for (int i = 0; i < lookups; i++) {
+      n += sprintf(body + n, " g%d", (int)((long)i * size / lookups));
+    }
+    sprintf(body + n, "})");
+    lval_del(linterp_eval(interp, body));
+
+    double start = now();
+    for (int i = 0; i < calls; i++) {
+      lval_del(linterp_eval(interp, "sum 0"));
+    }
+    double elapsed = now() - start;
+    linterp_del(interp);
+
+    printf("%5d globals: %.1fns/lookup\n", size,
+           elapsed / calls / lookups * 1e9);
+  }
+  free(body);
+  return 0;
+}
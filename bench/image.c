@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lispy.h"
+
+/**
+ * Time to the first eval with a prelude of n lambdas, loaded from source,
+ * from a heap image of it, and with no prelude, best of repeats.
+ *
+ * image [n] [repeats]
+ */
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void check(lval *x, char *what) {
+  if (lval_type(x) == LVAL_ERR) {
+    printf("%s: %s\n", what, lval_err_of(x));
+    exit(1);
+  }
+  lval_del(x);
+}
+
+double start_up(char *source, char *image) {
+  double start = now();
+  linterp *interp = linterp_new();
+  if (source) {
+    check(linterp_load(interp, source), source);
+  }
+  if (image) {
+    check(linterp_load_image(interp, image), image);
+  }
+  check(linterp_eval(interp, "+ 1 2"), "+ 1 2");
+  double took = now() - start;
+  linterp_del(interp);
+  return took;
+}
+
+double best(char *source, char *image, int repeats) {
+  double min = start_up(source, image);
+  for (int i = 1; i < repeats; i++) {
+    double t = start_up(source, image);
+    min = t < min ? t : min;
+  }
+  return min;
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 6000;
+  int repeats = argc > 2 ? atoi(argv[2]) : 5;
+  char source[] = "/tmp/lispy-image-bench.lspy";
+  char image[] = "/tmp/lispy-image-bench.img";
+
+  FILE *f = fopen(source, "w");
+  for (int i = 0; i < n; i++) {
+    fprintf(f, "(def {f%d} (\\ {x y} {if (> x %d) {+ x y} {- x y}}))\n", i,
+            i);
+  }
+  fclose(f);
+  linterp *interp = linterp_new();
+  check(linterp_load(interp, source), source);
+  char save[64];
+  snprintf(save, sizeof(save), "save-image \"%s\"", image);
+  check(linterp_eval(interp, save), save);
+  linterp_del(interp);
+
+  printf("loading the source %8.1fms\n", best(source, NULL, repeats) * 1e3);
+  printf("--image            %8.1fms\n", best(NULL, image, repeats) * 1e3);
+  printf("no prelude         %8.1fms\n", best(NULL, NULL, repeats) * 1e3);
+  unlink(source);
+  unlink(image);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lispy.h"
+
+/**
+ * The size of an lval, and the memory and the time to walk, copy and delete
+ * a Q-Expression of a million numbers. Small numbers are stored in the
+ * pointer itself, large ones take an lval each, so both are measured. A
+ * copy shares the children with the original, so it should take no time.
+ *
+ * layout [elements]
+ */
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+long resident(void) {
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%*s %ld", &pages) != 1) {
+      pages = 0;
+    }
+    fclose(f);
+  }
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+void measure(char *name, long base, int n) {
+  long before = resident();
+  double start = now();
+  lval *q = lval_qexpr();
+  for (int i = 0; i < n; i++) {
+    lval_add(q, lval_num(base + i));
+  }
+  double built = now() - start;
+  long bytes = resident() - before;
+
+  start = now();
+  unsigned long sum = 0;
+  for (int i = 0; i < q->count; i++) {
+    sum += lval_num_of(q->cell[i]);
+  }
+  double walked = now() - start;
+
+  start = now();
+  lval *copy = lval_copy(q);
+  double copied = now() - start;
+
+  start = now();
+  lval_del(copy);
+  lval_del(q);
+  double deleted = now() - start;
+
+  printf("%s: %.1f bytes/element, build %.1fns, walk %.2fns, copy %.1fms, "
+         "delete %.1fms (sum %lu)\n",
+         name, (double)bytes / n, built / n * 1e9, walked / n * 1e9,
+         copied * 1e3, deleted * 1e3, sum);
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000000;
+  printf("sizeof(lval) %zu\n", sizeof(lval));
+  measure("small numbers", 0, n);
+  measure("large numbers", LVAL_FIXNUM_MAX, n);
+  return 0;
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lispy.h"
+
+/**
+ * The time to read, join and take the tail of lists of 100,000 numbers, and
+ * to walk one to the end with tail.
+ *
+ * lists [repeats]
+ */
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+double run(linterp *interp, char *input, int repeats) {
+  double start = now();
+  for (int i = 0; i < repeats; i++) {
+    lval *r = linterp_eval(interp, input);
+    if (lval_type(r) == LVAL_ERR) {
+      printf("%s: %s\n", input, lval_err_of(r));
+      exit(1);
+    }
+    lval_del(r);
+  }
+  return (now() - start) / repeats;
+}
+
+int main(int argc, char **argv) {
+  int repeats = argc > 1 ? atoi(argv[1]) : 100;
+  int n = 100000;
+  char *def = malloc(n * 8 + 32);
+  int len = sprintf(def, "def {l} {");
+  for (int i = 0; i < n; i++) {
+    len += sprintf(def + len, "%d ", i);
+  }
+  sprintf(def + len, "}");
+
+  linterp *interp = linterp_new();
+  lval_del(linterp_eval(interp, "def {walk} (\\ {l} "
+                                "{if (== l {}) {0} {walk (tail l)}})"));
+  printf("read: %.3fms\n", run(interp, def, 10) * 1e3);
+  printf("join: %.3fms\n", run(interp, "join l l", repeats) * 1e3);
+  printf("tail: %.3fms\n", run(interp, "tail l", repeats) * 1e3);
+  printf("walk: %.3fms\n", run(interp, "walk l", 10) * 1e3);
+  linterp_del(interp);
+  free(def);
+  return 0;
+}
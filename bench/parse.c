@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "mpc.h"
+
+/**
+ * Parse throughput of mpc_parse_contents and mpc_parse_pipe with the lispy
+ * grammar, in MB/s. With -g it writes a file of about the given number of
+ * megabytes of definitions, strings and comments to parse.
+ *
+ * parse -g megabytes file
+ * parse file [file ...]
+ */
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int generate(char *path, long megabytes) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror("parse");
+    return 1;
+  }
+  char pad[151];
+  memset(pad, 'x', 150);
+  pad[150] = '\0';
+  for (long row = 0; ftell(f) < megabytes * 1000000; row++) {
+    fprintf(f, "(def {d%ld} {%ld \"%s%ld\" (+ %ld 1)}) ; %s row %ld\n", row,
+            row, pad, row, row, pad, row);
+  }
+  fclose(f);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 4 && strcmp(argv[1], "-g") == 0) {
+    return generate(argv[3], atol(argv[2]));
+  }
+  if (argc < 2) {
+    fputs("usage: parse -g megabytes file\n       parse file [file ...]\n",
+          stderr);
+    return 1;
+  }
+
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *String = mpc_new("string");
+  mpc_parser_t *Comment = mpc_new("comment");
+  mpc_parser_t *Sexpr = mpc_new("sexpr");
+  mpc_parser_t *Qexpr = mpc_new("qexpr");
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *Lispy = mpc_new("lispy");
+
+  // The grammar from linterp_new.
+  mpca_lang(MPCA_LANG_DEFAULT, "\
+				number: /-?[0-9]+/;\
+				symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;\
+				string: /\"(\\\\.|[^\"])*\"/ ;\
+        comment: /;[^\\r\\n]*/;\
+				sexpr: '(' <expr>* ')';\
+				qexpr: '{' <expr>* '}';\
+				expr: <number> | <symbol> | <sexpr> | \
+              <qexpr> | <string> | <comment>;\
+				lispy: /^/ <expr>+ /$/;\
+			",
+            Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+
+  int failed = 0;
+  for (int i = 1; i < argc; i++) {
+    struct stat st;
+    if (stat(argv[i], &st) != 0) {
+      perror(argv[i]);
+      failed = 1;
+      continue;
+    }
+    mpc_result_t r;
+    double start = now();
+    if (!mpc_parse_contents(argv[i], Lispy, &r)) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      failed = 1;
+      continue;
+    }
+    double elapsed = now() - start;
+    mpc_ast_delete(r.output);
+    printf("%s: %.1f MB in %.3fs, %.1f MB/s\n", argv[i], st.st_size / 1e6,
+           elapsed, st.st_size / 1e6 / elapsed);
+
+    FILE *f = fopen(argv[i], "r");
+    start = now();
+    if (!mpc_parse_pipe(argv[i], f, Lispy, &r)) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      fclose(f);
+      failed = 1;
+      continue;
+    }
+    elapsed = now() - start;
+    fclose(f);
+    mpc_ast_delete(r.output);
+    printf("%s as a pipe: %.3fs, %.1f MB/s\n", argv[i], elapsed,
+           st.st_size / 1e6 / elapsed);
+  }
+
+  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  return failed;
+}
@@ -0,0 +1,55 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lispy.h"
+
+/**
+ * Throughput of 1, 2, 4 and 8 threads that each run their own interpreter,
+ * which share nothing, so it should grow with the thread count up to the
+ * number of CPUs.
+ *
+ * threads [runs per thread]
+ */
+
+int runs;
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void *run(void *arg) {
+  (void)arg;
+  linterp *interp = linterp_new();
+  lval_del(linterp_eval(interp, "def {fib} (\\ {n} {if (< n 2) {n} "
+                                "{+ (fib (- n 1)) (fib (- n 2))}})"));
+  for (int i = 0; i < runs; i++) {
+    lval_del(linterp_eval(interp, "fib 18"));
+  }
+  linterp_del(interp);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  runs = argc > 1 ? atoi(argv[1]) : 50;
+  double single = 0;
+  for (int n = 1; n <= 8; n *= 2) {
+    pthread_t threads[8];
+    double start = now();
+    for (int i = 0; i < n; i++) {
+      pthread_create(&threads[i], NULL, run, NULL);
+    }
+    for (int i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    double rate = n * runs / (now() - start);
+    if (n == 1) {
+      single = rate;
+    }
+    printf("%d threads: %.1f runs/s, %.2fx\n", n, rate, rate / single);
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "mpc.h"
+
+/**
+ * Tokenizing speed of the lispy token regexes, in MB/s. Each token is only
+ * counted, so this measures mpc_re matching rather than building an AST.
+ * Make a large file to read with parse -g.
+ *
+ * tokens file [file ...]
+ */
+
+long count;
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+mpc_val_t *counted(mpc_val_t *x) {
+  free(x);
+  count++;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fputs("usage: tokens file [file ...]\n", stderr);
+    return 1;
+  }
+
+  // The token regexes from the grammar in linterp_new.
+  mpc_parser_t *token = mpc_apply(
+      mpc_tok(mpc_or(8, mpc_re("-?[0-9]+"),
+                     mpc_re("[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+"),
+                     mpc_re("\"(\\\\.|[^\"])*\""), mpc_re(";[^\\r\\n]*"),
+                     mpc_char('('), mpc_char(')'), mpc_char('{'),
+                     mpc_char('}'))),
+      counted);
+  mpc_parser_t *tokens =
+      mpc_whole(mpc_many(mpcf_all_free, token), mpcf_dtor_null);
+
+  int failed = 0;
+  for (int i = 1; i < argc; i++) {
+    struct stat st;
+    if (stat(argv[i], &st) != 0) {
+      perror(argv[i]);
+      failed = 1;
+      continue;
+    }
+    mpc_result_t r;
+    count = 0;
+    double start = now();
+    if (!mpc_parse_contents(argv[i], tokens, &r)) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      failed = 1;
+      continue;
+    }
+    double elapsed = now() - start;
+    printf("%s: %ld tokens in %.3fs, %.1f MB/s\n", argv[i], count, elapsed,
+           st.st_size / 1e6 / elapsed);
+  }
+
+  mpc_delete(tokens);
+  return failed;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+
+#include "lispy.h"
+
+// A builtin written by the host, (clamp x lo hi).
+lval *builtin_clamp(lenv *e, lval *a) {
+  (void)e;
+  LASSERT_NUM("clamp", a, 3);
+  for (int i = 0; i < 3; i++) {
+    LASSERT_TYPE("clamp", a, i, LVAL_NUM);
+  }
+
+  long x = lval_num_of(a->cell[0]);
+  long lo = lval_num_of(a->cell[1]);
+  long hi = lval_num_of(a->cell[2]);
+  lval_del(a);
+
+  return lval_num(x < lo ? lo : x > hi ? hi : x);
+}
+
+int main(void) {
+  linterp *interp = linterp_new();
+  linterp_add_builtin(interp, "clamp", builtin_clamp);
+
+  char *inputs[] = {
+      "def {sq} (\\ {x} {* x x})",
+      "clamp (sq 12) 0 100",
+      "map sq {1 2 3}",
+      "\"hello\"",
+      "clamp 1 2",
+  };
+
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    lval *x = linterp_eval(interp, inputs[i]);
+
+    switch (lval_type(x)) {
+    case LVAL_NUM:
+      printf("number: %ld\n", lval_num_of(x));
+      break;
+    case LVAL_STR:
+      printf("string: %s\n", lval_str_of(x));
+      break;
+    case LVAL_ERR:
+      printf("error: %s\n", lval_err_of(x));
+      break;
+    default:
+      printf("%s: ", ltype_name(lval_type(x)));
+      lval_println(x);
+    }
+
+    lval_del(x);
+  }
+
+  linterp_del(interp);
+  return 0;
+}
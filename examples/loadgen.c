@@ -0,0 +1,130 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Load generator for "lispy --serve". Opens a number of connections to the
+ * socket, sends the same request over each until the total is reached and
+ * reports requests per second and the p50 and p99 latency.
+ *
+ * loadgen path connections requests [code]
+ */
+
+typedef struct {
+  char *path;
+  char *code;
+  int requests;
+  double *latency;
+  int first;
+} lclient;
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int io(int fd, char *buf, size_t len, int writing) {
+  while (len > 0) {
+    ssize_t n = writing ? write(fd, buf, len) : read(fd, buf, len);
+    if (n <= 0) {
+      return 0;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+void *client(void *arg) {
+  lclient *c = arg;
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, c->path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("loadgen");
+    exit(1);
+  }
+
+  size_t len = strlen(c->code);
+  unsigned char hdr[4] = {len >> 24, len >> 16, len >> 8, len};
+  unsigned char rhdr[4];
+  char *reply = NULL;
+  for (int i = 0; i < c->requests; i++) {
+    double start = now();
+    if (!io(fd, (char *)hdr, 4, 1) || !io(fd, c->code, len, 1) ||
+        !io(fd, (char *)rhdr, 4, 0)) {
+      fputs("loadgen: connection closed\n", stderr);
+      exit(1);
+    }
+    uint32_t n =
+        (uint32_t)rhdr[0] << 24 | rhdr[1] << 16 | rhdr[2] << 8 | rhdr[3];
+    reply = realloc(reply, n + 1);
+    if (!io(fd, reply, n, 0)) {
+      fputs("loadgen: connection closed\n", stderr);
+      exit(1);
+    }
+    c->latency[i] = now() - start;
+
+    // Show one reply so a broken request is not mistaken for a fast one.
+    if (i == 0 && c->first) {
+      reply[n] = '\0';
+      printf("reply: %s\n", reply);
+    }
+  }
+  free(reply);
+  close(fd);
+  return NULL;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(double *)a, y = *(double *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    fputs("usage: loadgen path connections requests [code]\n", stderr);
+    return 1;
+  }
+  int conns = atoi(argv[2]);
+  int per_conn = atoi(argv[3]) / (conns > 0 ? conns : 1);
+  char *code = argc > 4 ? argv[4] : "+ 1 2";
+  if (conns < 1 || per_conn < 1) {
+    fputs("loadgen: need at least one request per connection\n", stderr);
+    return 1;
+  }
+
+  int total = conns * per_conn;
+  double *latency = malloc(sizeof(double) * total);
+  lclient *clients = malloc(sizeof(lclient) * conns);
+  pthread_t *threads = malloc(sizeof(pthread_t) * conns);
+
+  double start = now();
+  for (int i = 0; i < conns; i++) {
+    clients[i] = (lclient){argv[1], code, per_conn,
+                          latency + i * per_conn, i == 0};
+    pthread_create(&threads[i], NULL, client, &clients[i]);
+  }
+  for (int i = 0; i < conns; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now() - start;
+
+  qsort(latency, total, sizeof(double), cmp_double);
+  printf("%d requests over %d connections in %.3fs\n", total, conns, elapsed);
+  printf("%.0f requests/s p50 %.1fus p99 %.1fus\n", total / elapsed,
+         latency[total / 2] * 1e6, latency[total * 99 / 100] * 1e6);
+
+  free(latency);
+  free(clients);
+  free(threads);
+  return 0;
+}
@@ -0,0 +1,5176 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lispy.h"
+#include "mpc.h"
+
+char *ltype_name(int t) {
+  switch (t) {
+  case LVAL_NUM:
+    return "Number";
+  case LVAL_STR:
+    return "String";
+  case LVAL_ERR:
+    return "Error";
+  case LVAL_SYM:
+    return "Symbol";
+  case LVAL_FUN:
+    return "Function";
+  case LVAL_SEXPR:
+    return "S-Expression";
+  case LVAL_QEXPR:
+    return "Q-Expression";
+  case LVAL_FUT:
+    return "Future";
+  default:
+    return "Unknown";
+  }
+}
+struct lenv {
+  lenv *parent;
+  int count;
+  int capacity;            // Allocated length of syms, vals and hashes.
+  char **syms;             // Bound names, in the order they were bound.
+  lval **vals;             // Bound values, vals[i] is bound to syms[i].
+  unsigned long *hashes;   // hashes[i] is the hash of syms[i].
+  int table_size;          // Number of slots in table, a power of 2.
+  int *table;              // Open addressing index into syms, -1 if empty.
+  int borrowed;            // Whether syms, vals and hashes belong to the
+                           // caller, see lvm_frame_call.
+};
+
+/**
+ * The array holding the children of S-expressions and Q-expressions. head
+ * and tail return slices that share the array with the list they came from
+ * rather than copying it, so it may be used by several lvals. Like an lval,
+ * it must not be changed while shared, see lval_own_cells.
+ */
+struct lcells {
+  int refs;     // The number of lvals using the array.
+  int capacity; // The length of items.
+  int shared;   // Whether start and end are set, see lval_slice.
+  int start;    // While shared items[start..end) are the children held.
+  int end;      // Otherwise they are the children of the one lval.
+  lval *items[];
+};
+
+/**
+ * Bytecode compiled from the body of a lambda, see lcode_compile. It is
+ * cached on the body so each body is only compiled once.
+ */
+struct lcode {
+  int *ops; // Instructions, each followed by its operands.
+  int count;
+  int capacity;
+  lval **consts; // Literals and symbols used by the instructions.
+  int const_count;
+  int max_stack; // The deepest the value stack gets.
+  int depth;     // The depth of the value stack while compiling.
+};
+
+/**
+ * An expression being evaluated by future. It is shared by the futures
+ * for it and, until it is taken to run, the deque it waits in.
+ */
+struct ltask {
+  int refs;     // The number of owners, it is freed when it drops to 0.
+  int done;     // Set once result holds the value.
+  lenv *env;    // The bindings of the caller, see ltask_env.
+  lval *expr;   // The S-expression to evaluate.
+  lval *result; // The value of expr.
+  linterp *interp; // The interpreter that started it.
+};
+
+// DECLARATIONS
+lval *lval_fun(lbuiltin func);
+lval *lval_fut(ltask *task);
+lval *lval_sym(char *name);
+lval *lval_unshare(lval *v);
+lval *lval_read(mpc_ast_t *t);
+int lval_front(lval *v);
+void lval_reserve(lval *v, int capacity);
+void lval_own_cells(lval *v);
+void lval_release_cells(lcells *c, lval *v);
+lval *lval_slice(lval *v, int i, int n);
+lval *builtin_op(lenv *env, lval *a, char *op);
+lval *lval_eval(lenv *env, lval *v);
+lval *lval_call(lenv *env, lval *function, lval *args);
+lval *lval_bind(lenv *env, lval *function, lval *args);
+lval *lval_frame(lval *function, lval *args);
+lval *lval_apply(lenv *env, lval *v);
+void lval_free_buffers(lval *v);
+void lval_forget_code(lval *v);
+void lcode_del(lcode *c);
+void lenv_free_buffers(lenv *e);
+void lenv_reserve(lenv *env, int capacity);
+void lenv_own(lenv *env);
+lcode *lcode_compile(lval *body, lval *formals);
+lcode *lcode_of(lval *body, lval *formals);
+lval *lvm_run(lenv *env, lcode *c, lval **next);
+void ltask_del(ltask *t);
+void ltasks_settle(void);
+
+lval *builtin_load(lenv *env, lval *a);
+lval *builtin_lambda(lenv *e, lval *v);
+lval *builtin_join(lenv *env, lval *a);
+lval *builtin_head(lenv *env, lval *a);
+lval *builtin_tail(lenv *env, lval *a);
+lval *builtin_eval(lenv *env, lval *a);
+lval *builtin_if_branch(lval *a);
+lval *builtin_eval_expr(lval *a);
+lval *builtin_list(lenv *env, lval *a);
+lval *builtin_map(lenv *env, lval *a);
+lval *builtin_pmap(lenv *env, lval *a);
+lval *builtin_future(lenv *env, lval *a);
+lval *builtin_await(lenv *env, lval *a);
+lval *builtin_filter(lenv *env, lval *a);
+lval *builtin_foldl(lenv *env, lval *a);
+lval *builtin_len(lenv *env, lval *a);
+lval *builtin_nth(lenv *env, lval *a);
+lval *builtin_reverse(lenv *env, lval *a);
+lval *builtin_neq(lenv *env, lval *a);
+lval *builtin_eq(lenv *env, lval *a);
+lval *builtin_if(lenv *env, lval *a);
+lval *builtin_print(lenv *env, lval *args);
+lval *builtin_error(lenv *env, lval *args);
+lval *builtin_allocs(lenv *env, lval *args);
+lval *builtin_mem_stats(lenv *env, lval *args);
+lval *builtin_save_image(lenv *env, lval *a);
+#ifdef LISPY_GC
+lval *builtin_gc_stats(lenv *env, lval *args);
+#endif
+
+int limage_owns(void *p);
+lval *limage_load(char *filename);
+#ifdef LISPY_GC
+void limage_mark(void);
+void linterp_mark_saved(void);
+#endif
+
+lval *builtin_var(lenv *env, lval *a, char *func);
+lval *builtin_def(lenv *env, lval *a);
+lval *builtin_put(lenv *env, lval *a);
+
+lval *builtin_mul(lenv *env, lval *a);
+lval *builtin_sub(lenv *env, lval *a);
+lval *builtin_add(lenv *env, lval *a);
+lval *builtin_div(lenv *env, lval *a);
+
+lval *builtin_ge(lenv *env, lval *a);
+lval *builtin_gt(lenv *env, lval *a);
+lval *builtin_le(lenv *env, lval *a);
+lval *builtin_lt(lenv *env, lval *a);
+
+// THREADS
+
+// Non-zero while the workers of pmap or future may be running, it counts
+// the pmap calls running and the pool of future once started. Counters
+// that threads share, such as reference counts, are only updated
+// atomically while it is set.
+int lthreads_active = 0;
+
+// Set in the worker threads of pmap, and while running a future.
+__thread int lthread_worker = 0;
+
+// Add n to x, atomically while lthreads_active is set, and give the result.
+#define LATOMIC_ADD(x, n)                                                      \
+  (__atomic_load_n(&lthreads_active, __ATOMIC_RELAXED)                         \
+       ? __atomic_add_fetch(&(x), (n), __ATOMIC_ACQ_REL)                       \
+       : ((x) += (n)))
+
+// ALLOCATION
+
+// The number of heap allocations made by the current thread, reported by
+// the allocs builtin.
+__thread long lalloc_count = 0;
+
+void *lmalloc(size_t size) {
+  lalloc_count++;
+  return malloc(size);
+}
+
+void *lrealloc(void *p, size_t size) {
+  lalloc_count++;
+  return realloc(p, size);
+}
+
+/**
+ * lval and lenv objects come from per-type pools. Each pool hands out
+ * fixed size objects carved from slabs of LSLAB_BYTES and keeps freed
+ * objects on a free list for reuse. Slabs are never returned to the
+ * system. Build with -DLISPY_MALLOC to use plain malloc/free instead,
+ * e.g. for AddressSanitizer runs.
+ *
+ * Each thread has its own pools, so the workers of pmap do not contend
+ * for them. An object may be freed by a thread other than the one that
+ * allocated it, it then goes on that thread's free list.
+ *
+ * With -DLISPY_GC slabs are aligned to LSLAB_BYTES and their header holds
+ * a state byte for each object, which the collector uses to find and mark
+ * every object. That needs the slabs so it cannot be combined with
+ * -DLISPY_MALLOC.
+ */
+#if defined(LISPY_GC) && defined(LISPY_MALLOC)
+#error "LISPY_GC needs the slab allocator, build without LISPY_MALLOC"
+#endif
+
+#define LSLAB_BYTES 16384
+
+typedef struct lslab {
+  struct lslab *next;
+#ifdef LISPY_GC
+  // One of LGC_FREE, LGC_LIVE or LGC_MARKED for each object.
+  unsigned char state[];
+#endif
+  // Objects follow the header.
+} lslab;
+
+typedef struct {
+  char *name;
+  size_t size;      // Size of one object, at least sizeof(void *).
+  int per_slab;     // Objects per slab.
+  size_t offset;    // Offset of the first object from the start of a slab.
+  void *free_list;  // Freed objects, linked through their first word.
+  lslab *slabs;     // Every slab allocated for this pool.
+  int next_unused;  // Objects of the first slab never handed out yet.
+  long slab_count;
+  long live;        // Objects currently handed out.
+  long peak_live;
+} lpool;
+
+#ifdef LISPY_GC
+#define LPOOL_PER_SLAB(type)                                                   \
+  ((LSLAB_BYTES - sizeof(lslab) - 16) / (sizeof(type) + 1))
+#define LPOOL_OFFSET(type) ((sizeof(lslab) + LPOOL_PER_SLAB(type) + 15) & ~15)
+#else
+#define LPOOL_PER_SLAB(type) ((LSLAB_BYTES - sizeof(lslab)) / sizeof(type))
+#define LPOOL_OFFSET(type) sizeof(lslab)
+#endif
+
+#define LPOOL(name, type)                                                      \
+  { name, sizeof(type), LPOOL_PER_SLAB(type), LPOOL_OFFSET(type),              \
+    NULL, NULL, 0, 0, 0, 0 }
+
+__thread lpool lval_pool = LPOOL("lval", lval);
+__thread lpool lenv_pool = LPOOL("lenv", lenv);
+
+// Total bytes held by the current thread's pools and its high water mark.
+__thread long lpool_bytes = 0;
+__thread long lpool_peak_bytes = 0;
+
+enum { LGC_FREE, LGC_LIVE, LGC_MARKED };
+
+#ifdef LISPY_GC
+unsigned char *lpool_state(lpool *p, void *obj) {
+  /**
+   * Get the state byte of an object from a pool.
+   *
+   * lpool* p: The pool obj came from.
+   * void* obj: The object.
+   */
+  lslab *slab = (lslab *)((uintptr_t)obj & ~(uintptr_t)(LSLAB_BYTES - 1));
+  return &slab->state[((char *)obj - (char *)slab - p->offset) / p->size];
+}
+#endif
+
+void *lpool_alloc(lpool *p) {
+  /**
+   * Get an object from a pool.
+   *
+   * lpool* p: The pool.
+   * Returns:
+   * void*: Uninitialised memory of p->size bytes.
+   */
+  p->live++;
+  if (p->live > p->peak_live) {
+    p->peak_live = p->live;
+  }
+#ifdef LISPY_MALLOC
+  lpool_bytes += p->size;
+  if (lpool_bytes > lpool_peak_bytes) {
+    lpool_peak_bytes = lpool_bytes;
+  }
+  return lmalloc(p->size);
+#else
+  void *obj;
+  // Reuse a freed object if there is one.
+  if (p->free_list) {
+    obj = p->free_list;
+    p->free_list = *(void **)obj;
+  } else {
+    // Otherwise carve one out of the newest slab, adding a slab if full.
+    if (!p->slabs || p->next_unused == p->per_slab) {
+#ifdef LISPY_GC
+      lslab *slab = aligned_alloc(LSLAB_BYTES, LSLAB_BYTES);
+      lalloc_count++;
+      memset(slab->state, LGC_FREE, p->per_slab);
+#else
+      lslab *slab = lmalloc(p->offset + p->size * p->per_slab);
+#endif
+      slab->next = p->slabs;
+      p->slabs = slab;
+      p->next_unused = 0;
+      p->slab_count++;
+      lpool_bytes += p->offset + p->size * p->per_slab;
+      if (lpool_bytes > lpool_peak_bytes) {
+        lpool_peak_bytes = lpool_bytes;
+      }
+    }
+    obj = (char *)p->slabs + p->offset + p->size * p->next_unused++;
+  }
+#ifdef LISPY_GC
+  *lpool_state(p, obj) = LGC_LIVE;
+#endif
+  return obj;
+#endif
+}
+
+void lpool_free(lpool *p, void *obj) {
+  /**
+   * Return an object to the pool it came from.
+   *
+   * lpool* p: The pool.
+   * void* obj: An object from lpool_alloc(p).
+   */
+  p->live--;
+#ifdef LISPY_MALLOC
+  lpool_bytes -= p->size;
+  free(obj);
+#else
+#ifdef LISPY_GC
+  *lpool_state(p, obj) = LGC_FREE;
+#endif
+  *(void **)obj = p->free_list;
+  p->free_list = obj;
+#endif
+}
+
+void lpool_print_stats(lpool *p) {
+  printf("%-5s live %ld peak %ld", p->name, p->live, p->peak_live);
+#ifndef LISPY_MALLOC
+  long capacity = p->slab_count * p->per_slab;
+  printf(" slabs %ld occupancy %ld/%ld (%.1f%%)", p->slab_count, p->live,
+         capacity, capacity ? 100.0 * p->live / capacity : 0.0);
+#endif
+  putchar('\n');
+}
+
+void lmem_print_stats(void) {
+  /**
+   * Print how much memory the interpreter is using: live objects and slab
+   * occupancy for each pool, and the current and peak bytes held by them.
+   * The pools are those of the calling thread.
+   */
+  lpool_print_stats(&lval_pool);
+  lpool_print_stats(&lenv_pool);
+  printf("bytes %ld peak %ld allocs %ld\n", lpool_bytes, lpool_peak_bytes,
+         lalloc_count);
+}
+
+// GARBAGE COLLECTION
+
+#ifdef LISPY_GC
+/**
+ * With -DLISPY_GC lvals and lenvs are freed by a mark and sweep collector
+ * instead of reference counting. lval_del and lenv_del do nothing and
+ * lval_copy only flags the lval as shared, so lval_unshare still copies
+ * before anything modifies it in place.
+ *
+ * The roots are the root stacks below. linterp_enter pushes the global
+ * env, and
+ * code that holds lvals or lenvs across a call to lval_eval pushes them
+ * too. lval_eval is the only place a collection can start, and it roots
+ * its own arguments first. Any lval or lenv only held in a C local at
+ * that point would be freed.
+ */
+#define LGC_MAX_ROOTS 65536
+
+// The heap is never collected with fewer live objects than this.
+#ifndef LGC_MIN_HEAP
+#define LGC_MIN_HEAP 4096
+#endif
+
+// Like the pools, the collector's state is per thread and a collection only
+// frees objects from the current thread's pools. The global enviroment of
+// an interpreter is only a root while it is entered, see linterp_enter, so
+// a thread must not switch between interpreters. The root stacks are
+// allocated with LGC_MAX_ROOTS entries on first use.
+
+// Addresses of lval* variables that hold roots.
+__thread lval ***lgc_roots = NULL;
+__thread int lgc_root_count = 0;
+
+// lenvs that are roots.
+__thread lenv **lgc_env_roots = NULL;
+__thread int lgc_env_root_count = 0;
+
+// Arrays of lval* that are roots, such as the value stacks of lvm_run.
+// lgc_range_tops[i] points at the number of lvals in lgc_ranges[i].
+__thread lval ***lgc_ranges = NULL;
+__thread int **lgc_range_tops = NULL;
+__thread int lgc_range_count = 0;
+
+// Collect once this many objects are live.
+__thread long lgc_threshold = LGC_MIN_HEAP;
+
+__thread struct {
+  long collections;
+  long freed;       // Objects freed by the last collection.
+  double last_ms;   // Pause of the last collection.
+  double max_ms;    // Longest pause.
+  double total_ms;  // Sum of all pauses.
+} lgc_stats = {0, 0, 0, 0, 0};
+
+// Stack of lvals waiting to have their children marked.
+__thread lval **lgc_mark_stack = NULL;
+__thread int lgc_mark_count = 0;
+__thread int lgc_mark_size = 0;
+
+void lgc_push_root(lval **v) {
+  if (!lgc_roots) {
+    lgc_roots = malloc(sizeof(lval **) * LGC_MAX_ROOTS);
+  }
+  if (lgc_root_count == LGC_MAX_ROOTS) {
+    fputs("lispy: too many gc roots\n", stderr);
+    abort();
+  }
+  lgc_roots[lgc_root_count++] = v;
+}
+
+void lgc_push_env_root(lenv *e) {
+  if (!lgc_env_roots) {
+    lgc_env_roots = malloc(sizeof(lenv *) * LGC_MAX_ROOTS);
+  }
+  if (lgc_env_root_count == LGC_MAX_ROOTS) {
+    fputs("lispy: too many gc roots\n", stderr);
+    abort();
+  }
+  lgc_env_roots[lgc_env_root_count++] = e;
+}
+
+void lgc_push_range(lval **base, int *top) {
+  if (!lgc_ranges) {
+    lgc_ranges = malloc(sizeof(lval **) * LGC_MAX_ROOTS);
+    lgc_range_tops = malloc(sizeof(int *) * LGC_MAX_ROOTS);
+  }
+  if (lgc_range_count == LGC_MAX_ROOTS) {
+    fputs("lispy: too many gc roots\n", stderr);
+    abort();
+  }
+  lgc_ranges[lgc_range_count] = base;
+  lgc_range_tops[lgc_range_count++] = top;
+}
+
+void lgc_mark(lval *v) {
+  /**
+   * Queue an lval to be marked.
+   */
+  // Objects in an image are never freed, and only hold others in it.
+  if (!v || lval_is_fixnum(v) || limage_owns(v)) {
+    return;
+  }
+  unsigned char *state = lpool_state(&lval_pool, v);
+  if (*state == LGC_MARKED) {
+    return;
+  }
+  *state = LGC_MARKED;
+  if (lgc_mark_count == lgc_mark_size) {
+    lgc_mark_size = lgc_mark_size ? lgc_mark_size * 2 : 1024;
+    lgc_mark_stack = realloc(lgc_mark_stack, sizeof(lval *) * lgc_mark_size);
+  }
+  lgc_mark_stack[lgc_mark_count++] = v;
+}
+
+void lgc_mark_env(lenv *e) {
+  /**
+   * Mark an lenv, its values and its parents.
+   */
+  for (; e && !limage_owns(e); e = e->parent) {
+    unsigned char *state = lpool_state(&lenv_pool, e);
+    if (*state == LGC_MARKED) {
+      return;
+    }
+    *state = LGC_MARKED;
+    for (int i = 0; i < e->count; i++) {
+      lgc_mark(e->vals[i]);
+    }
+  }
+}
+
+void lgc_sweep(lpool *p, int is_lval) {
+  /**
+   * Free every object in a pool that was not marked and unmark the rest.
+   */
+  for (lslab *slab = p->slabs; slab; slab = slab->next) {
+    // Only the newest slab can be partly unused.
+    int used = slab == p->slabs ? p->next_unused : p->per_slab;
+    for (int i = 0; i < used; i++) {
+      if (slab->state[i] == LGC_MARKED) {
+        slab->state[i] = LGC_LIVE;
+      } else if (slab->state[i] == LGC_LIVE) {
+        void *obj = (char *)slab + p->offset + p->size * i;
+        if (is_lval) {
+          lval_free_buffers(obj);
+        } else {
+          lenv_free_buffers(obj);
+        }
+        lpool_free(p, obj);
+        lgc_stats.freed++;
+      }
+    }
+  }
+}
+
+void lgc_collect(void) {
+  /**
+   * Free every lval and lenv that can't be reached from the roots.
+   */
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  lgc_stats.freed = 0;
+
+  for (int i = 0; i < lgc_env_root_count; i++) {
+    lgc_mark_env(lgc_env_roots[i]);
+  }
+  for (int i = 0; i < lgc_root_count; i++) {
+    lgc_mark(*lgc_roots[i]);
+  }
+  for (int i = 0; i < lgc_range_count; i++) {
+    for (int j = 0; j < *lgc_range_tops[i]; j++) {
+      lgc_mark(lgc_ranges[i][j]);
+    }
+  }
+  limage_mark();
+  linterp_mark_saved();
+  while (lgc_mark_count) {
+    lval *v = lgc_mark_stack[--lgc_mark_count];
+    switch (v->type) {
+    case LVAL_FUN:
+      if (!v->builtin) {
+        lgc_mark_env(v->env);
+        lgc_mark(v->formals);
+        lgc_mark(v->body);
+      }
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) {
+        lgc_mark(v->cell[i]);
+      }
+      if (v->code) {
+        for (int i = 0; i < v->code->const_count; i++) {
+          lgc_mark(v->code->consts[i]);
+        }
+      }
+      break;
+    case LVAL_FUT:
+      lgc_mark(v->task->result);
+      break;
+    }
+  }
+
+  lgc_sweep(&lval_pool, 1);
+  lgc_sweep(&lenv_pool, 0);
+
+  // Let the heap grow to twice what survived before collecting again.
+  long live = lval_pool.live + lenv_pool.live;
+  lgc_threshold = live * 2 > LGC_MIN_HEAP ? live * 2 : LGC_MIN_HEAP;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ms = (end.tv_sec - start.tv_sec) * 1e3 +
+              (end.tv_nsec - start.tv_nsec) / 1e6;
+  lgc_stats.collections++;
+  lgc_stats.last_ms = ms;
+  lgc_stats.total_ms += ms;
+  if (ms > lgc_stats.max_ms) {
+    lgc_stats.max_ms = ms;
+  }
+}
+
+#define LGC_ROOT(v) lgc_push_root(&(v))
+#define LGC_ROOT_ENV(e) lgc_push_env_root(e)
+#define LGC_UNROOT(n) (lgc_root_count -= (n))
+#define LGC_UNROOT_ENV(n) (lgc_env_root_count -= (n))
+#define LGC_ROOT_RANGE(base, top) lgc_push_range(base, &(top))
+#define LGC_UNROOT_RANGE(n) (lgc_range_count -= (n))
+#else
+#define LGC_ROOT(v)
+#define LGC_ROOT_ENV(e)
+#define LGC_UNROOT(n)
+#define LGC_UNROOT_ENV(n)
+#define LGC_ROOT_RANGE(base, top)
+#define LGC_UNROOT_RANGE(n)
+#endif
+
+// SYMBOLS
+
+unsigned long lsym_hash(char *s) {
+  /**
+   * Hash a symbol name (FNV-1a).
+   *
+   * char* s: The name to hash.
+   * Returns:
+   * unsigned long: The hash.
+   */
+  unsigned long h = 14695981039346656037UL;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+/**
+ * An interned name. lsym_intern returns the name and lsym_of gets the lsym
+ * back from it.
+ */
+typedef struct limage limage;
+
+typedef struct {
+  int shadows;  // Bindings of the name in enviroments other than the global.
+  int global;   // Index of the binding in the global enviroment, or -1.
+  int orphaned; // Set once its interpreter is deleted, see linterp_del.
+  char name[];
+} lsym;
+
+static inline lsym *lsym_of(char *name) {
+  return (lsym *)(name - offsetof(lsym, name));
+}
+
+/**
+ * An interpreter: its grammar, its global enviroment and the names its code
+ * has interned. Nothing mutable is shared between interpreters, so several
+ * can run side by side, each on its own thread. The objects they use come
+ * from the pools of whichever thread allocates them, see lpool.
+ *
+ * The evaluator finds the interpreter it is running through linterp_self,
+ * which linterp_enter sets for the current thread.
+ */
+struct linterp {
+  mpc_parser_t *Number;
+  mpc_parser_t *Symbol;
+  mpc_parser_t *String;
+  mpc_parser_t *Comment;
+  mpc_parser_t *Sexpr;
+  mpc_parser_t *Qexpr;
+  mpc_parser_t *Expr;
+  mpc_parser_t *Lispy;
+
+  lenv *env; // The global enviroment, where def binds.
+
+  // The table of interned symbol names. Each distinct name is stored exactly
+  // once so symbols can be compared by pointer rather than with strcmp.
+  struct {
+    int count;
+    int size;              // Number of slots, a power of 2.
+    char **names;          // NULL if the slot is empty.
+    unsigned long *hashes; // hashes[i] is the hash of names[i].
+  } syms;
+  // Held while using syms, as the workers of pmap and future may intern
+  // names.
+  pthread_mutex_t sym_lock;
+
+  char *ampersand; // The interned "&" used to mark variable arguments.
+  char *sym_if;    // The interned "if", which lcode_compile compiles inline.
+
+  int futures; // Futures started by its code that have not finished.
+
+  limage *images; // Heap images mapped by linterp_load_image.
+
+  // The values of the global enviroment when linterp_snapshot was called,
+  // which linterp_restore goes back to.
+  lval **saved;
+  int saved_count;
+};
+
+// The interpreter the current thread is running.
+__thread linterp *linterp_self = NULL;
+
+linterp *linterp_enter(linterp *interp) {
+  /**
+   * Make interp the interpreter the current thread is running, until
+   * linterp_leave. Calls may nest, as when a thread waiting for a future
+   * runs one started by another interpreter.
+   *
+   * linterp* interp: The interpreter.
+   * Returns:
+   * linterp*: The interpreter to give back to linterp_leave.
+   */
+  linterp *outer = linterp_self;
+  linterp_self = interp;
+  LGC_ROOT_ENV(interp->env);
+  return outer;
+}
+
+void linterp_leave(linterp *outer) {
+  /**
+   * Go back to the interpreter that was running before linterp_enter.
+   */
+  LGC_UNROOT_ENV(1);
+  linterp_self = outer;
+}
+
+char *lsym_intern(char *s, unsigned long hash) {
+  /**
+   * Get the interned copy of a symbol name, adding it if it is new.
+   * The returned string is owned by the interpreter and must not be freed.
+   *
+   * char* s: The name.
+   * unsigned long hash: lsym_hash(s).
+   * Returns:
+   * char*: The interned name.
+   */
+  linterp *interp = linterp_self;
+  pthread_mutex_lock(&interp->sym_lock);
+  if ((interp->syms.count + 1) * 2 > interp->syms.size) {
+    int old_size = interp->syms.size;
+    char **old_names = interp->syms.names;
+    unsigned long *old_hashes = interp->syms.hashes;
+
+    interp->syms.size = old_size ? old_size * 2 : 256;
+    interp->syms.names = lmalloc(sizeof(char *) * interp->syms.size);
+    interp->syms.hashes = lmalloc(sizeof(unsigned long) * interp->syms.size);
+    memset(interp->syms.names, 0, sizeof(char *) * interp->syms.size);
+    for (int i = 0; i < old_size; i++) {
+      if (old_names[i]) {
+        int slot = old_hashes[i] & (interp->syms.size - 1);
+        while (interp->syms.names[slot]) {
+          slot = (slot + 1) & (interp->syms.size - 1);
+        }
+        interp->syms.names[slot] = old_names[i];
+        interp->syms.hashes[slot] = old_hashes[i];
+      }
+    }
+    free(old_names);
+    free(old_hashes);
+  }
+
+  int mask = interp->syms.size - 1;
+  int slot = hash & mask;
+  for (; interp->syms.names[slot]; slot = (slot + 1) & mask) {
+    if (interp->syms.hashes[slot] == hash &&
+        strcmp(interp->syms.names[slot], s) == 0) {
+      pthread_mutex_unlock(&interp->sym_lock);
+      return interp->syms.names[slot];
+    }
+  }
+
+  lsym *sym = lmalloc(sizeof(lsym) + strlen(s) + 1);
+  sym->shadows = 0;
+  sym->global = -1;
+  sym->orphaned = 0;
+  strcpy(sym->name, s);
+  interp->syms.names[slot] = sym->name;
+  interp->syms.hashes[slot] = hash;
+  interp->syms.count++;
+  pthread_mutex_unlock(&interp->sym_lock);
+  return sym->name;
+}
+
+char *lsym_ampersand(void) {
+  /**
+   * The interned "&" used to mark variable arguments in formals.
+   */
+  return linterp_self->ampersand;
+}
+
+char *lsym_if(void) {
+  /**
+   * The interned "if", which lcode_compile compiles inline.
+   */
+  return linterp_self->sym_if;
+}
+
+lenv *lenv_new(void) {
+  /**
+   * Create a new enviroment.
+   *
+   * returns:
+   * lenv* The new enviroment.
+   */
+  lenv *enviroment = lpool_alloc(&lenv_pool);
+  enviroment->parent = NULL;
+  enviroment->count = 0;
+  enviroment->capacity = 0;
+  enviroment->syms = NULL;
+  enviroment->vals = NULL;
+  enviroment->hashes = NULL;
+  enviroment->table_size = 0;
+  enviroment->table = NULL;
+  enviroment->borrowed = 0;
+  return enviroment;
+};
+
+void lenv_del(lenv *e) {
+  /**
+   * Deletes an lenv.
+   *
+   * lenv* e: the lenv to delete.
+   */
+#ifndef LISPY_GC
+  for (int i = 0; i < e->count; i++) {
+    lval_del(e->vals[i]);
+  }
+  lenv_free_buffers(e);
+  lpool_free(&lenv_pool, e);
+#endif
+}
+
+void lenv_free_buffers(lenv *e) {
+  /**
+   * Free the arrays owned by an lenv, but not the values in them.
+   */
+  // The host deletes values outside any interpreter, but never a global
+  // enviroment.
+  if (!linterp_self || e != linterp_self->env) {
+    for (int i = 0; i < e->count; i++) {
+      lsym *sym = lsym_of(e->syms[i]);
+      // The last binding of a name that outlived its interpreter frees it.
+      if (LATOMIC_ADD(sym->shadows, -1) == 0 && sym->orphaned) {
+        free(sym);
+      }
+    }
+  }
+  free(e->syms);
+  free(e->vals);
+  free(e->hashes);
+  free(e->table);
+}
+
+lenv *lenv_copy(lenv *env) {
+  /**
+   * Make a copy of an enviroment.
+   *
+   * lenv* env: The enviroment to copy.
+   * Returns:
+   * lenv*: a pointer to the copy.
+   */
+  lenv *new = lenv_new();
+  new->parent = env->parent;
+  new->count = env->count;
+  new->capacity = env->count;
+  new->syms = lmalloc(sizeof(char *) * new->count);
+  new->vals = lmalloc(sizeof(lval *) * new->count);
+  new->hashes = lmalloc(sizeof(unsigned long) * new->count);
+  for (int i = 0; i < new->count; i++) {
+    new->syms[i] = env->syms[i];
+    new->vals[i] = lval_copy(env->vals[i]);
+    new->hashes[i] = env->hashes[i];
+    LATOMIC_ADD(lsym_of(new->syms[i])->shadows, 1);
+  }
+  // The slots only hold indices so the table can be copied as is.
+  if (env->table_size) {
+    new->table_size = env->table_size;
+    new->table = lmalloc(sizeof(int) * new->table_size);
+    memcpy(new->table, env->table, sizeof(int) * new->table_size);
+  }
+  return new;
+}
+
+int lenv_find(lenv *env, lval *key) {
+  /**
+   * Find where a key is bound in a single enviroment, ignoring parents.
+   *
+   * lenv* env: The enviroment to search.
+   * lval* key: An lval* of type LVAL_SYM.
+   * Returns:
+   * int: The index into env->syms and env->vals or -1 if not bound.
+   */
+  if (env->count == 0) {
+    return -1;
+  }
+  // Frames made by lvm_frame_call have a few bindings and no table.
+  if (!env->table) {
+    for (int i = 0; i < env->count; i++) {
+      if (env->syms[i] == key->sym) {
+        return i;
+      }
+    }
+    return -1;
+  }
+  int mask = env->table_size - 1;
+  for (int slot = key->hash & mask; env->table[slot] != -1;
+       slot = (slot + 1) & mask) {
+    int i = env->table[slot];
+    if (env->syms[i] == key->sym) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void lenv_index(lenv *env, int i) {
+  /**
+   * Insert the binding at index i into the hash table, growing the table
+   * so it is never more than half full.
+   *
+   * lenv* env: The enviroment.
+   * int i: Index into env->syms of a binding not yet in the table.
+   */
+  if ((i + 1) * 2 > env->table_size) {
+    env->table_size = env->table_size ? env->table_size * 2 : 8;
+    env->table = lrealloc(env->table, sizeof(int) * env->table_size);
+    memset(env->table, -1, sizeof(int) * env->table_size);
+    // Re-insert all the earlier bindings.
+    for (int j = 0; j < i; j++) {
+      lenv_index(env, j);
+    }
+  }
+  int mask = env->table_size - 1;
+  int slot = env->hashes[i] & mask;
+  while (env->table[slot] != -1) {
+    slot = (slot + 1) & mask;
+  }
+  env->table[slot] = i;
+}
+
+lval *lenv_get(lenv *env, lval *key) {
+  /**
+   * Get the value bound to a key in an given enviroment.
+   *
+   * Names that no enviroment but the global one binds, which includes every
+   * builtin and function defined with def unless it is shadowed, are read
+   * straight from their slot in the global enviroment without searching the
+   * chain.
+   *
+   * lenv* env: The enviroment where to look for the value.
+   * lval* key: An lval* of type LVAL_SYM.
+   */
+  lsym *sym = lsym_of(key->sym);
+  // Other threads only change shadows by their own bindings, so a thread
+  // always sees the ones it made itself.
+  if (__atomic_load_n(&sym->shadows, __ATOMIC_RELAXED) == 0) {
+    if (sym->global != -1) {
+      return lval_copy(linterp_self->env->vals[sym->global]);
+    }
+    return lval_err("Unbound symbol! '%s'", key->sym);
+  }
+  for (; env; env = env->parent) {
+    int i = lenv_find(env, key);
+    if (i != -1) {
+      return lval_copy(env->vals[i]);
+    }
+  }
+  return lval_err("Unbound symbol! '%s'", key->sym);
+}
+
+int lenv_hidden(lenv *env, lenv *top) {
+  /**
+   * Whether every name bound in env is also bound in one of the enviroments
+   * from top down to env, so no lookup starting at top can reach env.
+   *
+   * lenv* env: An enviroment in the chain of parents of top.
+   * lenv* top: Where lookups start.
+   */
+  for (int i = 0; i < env->count; i++) {
+    lval key;
+    key.sym = env->syms[i];
+    key.hash = env->hashes[i];
+    lenv *e = top;
+    while (e != env && lenv_find(e, &key) == -1) {
+      e = e->parent;
+    }
+    if (e == env) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void lenv_put(lenv *env, lval *key, lval *value) {
+  /**
+   * Bound a new local variable.
+   * Copies the content so orignal memory can be freed.
+   *
+   * lenv* env: The enviroment to where variables are being stored.
+   * lval* key: The symbol, should be of type LVAL_SYM.
+   * lval* value: The value. Can be of any type?
+   */
+  if (env->borrowed) {
+    lenv_own(env);
+  }
+  int i = lenv_find(env, key);
+  // If key already in the enviroment.
+  if (i != -1) {
+    // Delete the value.
+    lval_del(env->vals[i]);
+    // Replace the value with a copy of the new value.
+    env->vals[i] = lval_copy(value);
+    return;
+  }
+
+  // Allocate space for new entry, doubling so appends are amortised O(1).
+  if (env->count == env->capacity) {
+    lenv_reserve(env, env->capacity ? env->capacity * 2 : 4);
+  }
+  i = env->count++;
+
+  // Copy the contents into the new memory locations.
+  env->vals[i] = lval_copy(value);
+  env->syms[i] = key->sym;
+  env->hashes[i] = key->hash;
+  lenv_index(env, i);
+
+  if (env == linterp_self->env) {
+    lsym_of(key->sym)->global = i;
+  } else {
+    LATOMIC_ADD(lsym_of(key->sym)->shadows, 1);
+  }
+}
+
+void lenv_reserve(lenv *env, int capacity) {
+  /**
+   * Make room for capacity bindings.
+   *
+   * lenv* env: The enviroment.
+   * int capacity: The number of bindings, at least env->count.
+   */
+  env->capacity = capacity;
+  env->vals = lrealloc(env->vals, sizeof(lval *) * env->capacity);
+  env->syms = lrealloc(env->syms, sizeof(char *) * env->capacity);
+  env->hashes = lrealloc(env->hashes, sizeof(unsigned long) * env->capacity);
+}
+
+void lenv_own(lenv *env) {
+  /**
+   * Give a frame made by lvm_frame_call arrays of its own, holding copies
+   * of the arguments, so bindings can be added to it.
+   *
+   * lenv* env: The enviroment, with borrowed set.
+   */
+  char **syms = env->syms;
+  lval **vals = env->vals;
+  unsigned long *hashes = env->hashes;
+  env->syms = NULL;
+  env->vals = NULL;
+  env->hashes = NULL;
+  env->borrowed = 0;
+  lenv_reserve(env, env->count);
+  for (int i = 0; i < env->count; i++) {
+    env->syms[i] = syms[i];
+    env->vals[i] = lval_copy(vals[i]);
+    env->hashes[i] = hashes[i];
+    lenv_index(env, i);
+  }
+}
+
+void lenv_def(lenv *env, lval *key, lval *value) {
+  /**
+   * Bound a new global variable.
+   * Copies the content so orignal memory can be freed.
+   *
+   * lenv* env: The enviroment to where variables are being stored.
+   * lval* key: The symbol, should be of type LVAL_SYM.
+   * lval* value: The value. Can be of any type?
+   */
+  // travese to the root of the tree of enviroments
+  while (env->parent) {
+    env = env->parent;
+  }
+  // define the varible in that eviroment
+  lenv_put(env, key, value);
+}
+
+void lenv_add_builtin(lenv *env, char *name, lbuiltin func) {
+  lval *key = lval_sym(name);
+  lval *value = lval_fun(func);
+
+  lenv_put(env, key, value);
+  lval_del(key);
+  lval_del(value);
+}
+
+void lenv_add_builtins(lenv *env) {
+  lenv_add_builtin(env, "tail", builtin_tail);
+  lenv_add_builtin(env, "head", builtin_head);
+  lenv_add_builtin(env, "eval", builtin_eval);
+  lenv_add_builtin(env, "join", builtin_join);
+  lenv_add_builtin(env, "list", builtin_list);
+  lenv_add_builtin(env, "map", builtin_map);
+  lenv_add_builtin(env, "pmap", builtin_pmap);
+  lenv_add_builtin(env, "future", builtin_future);
+  lenv_add_builtin(env, "await", builtin_await);
+  lenv_add_builtin(env, "filter", builtin_filter);
+  lenv_add_builtin(env, "foldl", builtin_foldl);
+  lenv_add_builtin(env, "len", builtin_len);
+  lenv_add_builtin(env, "nth", builtin_nth);
+  lenv_add_builtin(env, "reverse", builtin_reverse);
+  lenv_add_builtin(env, "def", builtin_def);
+  lenv_add_builtin(env, "=", builtin_put);
+
+  lenv_add_builtin(env, "plus", builtin_add);
+  lenv_add_builtin(env, "sub", builtin_sub);
+  lenv_add_builtin(env, "times", builtin_mul);
+  lenv_add_builtin(env, "div", builtin_div);
+
+  lenv_add_builtin(env, "+", builtin_add);
+  lenv_add_builtin(env, "-", builtin_sub);
+  lenv_add_builtin(env, "*", builtin_mul);
+  lenv_add_builtin(env, "/", builtin_div);
+
+  lenv_add_builtin(env, "==", builtin_eq);
+  lenv_add_builtin(env, "!=", builtin_neq);
+
+  lenv_add_builtin(env, ">", builtin_gt);
+  lenv_add_builtin(env, ">=", builtin_ge);
+  lenv_add_builtin(env, "<", builtin_lt);
+  lenv_add_builtin(env, "<=", builtin_le);
+
+  lenv_add_builtin(env, "if", builtin_if);
+  lenv_add_builtin(env, "\\", builtin_lambda);
+
+  lenv_add_builtin(env, "print", builtin_print);
+  lenv_add_builtin(env, "error", builtin_error);
+  lenv_add_builtin(env, "allocs", builtin_allocs);
+  lenv_add_builtin(env, "mem-stats", builtin_mem_stats);
+  lenv_add_builtin(env, "save-image", builtin_save_image);
+#ifdef LISPY_GC
+  lenv_add_builtin(env, "gc-stats", builtin_gc_stats);
+#endif
+  // lenv_add_builtin(env, "load", builtin_load);
+}
+
+// LVAL CONSTRUCTORS
+
+lval *lval_lambda(lval *formals, lval *body) {
+  lval *v = lpool_alloc(&lval_pool);
+  v->type = LVAL_FUN;
+  v->refs = 1;
+
+  // Set builtin to NULL as not builtin.
+  v->builtin = NULL;
+
+  // New enviroment.
+  v->env = lenv_new();
+
+  v->formals = formals;
+  v->body = body;
+  return v;
+}
+
+lval *lval_num(long x) {
+  /**
+   * Returns a pointer to a new lval of type LVAL_NUM. Only numbers outside
+   * the fixnum range are allocated.
+   *
+   * long x: The number to be represented.
+   */
+  if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+    return lval_fixnum(x);
+  }
+  // allocate memory the size of lval in the heap to store v
+  lval *v = lpool_alloc(&lval_pool);
+  v->type = LVAL_NUM;
+  v->refs = 1;
+  v->num = x;
+  return v;
+}
+
+lval *lval_str(char *str) {
+  /**
+   * Returns a pointer to a new lval of type LVAL_STR.
+   *
+   * char* str: The str to be represented.
+   */
+  lval *v = lpool_alloc(&lval_pool);
+  v->type = LVAL_STR;
+  v->refs = 1;
+  v->str = lmalloc(strlen(str) + 1);
+  strcpy(v->str, str);
+  return v;
+}
+
+lval *lval_err(char *format, ...) {
+  /**
+   * Returns a pointer to a new lval of type LVAL_ERR
+   *
+   * char* format: The error message as a printf style format.
+   * ...: the varibles to be pushed into the string.
+   */
+  lval *v = lpool_alloc(&lval_pool);
+  v->type = LVAL_ERR;
+  v->refs = 1;
+
+  va_list va;
+  va_start(va, format);
+
+  v->err = lmalloc(512);
+
+  vsnprintf(v->err, 511, format, va);
+  v->err = lrealloc(v->err, strlen(v->err) + 1);
+  va_end(va);
+
+  return v;
+}
+
+lval *lval_sym(char *s) {
+  /**
+   * Returns a pointer to a new lval of type LVAL_SYM
+   *
+   * char* s: The body of the symbol.
+   */
+  lval *v = lpool_alloc(&lval_pool);
+  v->type = LVAL_SYM;
+  v->refs = 1;
+  v->hash = lsym_hash(s);
+  v->sym = lsym_intern(s, v->hash);
+  return v;
+}
+
+// create a lval for a sexpr and return a pointer to it
+lval *lval_sexpr(void) {
+  /**
+   * Returns a pointer to a new lval of type LVAL_SEXPR
+   */
+  lval *v = lpool_alloc(&lval_pool);
+  v->type = LVAL_SEXPR;
+  v->refs = 1;
+  v->count = 0;
+  v->cell = NULL;
+  v->cells = NULL;
+  v->code = NULL;
+  return v;
+}
+
+lval *lval_qexpr(void) {
+  /**
+   * Returns a pointer to a new lval of type LVAL_SEXPR
+   */
+  lval *v = lpool_alloc(&lval_pool);
+  v->type = LVAL_QEXPR;
+  v->refs = 1;
+  v->count = 0;
+  v->cell = NULL;
+  v->cells = NULL;
+  v->code = NULL;
+  return v;
+}
+
+lval *lval_fut(ltask *task) {
+  /**
+   * Returns a pointer to a new lval of type LVAL_FUT, which takes over the
+   * caller's reference to task.
+   */
+  lval *v = lpool_alloc(&lval_pool);
+  v->type = LVAL_FUT;
+  v->refs = 1;
+  v->task = task;
+  return v;
+}
+
+lval *lval_fun(lbuiltin func) {
+  /**
+   * Returns a pointer to a new lval of type LVAL_FUN
+   */
+  lval *v = lpool_alloc(&lval_pool);
+  v->type = LVAL_FUN;
+  v->refs = 1;
+  v->builtin = func;
+  return v;
+}
+
+// LVAL UTIL FUNCTIONS/METHODS
+
+void lval_del(lval *v) {
+  /**
+   * Deletes an lval* object. Works deeply i.e. also deletes all chilren.
+   *
+   * Only frees the lval once its last owner has deleted it.
+   *
+   * lval* v: The lval* to be deleted.
+   */
+#ifndef LISPY_GC
+  if (lval_is_fixnum(v) || LATOMIC_ADD(v->refs, -1) > 0) {
+    return;
+  }
+
+  switch (v->type) {
+  case LVAL_FUN:
+    if (!v->builtin) {
+      // A frame's enviroment may be kept after it, see lval_eval_loop.
+      if (v->env) {
+        lenv_del(v->env);
+      }
+      lval_del(v->formals);
+      lval_del(v->body);
+    }
+    break;
+  }
+  lval_free_buffers(v);
+  lpool_free(&lval_pool, v);
+#endif
+}
+
+void lval_free_buffers(lval *v) {
+  /**
+   * Free the memory owned by an lval, but not its children. The array of
+   * children of a list is released, and deletes the children it holds once
+   * no lval uses it.
+   *
+   * lval* v: The lval.
+   */
+  switch (v->type) {
+  case LVAL_STR:
+    free(v->str);
+    break;
+  case LVAL_ERR:
+    free(v->err);
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (v->cells) {
+      lval_release_cells(v->cells, v);
+    }
+    if (v->code) {
+      lcode_del(v->code);
+    }
+    break;
+  case LVAL_FUT:
+    ltask_del(v->task);
+    break;
+  }
+}
+
+void lval_expr_print(FILE *f, lval *v, char open, char close) {
+  fputc(open, f);
+  for (int i = 0; i < v->count; i++) {
+    lval_fprint(f, v->cell[i]);
+
+    if (i != (v->count - 1)) {
+      fputc(' ', f);
+    }
+  }
+  fputc(close, f);
+}
+void lval_print_str(FILE *f, lval *v) {
+  /**
+   * Escape a string and then print it.
+   *
+   * FILE* f: The stream to print to.
+   * lval* v: Of type of LVAL_STR.
+   */
+  // Make a copy of the string.
+  char *escaped = lmalloc(strlen(v->str) + 1);
+  strcpy(escaped, v->str);
+  // Escape using an mpc function.
+  escaped = mpcf_escape(escaped);
+  // Print.
+  fprintf(f, "\"%s\"", escaped);
+  // Delete the copy.
+  free(escaped);
+}
+
+void lval_fprint(FILE *f, lval *v) {
+  switch (lval_type(v)) {
+  case LVAL_NUM:
+    fprintf(f, "%li", lval_num_of(v));
+    break;
+  case LVAL_ERR:
+    fprintf(f, "Error: %s", v->err);
+    break;
+  case LVAL_SYM:
+    fprintf(f, "%s", v->sym);
+    break;
+  case LVAL_FUN:
+    if (v->builtin) {
+      fprintf(f, "<builtin>");
+    } else {
+      fprintf(f, "(\\");
+      lval_fprint(f, v->formals);
+      fputc(' ', f);
+      lval_fprint(f, v->body);
+      fputc(')', f);
+    }
+    break;
+  case LVAL_STR:
+    lval_print_str(f, v);
+    break;
+  case LVAL_SEXPR:
+    lval_expr_print(f, v, '(', ')');
+    break;
+  case LVAL_QEXPR:
+    lval_expr_print(f, v, '{', '}');
+    break;
+  case LVAL_FUT:
+    fprintf(f, "<future>");
+  }
+}
+
+void lval_print(lval *v) { lval_fprint(stdout, v); }
+
+void lval_println(lval *v) {
+  lval_print(v);
+  putchar('\n');
+}
+
+lval *lval_read_num(mpc_ast_t *t) {
+  errno = 0;
+  long x = strtol(t->contents, NULL, 10);
+  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+}
+
+lval *lval_copy(lval *v) {
+  /**
+   * Return a copy of a lval that shares its structure with the original.
+   * Anything that modifies an lval in place must call lval_unshare first.
+   *
+   * lval* v: The lval* to copy.
+   *
+   * Returns: The copy.
+   */
+  if (!lval_is_fixnum(v)) {
+#ifdef LISPY_GC
+    // Not counted, just flagged as shared for lval_unshare.
+    v->refs = 2;
+#else
+    LATOMIC_ADD(v->refs, 1);
+#endif
+  }
+  return v;
+}
+
+lval *lval_unshare(lval *v) {
+  /**
+   * Get a version of v that is safe to modify in place. Returns v itself
+   * if it has one owner, otherwise gives up v and returns a shallow copy.
+   * Children are shared between the copies, so they must be unshared in
+   * turn before being modified.
+   *
+   * lval* v: The lval* to unshare, the caller's reference is consumed.
+   *
+   * Returns: An lval* with one owner.
+   */
+  if (lval_is_fixnum(v)) {
+    return v;
+  }
+  if (__atomic_load_n(&v->refs, __ATOMIC_ACQUIRE) == 1) {
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+      lval_own_cells(v);
+    }
+    return v;
+  }
+
+  lval *x = lpool_alloc(&lval_pool);
+  x->type = v->type;
+  x->refs = 1;
+
+  switch (x->type) {
+  case LVAL_FUN:
+    if (v->builtin) {
+      x->builtin = v->builtin;
+    } else {
+      x->builtin = NULL;
+      x->env = lenv_copy(v->env);
+      x->formals = lval_copy(v->formals);
+      x->body = lval_copy(v->body);
+    }
+    break;
+  case LVAL_NUM:
+    x->num = v->num;
+    break;
+  case LVAL_STR:
+    x->str = lmalloc(strlen(v->str) + 1);
+    strcpy(x->str, v->str);
+    break;
+  case LVAL_SYM:
+    x->sym = v->sym;
+    x->hash = v->hash;
+    break;
+  case LVAL_ERR:
+    x->err = lmalloc(strlen(v->err) + 1);
+    strcpy(x->err, v->err);
+    break;
+  case LVAL_QEXPR:
+  case LVAL_SEXPR:
+    x->count = 0;
+    x->cell = NULL;
+    x->cells = NULL;
+    x->code = NULL;
+    lval_reserve(x, v->count);
+    for (int i = 0; i < v->count; i++) {
+      x->cell[i] = lval_copy(v->cell[i]);
+    }
+    x->count = v->count;
+    break;
+  case LVAL_FUT:
+    x->task = v->task;
+    LATOMIC_ADD(x->task->refs, 1);
+    break;
+  }
+  lval_del(v);
+  return x;
+}
+lval *lval_call(lenv *env, lval *function, lval *args) {
+  /**
+   * Call an the function represented by an lval* object of type
+   * LVAL_FUN. Returns a partially initialised fuction if (number of
+   * arguments) < (expected number of arguments).
+   *
+   * lenv* env: The global enviroment.
+   * lval* function: The function lval* of type LVAL_FUN, consumed.
+   * lval* args: The S-expression holding the arguments, consumed.
+   *
+   * Returns:
+   * lval*: the result of the fuction call. Or the partially initialised
+   * 	     function
+   */
+  if (function->builtin) {
+    lval *result = function->builtin(env, args);
+    lval_del(function);
+    return result;
+  }
+
+  // Put the function in front of the arguments and apply it.
+  args = lval_unshare(args);
+  lval_forget_code(args);
+  if (lval_front(args)) {
+    args->cell--;
+  } else {
+    lval_reserve(args, args->count + 1);
+    memmove(&args->cell[1], &args->cell[0], sizeof(lval *) * args->count);
+  }
+  args->cell[0] = function;
+  args->count++;
+  args->type = LVAL_SEXPR;
+  return lval_apply(env, args);
+}
+
+lval *lval_bind(lenv *env, lval *function, lval *args) {
+  /**
+   * Bind arguments to the formals of a lambda, in its own enviroment.
+   * Pops each formal as it is bound so function and function->formals
+   * must have been unshared.
+   *
+   * lenv* env: The enviroment of the caller.
+   * lval* function: The lambda, of type LVAL_FUN.
+   * lval* args: The arguments, consumed.
+   *
+   * Returns:
+   * lval*: NULL if every formal is now bound and the body is ready to be
+   *        evaluated in function->env. Otherwise an error or, if there
+   *        were too few arguments, the partially applied function.
+   */
+  int given = args->count;
+  int total = function->formals->count;
+
+  while (args->count) {
+
+    // If no more arguments to bind.
+    if (function->formals->count == 0) {
+      int evaluated = given - args->count;
+      lval_del(args);
+      return lval_err("Function passed too many arguments. "
+                      "Got %i expected %i. "
+                      "Evaluated %i.",
+                      given, total, evaluated);
+    }
+
+    // Pop the next "formal".
+    lval *symbol = lval_pop(function->formals, 0);
+
+    // & means the function accepts a varible number of args.
+    if (symbol->sym == lsym_ampersand()) {
+
+      if (function->formals->count != 1) {
+        lval_del(symbol);
+        lval_del(args);
+        return lval_err("The '&' symbol not followed by exactly one symbol.");
+      }
+
+      lval *next_symbol = lval_pop(function->formals, 0);
+      // The remaining args are bound as a list.
+      lenv_put(function->env, next_symbol, builtin_list(env, args));
+      lval_del(symbol);
+      lval_del(next_symbol);
+      break;
+    }
+
+    // Pop the next argument.
+    lval *arg = lval_pop(args, 0);
+
+    lenv_put(function->env, symbol, arg);
+
+    // Delete the symbols.
+    lval_del(symbol);
+    lval_del(arg);
+  }
+
+  // Delete the args lval* as all args have been evaluated.
+  lval_del(args);
+
+  // If there is no arguments left and there is '&' followed by a symbol.
+  if (function->formals->count > 0 &&
+      function->formals->cell[0]->sym == lsym_ampersand()) {
+
+    // If the & symbol is not followed by one symbol.
+    if (function->formals->count != 2) {
+      return lval_err("The '&' symbol not followed by exactly one symbol.");
+    }
+
+    // Delete the lval represeting '&'.
+    lval_del(lval_pop(function->formals, 0));
+
+    lval *sym = lval_pop(function->formals, 0);
+    lval *value = lval_qexpr();
+
+    lenv_put(function->env, sym, value);
+    lval_del(sym);
+    lval_del(value);
+  }
+
+  if (function->formals->count == 0) {
+    return NULL;
+  } else {
+    return lval_copy(function);
+  }
+}
+
+lval *lval_frame(lval *function, lval *args) {
+  /**
+   * The common case of lval_bind, a lambda with nothing bound yet given
+   * exactly as many arguments as it has formals. The arguments are bound in
+   * a new enviroment without copying the lambda or popping its formals.
+   *
+   * lval* function: The lambda, consumed on success.
+   * lval* args: The arguments, consumed on success.
+   *
+   * Returns:
+   * lval*: A lambda with every formal bound in its enviroment, only for
+   *        running its body. NULL if lval_bind is needed, in which case
+   *        neither argument is consumed.
+   */
+  lval *formals = function->formals;
+  if (function->env->count || formals->count != args->count) {
+    return NULL;
+  }
+  for (int i = 0; i < formals->count; i++) {
+    if (formals->cell[i]->sym == lsym_ampersand()) {
+      return NULL;
+    }
+  }
+
+  lval *frame = lval_lambda(lval_copy(formals), lval_copy(function->body));
+  lenv_reserve(frame->env, formals->count);
+  for (int i = 0; i < formals->count; i++) {
+    lenv_put(frame->env, formals->cell[i], args->cell[i]);
+  }
+  lval_del(function);
+  lval_del(args);
+  return frame;
+}
+
+int lval_front(lval *v) {
+  /**
+   * The number of unused slots in the array of children before v->cell,
+   * left by popping the first child or by slicing.
+   */
+  return v->cells ? v->cell - v->cells->items : 0;
+}
+
+void lval_reserve(lval *v, int capacity) {
+  /**
+   * Make room for at least capacity children, counting from v->cell. The
+   * array grows geometrically so repeated lval_adds are amortised O(1).
+   *
+   * lval* v: An S-expression or Q-expression, the only user of its array.
+   * int capacity: The number of children to make room for.
+   */
+  lcells *c = v->cells;
+  int front = lval_front(v);
+  if (capacity <= (c ? c->capacity - front : 0)) {
+    return;
+  }
+  if (front) {
+    // Reuse the slots at the front first.
+    memmove(c->items, v->cell, sizeof(lval *) * v->count);
+    v->cell = c->items;
+    if (capacity <= c->capacity) {
+      return;
+    }
+  }
+  int size = c ? c->capacity * 2 : capacity;
+  if (size < capacity) {
+    size = capacity;
+  }
+  c = lrealloc(c, sizeof(lcells) + sizeof(lval *) * size);
+  if (!v->cells) {
+    c->refs = 1;
+    c->shared = 0;
+  }
+  c->capacity = size;
+  v->cells = c;
+  v->cell = c->items;
+}
+
+void lval_own_cells(lval *v) {
+  /**
+   * Make v the only user of its array of children so they can be changed
+   * in place. The children are copied to a new array if it is shared.
+   * Called by lval_unshare.
+   *
+   * lval* v: An S-expression or Q-expression.
+   */
+  lcells *c = v->cells;
+  if (!c) {
+    return;
+  }
+
+  if (__atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) > 1) {
+    lval **cell = v->cell;
+    int count = v->count;
+    LATOMIC_ADD(c->refs, -1);
+    v->cells = NULL;
+    v->cell = NULL;
+    v->count = 0;
+    lval_reserve(v, count);
+    for (int i = 0; i < count; i++) {
+      v->cell[i] = lval_copy(cell[i]);
+    }
+    v->count = count;
+    return;
+  }
+
+  if (c->shared) {
+    // The slices that used the rest of the array have been deleted.
+    int lo = v->cell - c->items;
+    int hi = lo + v->count;
+    for (int i = c->start; i < lo; i++) {
+      lval_del(c->items[i]);
+    }
+    for (int i = hi; i < c->end; i++) {
+      lval_del(c->items[i]);
+    }
+    c->shared = 0;
+  }
+}
+
+void lval_release_cells(lcells *c, lval *v) {
+  /**
+   * Stop using an array of children, deleting it and the children it holds
+   * if nothing else uses it.
+   *
+   * lcells* c: The array.
+   * lval* v: The lval that was using it.
+   */
+  if (LATOMIC_ADD(c->refs, -1) > 0) {
+    return;
+  }
+  int lo = c->shared ? c->start : v->cell - c->items;
+  int hi = c->shared ? c->end : lo + v->count;
+  for (int i = lo; i < hi; i++) {
+    lval_del(c->items[i]);
+  }
+  free(c);
+}
+
+lval *lval_slice(lval *v, int i, int n) {
+  /**
+   * Get children i to i + n - 1 of a list as a new list of the same type,
+   * sharing the array of children rather than copying it. O(1).
+   *
+   * lval* v: An S-expression or Q-expression, consumed.
+   * int i: The first child.
+   * int n: The number of children.
+   *
+   * Returns:
+   * lval*: The slice.
+   */
+  lval *x = lval_qexpr();
+  x->type = v->type;
+  if (n > 0) {
+    lcells *c = v->cells;
+    if (!__atomic_load_n(&c->shared, __ATOMIC_ACQUIRE)) {
+      // Record which children the array holds, as each user may only
+      // know about some of them from now on. Workers of pmap may slice
+      // the same list at once, they all store the same values.
+      int start = v->cell - c->items;
+      __atomic_store_n(&c->start, start, __ATOMIC_RELAXED);
+      __atomic_store_n(&c->end, start + v->count, __ATOMIC_RELAXED);
+      __atomic_store_n(&c->shared, 1, __ATOMIC_RELEASE);
+    }
+    LATOMIC_ADD(c->refs, 1);
+    x->cells = c;
+    x->cell = v->cell + i;
+    x->count = n;
+  }
+  lval_del(v);
+  return x;
+}
+
+lval *lval_add(lval *v, lval *x) {
+  lval_forget_code(v);
+  lval_reserve(v, v->count + 1);
+  v->cell[v->count++] = x;
+  return v;
+}
+
+lval *lval_join(lval *x, lval *y) {
+  /**
+   * Move each child from y to x.
+   *
+   * lval* x: Lval to move to.
+   * lval* y: Lval to move from.
+   */
+  x = lval_unshare(x);
+  lval_forget_code(x);
+  lval_reserve(x, x->count + y->count);
+
+  // The children can be moved rather than copied if nothing else has y.
+  int owned = __atomic_load_n(&y->refs, __ATOMIC_ACQUIRE) == 1 &&
+              (!y->cells ||
+               __atomic_load_n(&y->cells->refs, __ATOMIC_ACQUIRE) == 1);
+  if (owned) {
+    lval_own_cells(y);
+  }
+  for (int i = 0; i < y->count; i++) {
+    x->cell[x->count++] = owned ? y->cell[i] : lval_copy(y->cell[i]);
+  }
+  if (owned) {
+    y->count = 0;
+  }
+
+  lval_del(y);
+  return x;
+}
+
+int lval_eq(lval *x, lval *y) {
+  /**
+   * Compares two lval objects, returns 1 if they are equal
+   * and 0 if not.
+   *
+   * lval* x Lval to compare.
+   * lval* y Lval to compare.
+   * Returns:
+   * int Whether the lvals are equal.
+   */
+
+  if (lval_type(x) != lval_type(y)) {
+    return 0;
+  }
+
+  switch (lval_type(x)) {
+  case LVAL_NUM:
+    return lval_num_of(x) == lval_num_of(y);
+  case LVAL_STR:
+    return (strcmp(x->str, y->str) == 0);
+  case LVAL_SYM:
+    return (x->sym == y->sym);
+  case LVAL_ERR:
+    return (strcmp(x->err, y->err) == 0);
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (x->count != y->count) {
+      return 0;
+    }
+    for (int i = 0; i < x->count; i++) {
+      // If any pair of elements are not the same return false.
+      if (!lval_eq(x->cell[i], y->cell[i])) {
+        return 0;
+      }
+    }
+    return 1;
+  case LVAL_FUN:
+    if (x->builtin || y->builtin) {
+      return (x->builtin == y->builtin);
+    } else {
+      return (lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body));
+    }
+    break;
+  case LVAL_FUT:
+    return x->task == y->task;
+  }
+  return 0;
+}
+
+lval *builtin_print(lenv *env, lval *args) {
+  /**
+   * Print a string to the terminal.:
+   *
+   * lenv* env: The eniroment, won't be used.
+   * lval* args: An lval containing all the things to print.
+   */
+
+  for (int i = 0; i < args->count; i++) {
+    lval_print(args->cell[i]);
+    putchar(' ');
+  }
+
+  putchar('\n');
+  lval_del(args);
+
+  return lval_sexpr();
+}
+
+lval *builtin_error(lenv *env, lval *args) {
+  /**
+   * Raise an error.
+   *
+   * lenv* env: The eniroment, won't be used.
+   * lval* args: An lval containing the error message.
+   */
+  LASSERT_NUM("error", args, 1);
+  LASSERT_TYPE("error", args, 0, LVAL_STR);
+
+  // Create an error with the given string.
+  lval *err = lval_err(args->cell[0]->str);
+
+  lval_del(args);
+  return err;
+}
+
+lval *builtin_allocs(lenv *env, lval *args) {
+  /**
+   * Get the number of heap allocations the interpreter has made so far.
+   *
+   * Example usage:
+   *  (allocs {})
+   *
+   * lenv* env: The eniroment, won't be used.
+   * lval* args: An empty Q-Expression, as a lone builtin in an S-Expression
+   *             is returned rather than called.
+   */
+  LASSERT_NUM("allocs", args, 1);
+  LASSERT_TYPE("allocs", args, 0, LVAL_QEXPR);
+  LASSERT(args, args->cell[0]->count == 0,
+          "The function allocs expected an empty Q-Expression.");
+  lval_del(args);
+  return lval_num(lalloc_count);
+}
+
+lval *builtin_mem_stats(lenv *env, lval *args) {
+  /**
+   * Print the allocator statistics from lmem_print_stats.
+   *
+   * Example usage:
+   *  (mem-stats {})
+   *
+   * lenv* env: The eniroment, won't be used.
+   * lval* args: An empty Q-Expression, see builtin_allocs.
+   */
+  LASSERT_NUM("mem-stats", args, 1);
+  LASSERT_TYPE("mem-stats", args, 0, LVAL_QEXPR);
+  LASSERT(args, args->cell[0]->count == 0,
+          "The function mem-stats expected an empty Q-Expression.");
+  lval_del(args);
+  lmem_print_stats();
+  return lval_sexpr();
+}
+
+#ifdef LISPY_GC
+lval *builtin_gc_stats(lenv *env, lval *args) {
+  /**
+   * Print how many collections have run and how long they paused for.
+   *
+   * Example usage:
+   *  (gc-stats {})
+   *
+   * lenv* env: The eniroment, won't be used.
+   * lval* args: An empty Q-Expression, see builtin_allocs.
+   */
+  LASSERT_NUM("gc-stats", args, 1);
+  LASSERT_TYPE("gc-stats", args, 0, LVAL_QEXPR);
+  LASSERT(args, args->cell[0]->count == 0,
+          "The function gc-stats expected an empty Q-Expression.");
+  lval_del(args);
+  printf("collections %ld last freed %ld threshold %ld\n",
+         lgc_stats.collections, lgc_stats.freed, lgc_threshold);
+  printf("pause ms last %.3f max %.3f total %.3f mean %.3f\n",
+         lgc_stats.last_ms, lgc_stats.max_ms, lgc_stats.total_ms,
+         lgc_stats.collections ? lgc_stats.total_ms / lgc_stats.collections
+                               : 0.0);
+  return lval_sexpr();
+}
+#endif
+
+lval *builtin_load(lenv *env, lval *a) {
+  /**
+   * Load a "library" of code from a filename.
+   *
+   * lenv* env: The enviroment to use to evaluate the library.
+   * lval* a: An lval that should contain a single argument of type LVAL_STR
+   *          containing the filename.
+   * Returns:
+   *  lval* either an empty LVAL_SEXPR or an LVAL_ERR if an error occurs.
+   */
+
+  // Assert that has one arg of type LVAL_STR
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+  mpc_result_t r;
+  if (mpc_parse_contents(a->cell[0]->str, linterp_self->Lispy, &r)) {
+    lval *expr = lval_read(r.output);
+    mpc_ast_delete(r.output);
+
+    // While still expressions to eval.
+    LGC_ROOT(expr);
+    while (expr->count) {
+      // Evaluate the fist expr.
+      lval *x = lval_eval(env, lval_pop(expr, 0));
+
+      if (lval_type(x) == LVAL_ERR) {
+        lval_println(x);
+      }
+      lval_del(x);
+    }
+    LGC_UNROOT(1);
+
+    // Clean up
+    lval_del(expr);
+    lval_del(a);
+
+    // return an empty sexpr
+    return lval_sexpr();
+
+  } else {
+    char *err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+
+    lval *err = lval_err("Could not load library %s", err_msg);
+    free(err_msg);
+    lval_del(a);
+
+    return err;
+  }
+}
+
+lval *builtin_if(lenv *env, lval *a) {
+  /**
+   * A bulitin if function. Works like the terniary operator in c.
+   *
+   * Example usage:
+   *  if (a == b) {def {a} 1} {def {a} 2}
+   *
+   * lenv* env: The enviroment where to
+   * lval* a: The arguments. Should be made up of LVAL_NUM,
+   * 					LVAL_QEXPR, LVAL_QEXPR. Where the
+   * LVAL_NUM represents a boolean value.
+   */
+
+  lval *x = builtin_if_branch(a);
+  if (lval_type(x) == LVAL_ERR) {
+    return x;
+  }
+  return lval_eval(env, x);
+}
+
+lval *builtin_if_branch(lval *a) {
+  /**
+   * Pick the branch of an if without evaluating it. Used by builtin_if,
+   * and by lval_eval so that the branch is evaluated as a tail call.
+   *
+   * lval* a: The arguments to if.
+   *
+   * Returns:
+   * lval*: The branch as an S-expression or an error.
+   */
+
+  // Check for correct number of args.
+  LASSERT_NUM("if", a, 3);
+  // Check for correct types
+  LASSERT_TYPE("if", a, 0, LVAL_NUM);
+  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+  // Take the branch to execute, cell[1] if true and cell[2] if false.
+  lval *x = lval_unshare(lval_pop(a, lval_num_of(a->cell[0]) ? 1 : 2));
+  lval_del(a);
+
+  // Change the qexpr to sexpr so it can be executed.
+  x->type = LVAL_SEXPR;
+  return x;
+}
+
+lval *builtin_ord(lenv *env, lval *a, char *op) {
+  LASSERT_NUM(op, a, 2);
+  LASSERT_TYPE(op, a, 0, LVAL_NUM);
+  LASSERT_TYPE(op, a, 1, LVAL_NUM);
+  int r;
+
+  if (strcmp(op, ">=") == 0) {
+    r = (lval_num_of(a->cell[0]) >= lval_num_of(a->cell[1]));
+  }
+  if (strcmp(op, ">") == 0) {
+    r = (lval_num_of(a->cell[0]) > lval_num_of(a->cell[1]));
+  }
+  if (strcmp(op, "<=") == 0) {
+    r = (lval_num_of(a->cell[0]) <= lval_num_of(a->cell[1]));
+  }
+  if (strcmp(op, "<") == 0) {
+    r = (lval_num_of(a->cell[0]) < lval_num_of(a->cell[1]));
+  }
+
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval *builtin_ge(lenv *env, lval *a) { return builtin_ord(env, a, ">="); }
+
+lval *builtin_gt(lenv *env, lval *a) { return builtin_ord(env, a, ">"); }
+
+lval *builtin_le(lenv *env, lval *a) { return builtin_ord(env, a, "<="); }
+
+lval *builtin_lt(lenv *env, lval *a) { return builtin_ord(env, a, "<"); }
+
+lval *builtin_cmp(lenv *env, lval *a, char *op) {
+  /**
+   * Function to compare two arguments, used for
+   * builtin_eq and builtin_neq.
+   *
+   * lenv* env: The enviroment where to exectute.
+   * lval* a: The arguments passed.
+   * char* op: One of '>', '>=', '<' and '<='.
+   */
+  LASSERT_NUM(op, a, 2);
+  int r;
+
+  if (strcmp(op, "==") == 0) {
+    r = lval_eq(a->cell[0], a->cell[1]);
+  }
+  if (strcmp(op, "!=") == 0) {
+    r = !lval_eq(a->cell[0], a->cell[1]);
+  }
+
+  lval_del(a);
+
+  return lval_num(r);
+}
+
+lval *builtin_eq(lenv *env, lval *a) { return builtin_cmp(env, a, "=="); }
+
+lval *builtin_neq(lenv *env, lval *a) { return builtin_cmp(env, a, "!="); }
+
+lval *builtin_def(lenv *env, lval *a) {
+  /**
+   */
+
+  return builtin_var(env, a, "def");
+}
+
+lval *builtin_put(lenv *env, lval *a) {
+  /**
+   */
+  return builtin_var(env, a, "=");
+}
+
+lval *builtin_lambda(lenv *e, lval *v) {
+  /**
+   * Takes an lval* representing a lambda and returns a new
+   * lval of type LVAL_FUN.
+   *
+   * lenv* e: The enviroment.
+   * lval* v: The lval of type LVAL_SEXPR.
+   *
+   * Returns:
+   * lval*: An lval* of type LVAL_FUN.
+   */
+
+  // Check that the lval has 2 children both of which are Q-Expressions
+  LASSERT_NUM("//", v, 2);
+  LASSERT_TYPE("//", v, 0, LVAL_QEXPR);
+  LASSERT_TYPE("//", v, 1, LVAL_QEXPR);
+
+  // Check each of the formals is a Symbol
+  for (int i = 0; i < v->cell[0]->count; i++) {
+    LASSERT(v, lval_type(v->cell[0]->cell[i]) == LVAL_SYM,
+            "Cannot define non-symbol. Got %s expected %s.",
+            ltype_name(lval_type(v->cell[0]->cell[i])), ltype_name(LVAL_SYM));
+  }
+
+  lval *formals = lval_pop(v, 0);
+  lval *body = lval_pop(v, 0);
+  lval_del(v);
+
+  // Resolve the formals in the body to slots now, so calls only index.
+  lcode_of(body, formals);
+  return lval_lambda(formals, body);
+}
+
+lval *builtin_var(lenv *env, lval *a, char *func) {
+  /**
+   * Bind a list (q-expression) of symbols to the corresponding
+   * arguments.
+   *
+   * lenv* env: The enviroment where to execute.
+   * lval a: The arguemnts.
+   * char* func: Either "=" or "def" determines which scope to define vars in
+   * 						 local or global respectively.
+   */
+  // checks the first value is a q-expression
+  LASSERT_NOT_EMPTY(func, a);
+  LASSERT_TYPE("def", a, 0, LVAL_QEXPR);
+
+  // list of symbols
+  lval *syms = a->cell[0];
+
+  // Check all the elements are symbols.
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT_TYPE("def", syms, i, LVAL_SYM);
+  }
+
+  LASSERT(a, syms->count == a->count - 1,
+          "There are a different number of values to symbols."
+          "Got %i and expected %i.",
+          syms->count, a->count - 1);
+
+  // The global enviroment is shared by the workers of pmap and future, so
+  // it can only change while none of them are running.
+  int global = strcmp(func, "def") == 0 || env == linterp_self->env;
+  LASSERT(a, !(global && lthread_worker),
+          "%s can not change the global enviroment inside pmap or future.",
+          func);
+  if (global) {
+    ltasks_settle();
+  }
+
+  for (int i = 0; i < syms->count; i++) {
+    if (strcmp(func, "def") == 0) {
+      lenv_def(env, syms->cell[i], a->cell[i + 1]);
+    } else if (strcmp(func, "=") == 0) {
+      lenv_put(env, syms->cell[i], a->cell[i + 1]);
+    }
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval *lval_read_str(mpc_ast_t *t) {
+  /**
+   * Read a string into an lval_str. Unescapes the string.
+   *
+   * mpc_ast_t* t: The string node from the mpc library.
+   */
+  t->contents[strlen(t->contents) - 1] = '\0';
+  char *unescaped = lmalloc(strlen(t->contents + 1) + 1);
+  strcpy(unescaped, t->contents + 1);
+  unescaped = mpcf_unescape(unescaped);
+  lval *str = lval_str(unescaped);
+
+  free(unescaped);
+  return str;
+}
+
+lval *builtin_join(lenv *env, lval *a) {
+  /**
+   * Take a q-expression and join each child into the first.
+   *
+   * lenv* env: The enviroment.
+   * lval* a: q-expression containing all of the chilren to be evaluated.
+   */
+  LASSERT_NOT_EMPTY("join", a);
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+  }
+
+  lval *x = lval_pop(a, 0);
+
+  while (a->count) {
+    x = lval_join(x, lval_pop(a, 0));
+  }
+
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_head(lenv *e, lval *a) {
+  /**
+   * Take a q-expression and return a q-expression with a sigular child
+   * representing the first index.
+   *
+   * lenv* env: The enviroment.
+   * lval* a: q-expression to find the head of.
+   */
+  LASSERT_NUM("head", a, 1);
+  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count != 0, "Passed {} to head");
+  LASSERT_NOT_EMPTY("head", a);
+
+  // take the first child from a and del a
+  return lval_slice(lval_take(a, 0), 0, 1);
+}
+
+lval *builtin_tail(lenv *env, lval *a) {
+  /**
+   * Take a q-expression and return a q-expression with the first index
+   * removed
+   *
+   * lenv* env: The enviroment.
+   * lval* a: q-expression to find the head of.
+   */
+  LASSERT_NUM("tail", a, 1);
+  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("head", a);
+
+  lval *v = lval_take(a, 0);
+  if (v->count == 0) {
+    return v;
+  }
+  return lval_slice(v, 1, v->count - 1);
+}
+
+lval *builtin_list(lenv *env, lval *a) {
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+lval *builtin_map(lenv *env, lval *a) {
+  /**
+   * Call a function on each element of a list.
+   *
+   * Example usage:
+   *  map (\ {x} {* x 2}) {1 2 3}
+   *
+   * lenv* env: The enviroment to call the function in.
+   * lval* a: The arguments, a function and a Q-expression.
+   *
+   * Returns:
+   * lval*: A Q-expression of the results, or the first error.
+   */
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+  lval *f = a->cell[0];
+  lval *list = a->cell[1];
+  lval *result = lval_qexpr();
+  lval_reserve(result, list->count);
+
+  LGC_ROOT(a);
+  LGC_ROOT(result);
+  for (int i = 0; i < list->count; i++) {
+    lval *args = lval_add(lval_sexpr(), lval_copy(list->cell[i]));
+    lval *x = lval_call(env, lval_copy(f), args);
+    if (lval_type(x) == LVAL_ERR) {
+      lval_del(result);
+      result = x;
+      break;
+    }
+    lval_add(result, x);
+  }
+  LGC_UNROOT(2);
+
+  lval_del(a);
+  return result;
+}
+
+lval *builtin_filter(lenv *env, lval *a) {
+  /**
+   * Keep the elements of a list for which a function returns a number
+   * other than 0.
+   *
+   * Example usage:
+   *  filter (\ {x} {> x 1}) {1 2 3}
+   *
+   * lenv* env: The enviroment to call the function in.
+   * lval* a: The arguments, a function and a Q-expression.
+   *
+   * Returns:
+   * lval*: A Q-expression of the elements kept, or the first error.
+   */
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+  lval *f = a->cell[0];
+  lval *list = a->cell[1];
+  lval *result = lval_qexpr();
+
+  LGC_ROOT(a);
+  LGC_ROOT(result);
+  for (int i = 0; i < list->count; i++) {
+    lval *args = lval_add(lval_sexpr(), lval_copy(list->cell[i]));
+    lval *x = lval_call(env, lval_copy(f), args);
+    if (lval_type(x) == LVAL_ERR) {
+      lval_del(result);
+      result = x;
+      break;
+    }
+    if (lval_type(x) != LVAL_NUM) {
+      lval_del(result);
+      result = lval_err("The function %s expected %s but got %s", "filter",
+                        ltype_name(LVAL_NUM), ltype_name(lval_type(x)));
+      lval_del(x);
+      break;
+    }
+    if (lval_num_of(x)) {
+      lval_add(result, lval_copy(list->cell[i]));
+    }
+    lval_del(x);
+  }
+  LGC_UNROOT(2);
+
+  lval_del(a);
+  return result;
+}
+
+lval *builtin_foldl(lenv *env, lval *a) {
+  /**
+   * Combine the elements of a list from the left, starting from an
+   * initial value.
+   *
+   * Example usage:
+   *  foldl + 0 {1 2 3}
+   *
+   * lenv* env: The enviroment to call the function in.
+   * lval* a: The arguments, a function taking the value so far and an
+   *          element, the initial value and a Q-expression.
+   *
+   * Returns:
+   * lval*: The final value, or the first error.
+   */
+  LASSERT_NUM("foldl", a, 3);
+  LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+  LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+  lval *f = a->cell[0];
+  lval *list = a->cell[2];
+  lval *result = lval_copy(a->cell[1]);
+
+  LGC_ROOT(a);
+  LGC_ROOT(result);
+  for (int i = 0; i < list->count && lval_type(result) != LVAL_ERR; i++) {
+    lval *args = lval_add(lval_sexpr(), result);
+    lval_add(args, lval_copy(list->cell[i]));
+    result = lval_call(env, lval_copy(f), args);
+  }
+  LGC_UNROOT(2);
+
+  lval_del(a);
+  return result;
+}
+
+/**
+ * A call of pmap, shared by the workers. Elements are handed out in chunks
+ * of chunk elements, next is the first element not yet handed out.
+ */
+typedef struct {
+  linterp *interp;
+  lenv *env;
+  lval *f;
+  lval *list;
+  lval **results;
+  int chunk;
+  int next;
+} lpmap_job;
+
+/**
+ * The workers of pmap, started by the first call. Each waits for a new
+ * generation of job, runs it and the last to finish signals done. They run
+ * one job at a time, for whichever call holds busy.
+ */
+struct {
+  int size;
+  pthread_mutex_t busy;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  lpmap_job *job;
+  long generation;
+  int running;
+} lworkers = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+              PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0};
+
+void lpmap_run(lpmap_job *job) {
+  /**
+   * Take chunks of a pmap job until there are none left, calling the
+   * function on each element in an enviroment of this thread's own.
+   *
+   * lpmap_job* job: The job.
+   */
+  linterp *outer = linterp_enter(job->interp);
+  lenv *env = lenv_new();
+  env->parent = job->env;
+  int count = job->list->count;
+  while (1) {
+    int i = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED);
+    if (i >= count) {
+      break;
+    }
+    int end = i + job->chunk < count ? i + job->chunk : count;
+    for (; i < end; i++) {
+      lval *args = lval_add(lval_sexpr(), lval_copy(job->list->cell[i]));
+      job->results[i] = lval_call(env, lval_copy(job->f), args);
+    }
+  }
+  lenv_del(env);
+  linterp_leave(outer);
+}
+
+void *lworker_main(void *arg) {
+  lthread_worker = 1;
+  long seen = 0;
+  pthread_mutex_lock(&lworkers.lock);
+  while (1) {
+    while (lworkers.generation == seen) {
+      pthread_cond_wait(&lworkers.work, &lworkers.lock);
+    }
+    seen = lworkers.generation;
+    pthread_mutex_unlock(&lworkers.lock);
+
+    lpmap_run(lworkers.job);
+
+    pthread_mutex_lock(&lworkers.lock);
+    if (--lworkers.running == 0) {
+      pthread_cond_signal(&lworkers.done);
+    }
+  }
+  return NULL;
+}
+
+int lthreads_wanted(void) {
+  /**
+   * The number of threads to run Lisp code on, one for each CPU or
+   * LISPY_THREADS if it is set.
+   */
+  char *threads = getenv("LISPY_THREADS");
+  int size = threads ? atoi(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+  return size < 1 ? 1 : size;
+}
+
+void lworkers_atfork_child(void) {
+  /**
+   * A forked child has none of its parent's threads, so the next pmap in it
+   * starts a pool of its own.
+   */
+  lworkers.size = 0;
+  lworkers.generation = 0;
+  lworkers.running = 0;
+  pthread_mutex_init(&lworkers.busy, NULL);
+  pthread_mutex_init(&lworkers.lock, NULL);
+  pthread_cond_init(&lworkers.work, NULL);
+  pthread_cond_init(&lworkers.done, NULL);
+}
+
+int lworkers_start(void) {
+  /**
+   * Start the workers if they are not running yet, see lthreads_wanted.
+   *
+   * Returns:
+   * int: The number of workers, 0 if none could be started.
+   */
+  if (lworkers.size) {
+    return lworkers.size;
+  }
+  int size = lthreads_wanted();
+
+  static int registered = 0;
+  if (!registered) {
+    pthread_atfork(NULL, NULL, lworkers_atfork_child);
+    registered = 1;
+  }
+
+  for (int i = 0; i < size; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, lworker_main, NULL) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    lworkers.size++;
+  }
+  return lworkers.size;
+}
+
+lval *lpmap_map(lenv *env, lval *a) {
+  /**
+   * pmap on the calling thread, for when the workers can't be used. It runs
+   * as a worker so the function is held to the same rules either way.
+   */
+  int worker = lthread_worker;
+  lthread_worker = 1;
+  lval *result = builtin_map(env, a);
+  lthread_worker = worker;
+  return result;
+}
+
+lval *builtin_pmap(lenv *env, lval *a) {
+  /**
+   * Like map, but the calls are shared between a pool of worker threads.
+   * The function should be pure: it may not use def, and anything it
+   * prints comes out in no particular order. The results keep the order
+   * of the list and the first error in the list is returned, as with map.
+   * In a build with LISPY_GC the calls run serially on the calling thread.
+   *
+   * Example usage:
+   *  pmap (\ {n} {fib n}) {20 21 22 23}
+   *
+   * lenv* env: The enviroment to call the function in.
+   * lval* a: The arguments, a function and a Q-expression.
+   *
+   * Returns:
+   * lval*: A Q-expression of the results, or the first error.
+   */
+  LASSERT_NUM("pmap", a, 2);
+  LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+  LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+  // pmap runs serially under LISPY_GC, as the collector only knows about
+  // the calling thread.
+#ifdef LISPY_GC
+  return lpmap_map(env, a);
+#else
+  // Workers can not wait for themselves, and run one call at a time, so map
+  // if this is one or another interpreter has them. One worker would only
+  // add locking to what map does already.
+  if (lthread_worker || a->cell[1]->count == 0 ||
+      pthread_mutex_trylock(&lworkers.busy) != 0) {
+    return lpmap_map(env, a);
+  }
+  int workers = lworkers_start();
+  if (workers < 2) {
+    pthread_mutex_unlock(&lworkers.busy);
+    return lpmap_map(env, a);
+  }
+
+  lval *list = a->cell[1];
+  lpmap_job job;
+  job.interp = linterp_self;
+  job.env = env;
+  job.f = a->cell[0];
+  job.list = list;
+  job.results = lmalloc(sizeof(lval *) * list->count);
+  // Several chunks per worker, so a slow chunk does not hold up the rest.
+  job.chunk = list->count / (workers * 4);
+  if (job.chunk < 1) {
+    job.chunk = 1;
+  }
+  job.next = 0;
+
+  __atomic_add_fetch(&lthreads_active, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&lworkers.lock);
+  lworkers.job = &job;
+  lworkers.generation++;
+  lworkers.running = workers;
+  pthread_cond_broadcast(&lworkers.work);
+  while (lworkers.running) {
+    pthread_cond_wait(&lworkers.done, &lworkers.lock);
+  }
+  pthread_mutex_unlock(&lworkers.lock);
+  pthread_mutex_unlock(&lworkers.busy);
+  __atomic_sub_fetch(&lthreads_active, 1, __ATOMIC_SEQ_CST);
+
+  lval *result = lval_qexpr();
+  lval_reserve(result, list->count);
+  memcpy(result->cell, job.results, sizeof(lval *) * list->count);
+  result->count = list->count;
+  free(job.results);
+  lval_del(a);
+
+  // Like map, give the first error instead.
+  for (int i = 0; i < result->count; i++) {
+    if (lval_type(result->cell[i]) == LVAL_ERR) {
+      return lval_take(result, i);
+    }
+  }
+  return result;
+#endif
+}
+
+/**
+ * The tasks of future that are waiting to run. Every thread running Lisp
+ * code pushes and pops its own tasks at the bottom of a deque, and threads
+ * with nothing to do steal from the top of the others. A thief so takes the
+ * oldest task, which in divide and conquer code is the largest. Each deque
+ * has its own lock, there is no queue shared by every thread.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  ltask **items; // Ring buffer of capacity tasks, a power of 2.
+  int capacity;
+  long top;    // Index of the oldest task.
+  long bottom; // Index after the newest task.
+} ldeque;
+
+/**
+ * The pool that runs futures, started by the first call of future. It is
+ * shared by every interpreter, each task records the one that started it.
+ * Deque 0 is used by the threads that are not workers of the pool, such as
+ * the main thread. Threads with nothing to do wait on wake, which is
+ * signalled when a task is pushed or finishes while any are waiting.
+ */
+struct {
+  pthread_once_t once;
+  int size; // The number of deques, one more than the number of workers.
+  ldeque *deques;
+  int queued; // Tasks waiting in a deque.
+  int idle;   // Threads waiting on wake.
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} ltasks = {PTHREAD_ONCE_INIT, 0, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER,
+            PTHREAD_COND_INITIALIZER};
+
+// The index of the current thread's deque.
+__thread int ltask_deque = 0;
+
+void ldeque_push(ldeque *d, ltask *t) {
+  /**
+   * Push a task onto the bottom of a deque.
+   */
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom - d->top == d->capacity) {
+    int capacity = d->capacity ? d->capacity * 2 : 64;
+    ltask **items = lmalloc(sizeof(ltask *) * capacity);
+    for (long i = d->top; i < d->bottom; i++) {
+      items[i & (capacity - 1)] = d->items[i & (d->capacity - 1)];
+    }
+    free(d->items);
+    d->items = items;
+    d->capacity = capacity;
+  }
+  d->items[d->bottom++ & (d->capacity - 1)] = t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+ltask *ldeque_take(ldeque *d, int steal) {
+  /**
+   * Take the newest task from a deque, or the oldest if steal is set.
+   *
+   * Returns:
+   * ltask*: The task, or NULL if the deque is empty.
+   */
+  ltask *t = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->top < d->bottom) {
+    long i = steal ? d->top++ : --d->bottom;
+    t = d->items[i & (d->capacity - 1)];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+ltask *ltask_find(void) {
+  /**
+   * Take a task for the current thread to run, the newest from its own
+   * deque or else the oldest from the next deque that has one.
+   *
+   * Returns:
+   * ltask*: The task, or NULL if none are waiting.
+   */
+  if (__atomic_load_n(&ltasks.queued, __ATOMIC_SEQ_CST) == 0) {
+    return NULL;
+  }
+  ltask *t = ldeque_take(&ltasks.deques[ltask_deque], 0);
+  for (int i = 1; !t && i < ltasks.size; i++) {
+    t = ldeque_take(&ltasks.deques[(ltask_deque + i) % ltasks.size], 1);
+  }
+  if (t) {
+    __atomic_sub_fetch(&ltasks.queued, 1, __ATOMIC_SEQ_CST);
+  }
+  return t;
+}
+
+void ltasks_wake(void) {
+  /**
+   * Wake the waiting threads, if there are any, to look again.
+   */
+  if (__atomic_load_n(&ltasks.idle, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&ltasks.lock);
+    pthread_cond_broadcast(&ltasks.wake);
+    pthread_mutex_unlock(&ltasks.lock);
+  }
+}
+
+void ltask_del(ltask *t) {
+  /**
+   * Give up a reference to a task, freeing it once it has no owners.
+   */
+  if (LATOMIC_ADD(t->refs, -1) > 0) {
+    return;
+  }
+  if (t->env) {
+    lenv_del(t->env);
+  }
+  if (t->expr) {
+    lval_del(t->expr);
+  }
+  if (t->result) {
+    lval_del(t->result);
+  }
+  free(t);
+}
+
+void ltask_run(ltask *t) {
+  /**
+   * Evaluate a task taken from a deque, then give up the deque's reference.
+   * It runs as a worker whichever thread runs it, so it can't use def.
+   *
+   * ltask* t: The task.
+   */
+  linterp *outer = linterp_enter(t->interp);
+  int worker = lthread_worker;
+  lthread_worker = 1;
+  lval *result = lval_eval(t->env, t->expr);
+  lthread_worker = worker;
+  lenv_del(t->env);
+  linterp_leave(outer);
+  t->env = NULL;
+  t->expr = NULL;
+  t->result = result;
+  __atomic_store_n(&t->done, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&t->interp->futures, 1, __ATOMIC_SEQ_CST);
+  ltasks_wake();
+  ltask_del(t);
+}
+
+int ltask_finished(ltask *t) {
+  /**
+   * Whether a task is done, or with NULL whether every future of the
+   * current interpreter is.
+   */
+  if (t) {
+    return __atomic_load_n(&t->done, __ATOMIC_SEQ_CST);
+  }
+  return __atomic_load_n(&linterp_self->futures, __ATOMIC_SEQ_CST) == 0;
+}
+
+void ltask_wait(ltask *t) {
+  /**
+   * Wait for a task to be done, or with NULL for every future of the
+   * current interpreter. The thread runs waiting tasks meanwhile, so
+   * awaiting a task that has not started usually runs it here, and only
+   * sleeps once there are none left.
+   *
+   * ltask* t: The task, or NULL.
+   */
+  while (!ltask_finished(t)) {
+    ltask *next = ltask_find();
+    if (next) {
+      ltask_run(next);
+      continue;
+    }
+    pthread_mutex_lock(&ltasks.lock);
+    __atomic_add_fetch(&ltasks.idle, 1, __ATOMIC_SEQ_CST);
+    while (!ltask_finished(t) &&
+           __atomic_load_n(&ltasks.queued, __ATOMIC_SEQ_CST) == 0) {
+      pthread_cond_wait(&ltasks.wake, &ltasks.lock);
+    }
+    __atomic_sub_fetch(&ltasks.idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ltasks.lock);
+  }
+}
+
+void ltasks_settle(void) {
+  /**
+   * Wait for every future to finish, if the pool has workers that may be
+   * reading the global enviroment.
+   */
+  if (__atomic_load_n(&ltasks.size, __ATOMIC_SEQ_CST) > 1) {
+    ltask_wait(NULL);
+  }
+}
+
+void *ltask_worker_main(void *arg) {
+  ltask_deque = (intptr_t)arg;
+  lthread_worker = 1;
+  // Wait on a task that is never done, running the others forever.
+  ltask never = {0};
+  ltask_wait(&never);
+  return NULL;
+}
+
+void ltasks_atfork_child(void) {
+  /**
+   * A forked child has none of its parent's threads, so the next future in
+   * it starts a pool of its own. Tasks still waiting in the deques are
+   * dropped, see linterp_settle.
+   */
+  static const pthread_once_t once = PTHREAD_ONCE_INIT;
+  if (ltasks.size > 1) {
+    __atomic_sub_fetch(&lthreads_active, 1, __ATOMIC_SEQ_CST);
+  }
+  for (int i = 0; i < ltasks.size; i++) {
+    free(ltasks.deques[i].items);
+  }
+  free(ltasks.deques);
+  ltasks.once = once;
+  ltasks.size = 0;
+  ltasks.deques = NULL;
+  ltasks.queued = 0;
+  ltasks.idle = 0;
+  pthread_mutex_init(&ltasks.lock, NULL);
+  pthread_cond_init(&ltasks.wake, NULL);
+}
+
+void ltasks_start(void) {
+  /**
+   * Start the pool, with a worker for each thread from lthreads_wanted but
+   * the one calling. With a single thread there are no workers and each
+   * future runs when it is awaited.
+   */
+  int size = lthreads_wanted();
+
+  static int registered = 0;
+  if (!registered) {
+    pthread_atfork(NULL, NULL, ltasks_atfork_child);
+    registered = 1;
+  }
+
+  ltasks.deques = lmalloc(sizeof(ldeque) * size);
+  for (int i = 0; i < size; i++) {
+    pthread_mutex_init(&ltasks.deques[i].lock, NULL);
+    ltasks.deques[i].items = NULL;
+    ltasks.deques[i].capacity = 0;
+    ltasks.deques[i].top = 0;
+    ltasks.deques[i].bottom = 0;
+  }
+  if (size > 1) {
+    __atomic_add_fetch(&lthreads_active, 1, __ATOMIC_SEQ_CST);
+  }
+  __atomic_store_n(&ltasks.size, size, __ATOMIC_SEQ_CST);
+  for (int i = 1; i < size; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, ltask_worker_main, (void *)(intptr_t)i) !=
+        0) {
+      break;
+    }
+    pthread_detach(thread);
+  }
+}
+
+lenv *ltask_env(lenv *env) {
+  /**
+   * The enviroment a future is evaluated in. It holds the bindings visible
+   * from env that are not global, as they are now, so the task does not
+   * depend on the caller's enviroments, which may be gone by the time it
+   * runs.
+   *
+   * lenv* env: The enviroment of the caller of future.
+   *
+   * Returns:
+   * lenv*: A new enviroment whose parent is the global enviroment.
+   */
+  lenv *copy = lenv_new();
+  copy->parent = linterp_self->env;
+  for (; env && env != linterp_self->env; env = env->parent) {
+    for (int i = 0; i < env->count; i++) {
+      lval key;
+      key.sym = env->syms[i];
+      key.hash = env->hashes[i];
+      // Inner enviroments come first and shadow the outer ones.
+      if (lenv_find(copy, &key) == -1) {
+        lenv_put(copy, &key, env->vals[i]);
+      }
+    }
+  }
+  return copy;
+}
+
+lval *builtin_future(lenv *env, lval *a) {
+  /**
+   * Start evaluating a Q-expression on the pool of worker threads and
+   * return a future for its value, see builtin_await. The expression sees
+   * the variables of the caller as they are when future is called. Like the
+   * function given to pmap it should be pure and can't use def.
+   *
+   * Example usage:
+   *  (\ {a b} {+ (await a) (await b)}) (future {fib 20}) (future {fib 21})
+   *
+   * lenv* env: The enviroment of the caller.
+   * lval* a: The arguments, a single Q-expression.
+   *
+   * Returns:
+   * lval*: A future.
+   */
+  LASSERT_NUM("future", a, 1);
+  LASSERT_TYPE("future", a, 0, LVAL_QEXPR);
+
+  lval *expr = builtin_eval_expr(a);
+  ltask *t = lmalloc(sizeof(ltask));
+  t->refs = 1;
+  t->done = 0;
+  t->env = NULL;
+  t->expr = NULL;
+  t->result = NULL;
+  t->interp = linterp_self;
+
+#ifdef LISPY_GC
+  // The collector only knows about the calling thread, so evaluate it now,
+  // but as a worker would so it is held to the same rules either way.
+  int worker = lthread_worker;
+  lthread_worker = 1;
+  t->result = lval_eval(ltask_env(env), expr);
+  lthread_worker = worker;
+  t->done = 1;
+#else
+  pthread_once(&ltasks.once, ltasks_start);
+  t->refs = 2; // The future and the deque.
+  t->env = ltask_env(env);
+  t->expr = expr;
+  __atomic_add_fetch(&linterp_self->futures, 1, __ATOMIC_SEQ_CST);
+  ldeque_push(&ltasks.deques[ltask_deque], t);
+  __atomic_add_fetch(&ltasks.queued, 1, __ATOMIC_SEQ_CST);
+  ltasks_wake();
+#endif
+  return lval_fut(t);
+}
+
+lval *builtin_await(lenv *env, lval *a) {
+  /**
+   * Wait for the value of a future, running other futures meanwhile.
+   *
+   * lenv* env: The enviroment of the caller.
+   * lval* a: The arguments, a single future.
+   *
+   * Returns:
+   * lval*: The value of the future's expression, which may be an error.
+   */
+  LASSERT_NUM("await", a, 1);
+  LASSERT_TYPE("await", a, 0, LVAL_FUT);
+
+  ltask *t = a->cell[0]->task;
+  ltask_wait(t);
+  lval *result = lval_copy(t->result);
+  lval_del(a);
+  return result;
+}
+
+lval *builtin_len(lenv *env, lval *a) {
+  /**
+   * Get the number of elements in a list.
+   *
+   * Example usage:
+   *  len {a b c}
+   *
+   * lenv* env: The enviroment.
+   * lval* a: The arguments, a Q-expression.
+   */
+  LASSERT_NUM("len", a, 1);
+  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+
+  lval *x = lval_num(a->cell[0]->count);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_nth(lenv *env, lval *a) {
+  /**
+   * Get an element of a list by its index, counting from 0.
+   *
+   * Example usage:
+   *  nth 1 {a b c}
+   *
+   * lenv* env: The enviroment.
+   * lval* a: The arguments, a number and a Q-expression.
+   */
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+  long i = lval_num_of(a->cell[0]);
+  lval *list = a->cell[1];
+  LASSERT(a, i >= 0 && i < list->count,
+          "Index %li out of range for a list of %i elements.", i,
+          list->count);
+
+  lval *x = lval_copy(list->cell[i]);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_reverse(lenv *env, lval *a) {
+  /**
+   * Get a list with the elements of another in the opposite order.
+   *
+   * Example usage:
+   *  reverse {1 2 3}
+   *
+   * lenv* env: The enviroment.
+   * lval* a: The arguments, a Q-expression.
+   */
+  LASSERT_NUM("reverse", a, 1);
+  LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+  lval *list = a->cell[0];
+  lval *x = lval_qexpr();
+  lval_reserve(x, list->count);
+  for (int i = list->count - 1; i >= 0; i--) {
+    x->cell[x->count++] = lval_copy(list->cell[i]);
+  }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_eval(lenv *env, lval *a) {
+  lval *v = builtin_eval_expr(a);
+  if (lval_type(v) == LVAL_ERR) {
+    return v;
+  }
+  // evaluate the S-expression
+  return lval_eval(env, v);
+}
+
+lval *builtin_eval_expr(lval *a) {
+  /**
+   * Turn the argument of eval into the S-expression to evaluate. Used by
+   * builtin_eval, and by lval_eval so that it is evaluated as a tail call.
+   *
+   * lval* a: The arguments to eval.
+   *
+   * Returns:
+   * lval*: An S-expression or an error.
+   */
+  LASSERT_NUM("eval", a, 1);
+  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+  // take the first child from a and delete a
+  lval *v = lval_unshare(lval_take(a, 0));
+  // set the type of v to S-expression
+  v->type = LVAL_SEXPR;
+  return v;
+}
+
+lval *builtin_add(lenv *env, lval *a) { return builtin_op(env, a, "+"); }
+
+lval *builtin_sub(lenv *env, lval *a) { return builtin_op(env, a, "-"); }
+
+lval *builtin_div(lenv *env, lval *a) { return builtin_op(env, a, "/"); }
+
+lval *builtin_mul(lenv *env, lval *a) { return builtin_op(env, a, "*"); }
+
+lval *builtin_op(lenv *env, lval *a, char *op) {
+  LASSERT_NOT_EMPTY(op, a);
+  for (int i = 0; i < a->count; i++) {
+    if (lval_type(a->cell[i]) != LVAL_NUM) {
+      lval_del(a);
+      return lval_err("Cannot operate on non-number");
+    }
+  }
+
+  // Work on plain longs so no intermediate numbers are allocated.
+  long x = lval_num_of(a->cell[0]);
+
+  // if only one expression and - then negate
+  if ((strcmp(op, "-") == 0) && a->count == 1) {
+    x = -x;
+  }
+
+  for (int i = 1; i < a->count; i++) {
+    long y = lval_num_of(a->cell[i]);
+
+    if (strcmp(op, "+") == 0) {
+      x += y;
+    }
+    if (strcmp(op, "-") == 0) {
+      x -= y;
+    }
+    if (strcmp(op, "*") == 0) {
+      x *= y;
+    }
+    if (strcmp(op, "/") == 0) {
+      if (y == 0) {
+        lval_del(a);
+        return lval_err("Division By Zero!");
+      }
+      x /= y;
+    }
+  }
+  lval_del(a);
+  return lval_num(x);
+}
+
+lval *builtin(lenv *env, lval *a, char *func) {
+  if (strcmp("list", func) == 0) {
+    return builtin_list(env, a);
+  }
+  if (strcmp("eval", func) == 0) {
+    return builtin_eval(env, a);
+  }
+  if (strcmp("head", func) == 0) {
+    return builtin_head(env, a);
+  }
+  if (strcmp("tail", func) == 0) {
+    return builtin_tail(env, a);
+  }
+  if (strcmp("join", func) == 0) {
+    return builtin_join(env, a);
+  }
+  if (strstr("+-*/", func)) {
+    return builtin_op(env, a, func);
+  }
+  lval_del(a);
+  return lval_err("Unkown function");
+}
+
+lval *lval_read(mpc_ast_t *t) {
+
+  if (strstr(t->tag, "number")) {
+    return lval_read_num(t);
+  }
+  if (strstr(t->tag, "symbol")) {
+    return lval_sym(t->contents);
+  }
+  if (strstr(t->tag, "string")) {
+    return lval_read_str(t);
+  }
+
+  lval *x = NULL;
+  if (strcmp(t->tag, ">") == 0) {
+    x = lval_sexpr();
+  }
+  if (strstr(t->tag, "sexpr")) {
+    x = lval_sexpr();
+  }
+  if (strstr(t->tag, "qexpr")) {
+    x = lval_qexpr();
+  }
+
+  for (int i = 0; i < t->children_num; i++) {
+    if (strcmp(t->children[i]->contents, "(") == 0) {
+      continue;
+    }
+    if (strcmp(t->children[i]->contents, ")") == 0) {
+      continue;
+    }
+    if (strcmp(t->children[i]->contents, "{") == 0) {
+      continue;
+    }
+    if (strcmp(t->children[i]->contents, "}") == 0) {
+      continue;
+    }
+    if (strcmp(t->children[i]->tag, "regex") == 0) {
+      continue;
+    }
+    if (strstr(t->children[i]->tag, "comment")) {
+      continue;
+    }
+    x = lval_add(x, lval_read(t->children[i]));
+  }
+  return x;
+}
+
+lval *lval_pop(lval *v, int i) {
+  /**
+   * Remove a child. Popping the first child is O(1), the slot it leaves is
+   * reused by lval_reserve. The array is never shrunk. v must be the only
+   * user of its array, see lval_own_cells.
+   *
+   * lval* v: An S-expression or Q-expression.
+   * int i: The index of the child.
+   *
+   * Returns:
+   * lval*: The child.
+   */
+  lval_forget_code(v);
+  lval *x = v->cell[i];
+
+  if (i == 0) {
+    v->cell++;
+  } else {
+    memmove(&v->cell[i], &v->cell[i + 1],
+            sizeof(lval *) * (v->count - i - 1));
+  }
+  v->count--;
+  // Go back to the start of the array once it is empty.
+  if (v->count == 0) {
+    v->cell = v->cells->items;
+  }
+  return x;
+}
+
+lval *lval_take(lval *v, int i) {
+  lval *x = lval_pop(v, i);
+  lval_del(v);
+  return x;
+}
+
+// BYTECODE
+
+/**
+ * Lambda bodies are compiled to bytecode to save walking them on each call.
+ * On fib 27 (bench/fib.lspy) it made calls 1.7x faster than walking, and
+ * 2.4x once formals were resolved to slots. Most of what was left was
+ * allocation. Calls not in tail position now run in a frame over their
+ * arguments on the VM stack, see lvm_frame_call, and arithmetic on two
+ * small numbers skips the S-Expression of arguments, see lvm_arith, which
+ * took it to 7.9x (0.46s to 0.058s, best of 9), still short of the 10x hoped
+ * for. Each name that is not a formal is still looked up by name on every
+ * call, as with dynamic scope a caller may have bound it, and other
+ * builtins still take their arguments as an S-Expression.
+ */
+
+/**
+ * The instructions of an lcode, each is followed by the operands listed.
+ * The value stack is an array of lval* local to lvm_run.
+ */
+enum {
+  LOP_CONST,    // k: Push consts[k].
+  LOP_LOCAL,    // i k: Push local i, bound to the symbol consts[k].
+  LOP_NAME,     // k: Push the value bound to the symbol consts[k].
+  LOP_CALL,     // n: Apply the function under n arguments to them.
+  LOP_TAILCALL, // n: As LOP_CALL, then return the result.
+  LOP_IF,       // k pc: Jump to pc unless consts[k] is bound to builtin_if.
+  LOP_BRANCH,   // pc end: Pop the condition of an if, jump to pc if false.
+                // If it is not a number the error is the result of the if,
+                // it is pushed and execution goes to end or returns if -1.
+  LOP_JUMP,     // pc: Jump to pc.
+  LOP_RETURN    // Return the top of the stack.
+};
+
+void lval_forget_code(lval *v) {
+  /**
+   * Drop the bytecode cached on an S-expression or Q-expression, called
+   * before it is changed.
+   *
+   * lval* v: An lval* of type LVAL_SEXPR or LVAL_QEXPR.
+   */
+  if (v->code) {
+    lcode_del(v->code);
+    v->code = NULL;
+  }
+}
+
+void lcode_del(lcode *c) {
+  for (int i = 0; i < c->const_count; i++) {
+    lval_del(c->consts[i]);
+  }
+  free(c->consts);
+  free(c->ops);
+  free(c);
+}
+
+int lcode_emit(lcode *c, int op) {
+  /**
+   * Append an instruction or operand.
+   *
+   * Returns:
+   * int: Where it was put, so a jump target can be patched later.
+   */
+  if (c->count == c->capacity) {
+    c->capacity = c->capacity ? c->capacity * 2 : 16;
+    c->ops = lrealloc(c->ops, sizeof(int) * c->capacity);
+  }
+  c->ops[c->count] = op;
+  return c->count++;
+}
+
+int lcode_const(lcode *c, lval *v) {
+  /**
+   * Add a constant to the pool of an lcode.
+   *
+   * lval* v: The constant, a copy is kept.
+   *
+   * Returns:
+   * int: The index of the constant.
+   */
+  c->consts = lrealloc(c->consts, sizeof(lval *) * (c->const_count + 1));
+  c->consts[c->const_count] = lval_copy(v);
+  return c->const_count++;
+}
+
+void lcode_push(lcode *c, int n) {
+  // Track the depth of the value stack, n values are pushed or popped.
+  c->depth += n;
+  if (c->depth > c->max_stack) {
+    c->max_stack = c->depth;
+  }
+}
+
+int lcode_slot(lval *formals, char *sym) {
+  /**
+   * Find where a formal will be bound in the enviroment of a call. Formals
+   * are bound in order, skipping '&' and repeated names.
+   *
+   * lval* formals: The formals of the lambda.
+   * char* sym: An interned name.
+   *
+   * Returns:
+   * int: The index into env->syms and env->vals, or -1 if not a formal.
+   */
+  int slot = 0;
+  for (int i = 0; i < formals->count; i++) {
+    char *name = formals->cell[i]->sym;
+    int repeated = name == lsym_ampersand();
+    for (int j = 0; j < i && !repeated; j++) {
+      repeated = formals->cell[j]->sym == name;
+    }
+    if (repeated) {
+      continue;
+    }
+    if (name == sym) {
+      return slot;
+    }
+    slot++;
+  }
+  return -1;
+}
+
+void lcode_compile_sexpr(lcode *c, lval *formals, lval *v, int tail);
+
+void lcode_compile_expr(lcode *c, lval *formals, lval *x) {
+  /**
+   * Compile code that pushes the value of an expression.
+   *
+   * lcode* c: The code being compiled.
+   * lval* formals: The formals of the lambda, they are read by slot.
+   * lval* x: The expression.
+   */
+  switch (lval_type(x)) {
+  case LVAL_SEXPR:
+    lcode_compile_sexpr(c, formals, x, 0);
+    return;
+  case LVAL_SYM: {
+    int i = lcode_slot(formals, x->sym);
+    if (i != -1) {
+      lcode_emit(c, LOP_LOCAL);
+      lcode_emit(c, i);
+    } else {
+      lcode_emit(c, LOP_NAME);
+    }
+    lcode_emit(c, lcode_const(c, x));
+    break;
+  }
+  default:
+    // Everything else evaluates to itself.
+    lcode_emit(c, LOP_CONST);
+    lcode_emit(c, lcode_const(c, x));
+    break;
+  }
+  lcode_push(c, 1);
+}
+
+void lcode_compile_sexpr(lcode *c, lval *formals, lval *v, int tail) {
+  /**
+   * Compile code that evaluates the children of an S-expression and applies
+   * the first to the rest. An if with two Q-expression branches is compiled
+   * inline, guarded in case if has been redefined.
+   *
+   * lval* v: The S-expression, or a Q-expression being run as one.
+   * int tail: Whether v is in tail position, in which case the code returns.
+   */
+  if (v->count == 0) {
+    // Evaluates to an empty S-expression, even when v is a Q-expression.
+    lval *empty = lval_sexpr();
+    lcode_emit(c, LOP_CONST);
+    lcode_emit(c, lcode_const(c, empty));
+    lval_del(empty);
+    lcode_push(c, 1);
+    if (tail) {
+      lcode_emit(c, LOP_RETURN);
+    }
+    return;
+  }
+  if (v->count == 1) {
+    // Evaluates to its child, as a branch such as {n} does.
+    lcode_compile_expr(c, formals, v->cell[0]);
+    if (tail) {
+      lcode_emit(c, LOP_RETURN);
+    }
+    return;
+  }
+
+  int ends[3];
+  int end_count = 0;
+  int generic = -1;
+  if (v->count == 4 && lval_type(v->cell[0]) == LVAL_SYM &&
+      v->cell[0]->sym == lsym_if() && lval_type(v->cell[2]) == LVAL_QEXPR &&
+      lval_type(v->cell[3]) == LVAL_QEXPR) {
+    lcode_emit(c, LOP_IF);
+    lcode_emit(c, lcode_const(c, v->cell[0]));
+    generic = lcode_emit(c, 0);
+
+    lcode_compile_expr(c, formals, v->cell[1]);
+    lcode_emit(c, LOP_BRANCH);
+    int otherwise = lcode_emit(c, 0);
+    if (tail) {
+      lcode_emit(c, -1);
+    } else {
+      ends[end_count++] = lcode_emit(c, 0);
+    }
+    lcode_push(c, -1);
+
+    // Each branch leaves one value on the stack, or returns.
+    for (int i = 2; i <= 3; i++) {
+      lcode_compile_sexpr(c, formals, v->cell[i], tail);
+      if (!tail) {
+        lcode_emit(c, LOP_JUMP);
+        ends[end_count++] = lcode_emit(c, 0);
+      }
+      lcode_push(c, -1);
+      if (i == 2) {
+        c->ops[otherwise] = c->count;
+      }
+    }
+    c->ops[generic] = c->count;
+  }
+
+  for (int i = 0; i < v->count; i++) {
+    lcode_compile_expr(c, formals, v->cell[i]);
+  }
+  lcode_emit(c, tail ? LOP_TAILCALL : LOP_CALL);
+  lcode_emit(c, v->count - 1);
+  lcode_push(c, -v->count + 1);
+
+  for (int i = 0; i < end_count; i++) {
+    c->ops[ends[i]] = c->count;
+  }
+}
+
+lcode *lcode_compile(lval *body, lval *formals) {
+  /**
+   * Compile the body of a lambda.
+   *
+   * lval* body: The body, a Q-expression.
+   * lval* formals: The formals of the lambda.
+   *
+   * Returns:
+   * lcode*: The code, to be run by lvm_run.
+   */
+  lcode *c = lmalloc(sizeof(lcode));
+  memset(c, 0, sizeof(lcode));
+  lcode_compile_sexpr(c, formals, body, 1);
+  return c;
+}
+
+lcode *lcode_of(lval *body, lval *formals) {
+  /**
+   * Get the code of a lambda body, compiling it the first time. A body may
+   * be shared by threads, so the code is published with a CAS and a thread
+   * that loses the race frees what it compiled.
+   *
+   * lval* body: The body, a Q-expression.
+   * lval* formals: The formals of the lambda.
+   *
+   * Returns:
+   * lcode*: The code cached on the body.
+   */
+  lcode *c = __atomic_load_n(&body->code, __ATOMIC_ACQUIRE);
+  if (!c) {
+    lcode *fresh = lcode_compile(body, formals);
+    if (__atomic_compare_exchange_n(&body->code, &c, fresh, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      c = fresh;
+    } else {
+      lcode_del(fresh);
+    }
+  }
+  return c;
+}
+
+lval *lvm_arith(lbuiltin builtin, long x, long y) {
+  /**
+   * Apply an arithmetic or comparison builtin to two numbers as the builtin
+   * would, without making an S-expression of them.
+   *
+   * Returns:
+   * lval*: The result, or NULL if builtin is not one of them.
+   */
+  if (builtin == builtin_add) {
+    return lval_num(x + y);
+  }
+  if (builtin == builtin_sub) {
+    return lval_num(x - y);
+  }
+  if (builtin == builtin_mul) {
+    return lval_num(x * y);
+  }
+  if (builtin == builtin_lt) {
+    return lval_num(x < y);
+  }
+  if (builtin == builtin_gt) {
+    return lval_num(x > y);
+  }
+  if (builtin == builtin_le) {
+    return lval_num(x <= y);
+  }
+  if (builtin == builtin_ge) {
+    return lval_num(x >= y);
+  }
+  if (builtin == builtin_eq) {
+    return lval_num(x == y);
+  }
+  if (builtin == builtin_neq) {
+    return lval_num(x != y);
+  }
+  return NULL;
+}
+
+lval *lvm_call(lenv *env, lval **items, int n, lval **next) {
+  /**
+   * Apply the function items[0] to the arguments items[1..n].
+   *
+   * lenv* env: The enviroment of the caller.
+   * lval** items: The function and its arguments, consumed.
+   * int n: The number of arguments.
+   * lval** next: If not NULL this is a tail call. Instead of calling a
+   *              lambda, if or eval the expression is put here for lval_eval
+   *              to continue with.
+   *
+   * Returns:
+   * lval*: The result, or NULL if the call was put in next.
+   */
+  lval *f = items[0];
+  int is_builtin = lval_type(f) == LVAL_FUN && f->builtin &&
+                   f->builtin != builtin_if && f->builtin != builtin_eval;
+
+  // Arithmetic on two small numbers, most builtin calls in numeric code,
+  // needs no arguments S-expression.
+  if (is_builtin && n == 2 && lval_is_fixnum(items[1]) &&
+      lval_is_fixnum(items[2])) {
+    lval *result = lvm_arith(f->builtin, lval_num_of(items[1]),
+                             lval_num_of(items[2]));
+    if (result) {
+      lval_del(f);
+      return result;
+    }
+  }
+
+  // The common case of a builtin with arguments can skip lval_apply.
+  if (is_builtin && n > 0) {
+    int ok = 1;
+    for (int i = 1; i <= n; i++) {
+      ok = ok && lval_type(items[i]) != LVAL_ERR;
+    }
+    if (ok) {
+      lval *args = lval_sexpr();
+      lval_reserve(args, n);
+      args->count = n;
+      memcpy(args->cell, &items[1], sizeof(lval *) * n);
+      lval *result = f->builtin(env, args);
+      lval_del(f);
+      return result;
+    }
+  }
+
+  lval *v = lval_sexpr();
+  lval_reserve(v, n + 1);
+  v->count = n + 1;
+  memcpy(v->cell, items, sizeof(lval *) * v->count);
+  if (next && !is_builtin) {
+    *next = v;
+    return NULL;
+  }
+  return lval_apply(env, v);
+}
+
+/**
+ * The most formals a lambda may have for lvm_frame_call, whose names are
+ * kept in arrays on the C stack.
+ */
+#define LVM_FRAME_MAX 8
+
+lval *lvm_frame_call(lenv *env, lval **items, int n) {
+  /**
+   * Call a lambda, with nothing bound yet, given exactly as many arguments
+   * as it has formals. Unlike lval_frame this makes no new lambda and no
+   * S-expression of the arguments. The frame is an lenv whose values are
+   * the arguments where they lie on the caller's stack and whose names are
+   * the formals in arrays on the C stack, looked up without a table. It is
+   * still the parent of whatever the body calls, for dynamic scope. Should
+   * the body bind a name in it, with = or through eval, lenv_put gives it
+   * arrays of its own first.
+   *
+   * lenv* env: The enviroment of the caller.
+   * lval** items: The function and its arguments, consumed on success.
+   *               They stay in the caller's stack, below its top, so a
+   *               collection while the body runs still sees them.
+   * int n: The number of arguments.
+   *
+   * Returns:
+   * lval*: The result, or NULL if this is not such a call, in which case
+   *        nothing is consumed.
+   */
+  lval *f = items[0];
+  if (n == 0 || n > LVM_FRAME_MAX || lval_type(f) != LVAL_FUN ||
+      f->builtin || f->env->count || f->formals->count != n) {
+    return NULL;
+  }
+  char *syms[LVM_FRAME_MAX];
+  unsigned long hashes[LVM_FRAME_MAX];
+  for (int i = 0; i < n; i++) {
+    lval *formal = f->formals->cell[i];
+    if (formal->sym == lsym_ampersand() ||
+        lval_type(items[i + 1]) == LVAL_ERR) {
+      return NULL;
+    }
+    // A repeated formal is bound once by lenv_put, so leave it to it.
+    for (int j = 0; j < i; j++) {
+      if (syms[j] == formal->sym) {
+        return NULL;
+      }
+    }
+    syms[i] = formal->sym;
+    hashes[i] = formal->hash;
+  }
+
+  lenv *frame = lenv_new();
+  frame->parent = env;
+  frame->count = n;
+  frame->capacity = n;
+  frame->syms = syms;
+  frame->vals = &items[1];
+  frame->hashes = hashes;
+  frame->borrowed = 1;
+  for (int i = 0; i < n; i++) {
+    LATOMIC_ADD(lsym_of(syms[i])->shadows, 1);
+  }
+  LGC_ROOT_ENV(frame);
+#ifdef LISPY_GC
+  // Bodies called this way never reach the check in lval_eval_loop.
+  if (lval_pool.live + lenv_pool.live > lgc_threshold) {
+    lgc_collect();
+  }
+#endif
+
+  lval *next;
+  lval *result = lvm_run(frame, lcode_of(f->body, f->formals), &next);
+  if (!result) {
+    result = lval_apply(frame, next);
+  }
+
+  LGC_UNROOT_ENV(1);
+  if (frame->borrowed) {
+    for (int i = 0; i < n; i++) {
+      LATOMIC_ADD(lsym_of(syms[i])->shadows, -1);
+    }
+    frame->count = 0;
+    frame->syms = NULL;
+    frame->vals = NULL;
+    frame->hashes = NULL;
+  }
+  lenv_del(frame);
+  for (int i = 0; i <= n; i++) {
+    lval_del(items[i]);
+  }
+  return result;
+}
+
+lval *lvm_run(lenv *env, lcode *c, lval **next) {
+  /**
+   * Run the code of a lambda body.
+   *
+   * lenv* env: The enviroment of the lambda.
+   * lcode* c: The code.
+   * lval** next: Set to the expression to continue with if the body ends in
+   *              a tail call, otherwise set to NULL.
+   *
+   * Returns:
+   * lval*: The result, or NULL if next was set.
+   */
+  lval *small[32];
+  lval **stack =
+      c->max_stack <= 32 ? small : lmalloc(sizeof(lval *) * c->max_stack);
+  int sp = 0;
+  int *ops = c->ops;
+  int pc = 0;
+  lval *result = NULL;
+  *next = NULL;
+  LGC_ROOT_RANGE(stack, sp);
+
+  while (!result) {
+    switch (ops[pc]) {
+    case LOP_CONST:
+      stack[sp++] = lval_copy(c->consts[ops[pc + 1]]);
+      pc += 2;
+      break;
+    case LOP_LOCAL: {
+      int i = ops[pc + 1];
+      lval *sym = c->consts[ops[pc + 2]];
+      // The slot is only a guess, the body may be shared by lambdas whose
+      // formals were bound in a different order.
+      if (i < env->count && env->syms[i] == sym->sym) {
+        stack[sp++] = lval_copy(env->vals[i]);
+      } else {
+        stack[sp++] = lenv_get(env, sym);
+      }
+      pc += 3;
+      break;
+    }
+    case LOP_NAME:
+      stack[sp++] = lenv_get(env, c->consts[ops[pc + 1]]);
+      pc += 2;
+      break;
+    case LOP_CALL:
+    case LOP_TAILCALL: {
+      int n = ops[pc + 1];
+      if (ops[pc] == LOP_CALL) {
+        lval *x = lvm_frame_call(env, &stack[sp - n - 1], n);
+        if (x) {
+          sp -= n + 1;
+          stack[sp++] = x;
+          pc += 2;
+          break;
+        }
+      }
+      sp -= n + 1;
+      lval *x =
+          lvm_call(env, &stack[sp], n, ops[pc] == LOP_TAILCALL ? next : NULL);
+      if (ops[pc] == LOP_TAILCALL) {
+        result = x ? x : *next;
+      } else {
+        stack[sp++] = x;
+      }
+      pc += 2;
+      break;
+    }
+    case LOP_IF: {
+      lval *f = lenv_get(env, c->consts[ops[pc + 1]]);
+      int is_if = lval_type(f) == LVAL_FUN && f->builtin == builtin_if;
+      lval_del(f);
+      pc = is_if ? pc + 3 : ops[pc + 2];
+      break;
+    }
+    case LOP_BRANCH: {
+      lval *cond = stack[--sp];
+      if (lval_type(cond) == LVAL_NUM) {
+        pc = lval_num_of(cond) ? pc + 3 : ops[pc + 1];
+        lval_del(cond);
+        break;
+      }
+      lval *err = cond;
+      if (lval_type(cond) != LVAL_ERR) {
+        err = lval_err("The function %s expected %s but got %s", "if",
+                       ltype_name(LVAL_NUM), ltype_name(lval_type(cond)));
+        lval_del(cond);
+      }
+      if (ops[pc + 2] == -1) {
+        result = err;
+      } else {
+        stack[sp++] = err;
+        pc = ops[pc + 2];
+      }
+      break;
+    }
+    case LOP_JUMP:
+      pc = ops[pc + 1];
+      break;
+    case LOP_RETURN:
+      result = stack[--sp];
+      break;
+    }
+  }
+
+  LGC_UNROOT_RANGE(1);
+  if (stack != small) {
+    free(stack);
+  }
+  if (result == *next) {
+    return NULL;
+  }
+  return result;
+}
+
+lval *lval_eval_loop(lenv *env, lval *v, int evaluated) {
+  /**
+   * Evaluate an lval within the context of an enviroment.
+   *
+   * Expressions in tail position, the body of a lambda and the expression
+   * run by if or eval, are evaluated by going round the loop again rather
+   * than by recursing, so tail recursion runs in constant C stack. A lambda
+   * called in tail position replaces the lambda that called it, but its
+   * enviroment still has the caller's as its parent, as variables are
+   * scoped dynamically. The kept enviroments are dropped once every name
+   * they bind is bound again nearer the top, as in a loop that calls itself
+   * with the same formals, so tail recursion also runs in bounded memory.
+   *
+   * The body of a lambda is compiled the first time it is called and run by
+   * lvm_run. Other S-expressions, such as those run by eval, are walked.
+   *
+   * lenv* env: The enviroment to get variables from.
+   * lval* v: The lval to evaluate.
+   * int evaluated: Whether v is an S-expression whose children have already
+   *                been evaluated.
+   */
+
+  // The lambda whose body is being run, env is its enviroment. The
+  // enviroments between its parent and base belong to replaced lambdas.
+  lval *frame = NULL;
+  lenv *base = env;
+  lval *result;
+  LGC_ROOT(frame);
+
+  while (1) {
+#ifdef LISPY_GC
+    if (lval_pool.live + lenv_pool.live > lgc_threshold) {
+      LGC_ROOT(v);
+      LGC_ROOT_ENV(env);
+      lgc_collect();
+      LGC_UNROOT(1);
+      LGC_UNROOT_ENV(1);
+    }
+#endif
+    if (lval_type(v) == LVAL_SYM) {
+      result = lenv_get(env, v);
+      lval_del(v); // delete the LVAL_SYM as its been replaced
+      break;
+    }
+    if (lval_type(v) != LVAL_SEXPR) {
+      result = v;
+      break;
+    }
+
+    if (!evaluated) {
+      // The children are replaced in place.
+      v = lval_unshare(v);
+
+      // eval all chilren
+      LGC_ROOT(v);
+      LGC_ROOT_ENV(env);
+      for (int i = 0; i < v->count; i++) {
+        v->cell[i] = lval_eval(env, v->cell[i]);
+      }
+      LGC_UNROOT(1);
+      LGC_UNROOT_ENV(1);
+    }
+    evaluated = 0;
+
+    // if a child throws error
+    // take take that (del from v)
+    // and return
+    result = NULL;
+    for (int i = 0; i < v->count; i++) {
+      if (lval_type(v->cell[i]) == LVAL_ERR) {
+        result = lval_take(v, i);
+        break;
+      }
+    }
+    if (result) {
+      break;
+    }
+
+    // if v has no chilren
+    if (v->count == 0) {
+      result = v;
+      break;
+    }
+
+    // if v has one child take and return that
+    if (v->count == 1) {
+      result = lval_take(v, 0);
+      break;
+    }
+
+    // get first expre
+    lval *f = lval_pop(v, 0);
+    if (lval_type(f) != LVAL_FUN) {
+      result = lval_err("S-Expression starts with the incorrect type"
+                        "Got %s but expected %s.",
+                        ltype_name(lval_type(f)), ltype_name(LVAL_FUN));
+      lval_del(f);
+      lval_del(v);
+      break;
+    }
+
+    // if and eval continue with the expression they pick.
+    if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+      lval *next =
+          f->builtin == builtin_if ? builtin_if_branch(v) : builtin_eval_expr(v);
+      lval_del(f);
+      if (lval_type(next) == LVAL_ERR) {
+        result = next;
+        break;
+      }
+      v = next;
+      continue;
+    }
+
+    // evaluate using builtin
+    if (f->builtin) {
+      result = f->builtin(env, v);
+      lval_del(f);
+      break;
+    }
+
+    lval *bound = lval_frame(f, v);
+    if (bound) {
+      f = bound;
+    } else {
+      // lval_bind binds arguments into the function so it needs its own
+      // copy.
+      f = lval_unshare(f);
+      f->formals = lval_unshare(f->formals);
+      result = lval_bind(env, f, v);
+      if (result) {
+        lval_del(f);
+        break;
+      }
+    }
+
+    // Run the body of f, in place of the current frame.
+    f->env->parent = env;
+    if (frame) {
+      frame->env = NULL;
+      lval_del(frame);
+      lenv *above = f->env;
+      for (lenv *e = env; e != base; e = above->parent) {
+        if (lenv_hidden(e, f->env)) {
+          above->parent = e->parent;
+          lenv_del(e);
+        } else {
+          above = e;
+        }
+      }
+    }
+    frame = f;
+    env = f->env;
+    result = lvm_run(env, lcode_of(f->body, f->formals), &v);
+    if (result) {
+      break;
+    }
+    // The body ended in a tail call, v has its evaluated children.
+    evaluated = 1;
+  }
+
+  LGC_UNROOT(1);
+  if (frame) {
+    lenv *kept = frame->env->parent;
+    lval_del(frame);
+    while (kept != base) {
+      lenv *parent = kept->parent;
+      lenv_del(kept);
+      kept = parent;
+    }
+  }
+  return result;
+}
+
+lval *lval_eval(lenv *env, lval *v) {
+  /**
+   * Evaluate an lval within the context of an enviroment.
+   *
+   * lenv* env: The enviroment to get variables from.
+   * lval* v: The lval to evaluate.
+   */
+  return lval_eval_loop(env, v, 0);
+}
+
+lval *lval_apply(lenv *env, lval *v) {
+  /**
+   * Apply the first child of an S-expression to the rest, which have
+   * already been evaluated.
+   *
+   * lenv* env: The enviroment of the caller.
+   * lval* v: The S-expression, consumed.
+   */
+  return lval_eval_loop(env, v, 1);
+}
+
+// IMAGES
+
+/**
+ * A heap image is the global enviroment written to a file by save-image, so
+ * it can be restored without parsing and evaluating the code that built it.
+ * The file is a header followed by records, each an lval or lenv laid out
+ * as it is in memory with the strings and arrays it owns after it. Pointers
+ * are stored as offsets from the start of the file, and symbols and
+ * builtins by name.
+ *
+ * linterp_load_image maps the file, checks every offset in it stays inside
+ * it, then fixes the pointers up in one pass over the records. The objects
+ * are then used where they are. Their counts of owners start at LIMAGE_REFS
+ * so they are never freed, and never changed in place as lval_unshare
+ * copies them first. The mapping is private, so the counts and bytecode
+ * cached on bodies are only written to memory.
+ */
+#define LIMAGE_MAGIC "LISPYIMG"
+#define LIMAGE_VERSION 1
+#define LIMAGE_REFS (INT_MAX / 2)
+
+enum { LIMAGE_LVAL, LIMAGE_LENV };
+
+typedef struct {
+  char magic[8];
+  int version;
+  // An image only loads in a build that lays the structs out the same.
+  int lval_size;
+  int lenv_size;
+  int lcells_size;
+  long size; // The size of the file.
+  long root; // Offset of the global enviroment, an lenv.
+} limage_header;
+
+typedef struct {
+  int kind;  // LIMAGE_LVAL or LIMAGE_LENV.
+  long size; // Bytes from this record to the next.
+} limage_record;
+
+struct limage {
+  char *base;
+  long size;
+  limage *next;
+};
+
+typedef struct {
+  char *buf;
+  long size;
+  long capacity;
+  // Where each object already written is, by its address.
+  void **keys;
+  long *offsets;
+  long table_size;
+  long count;
+  lenv *names; // The builtins, bound to their own names.
+  char *err;   // What could not be saved, or NULL.
+} limage_writer;
+
+#define LIMAGE_AT(w, off, type) ((type *)((w)->buf + (off)))
+
+long limage_alloc(limage_writer *w, long size) {
+  /**
+   * Add size bytes of zeros to the image, rounded up to keep records 8 byte
+   * aligned.
+   *
+   * Returns:
+   * long: The offset of the bytes.
+   */
+  size = (size + 7) & ~7L;
+  if (w->size + size > w->capacity) {
+    w->capacity = w->capacity * 2 > w->size + size ? w->capacity * 2
+                                                   : w->size + size;
+    w->buf = lrealloc(w->buf, w->capacity);
+  }
+  memset(w->buf + w->size, 0, size);
+  long off = w->size;
+  w->size += size;
+  return off;
+}
+
+long limage_slot(limage_writer *w, void *p) {
+  /**
+   * The slot for an address in the table of objects written, which is
+   * grown so it is never more than half full.
+   */
+  if ((w->count + 1) * 2 > w->table_size) {
+    void **keys = w->keys;
+    long *offsets = w->offsets;
+    long size = w->table_size;
+    w->table_size = size ? size * 2 : 1024;
+    w->keys = calloc(w->table_size, sizeof(void *));
+    w->offsets = lmalloc(sizeof(long) * w->table_size);
+    w->count = 0;
+    for (long i = 0; i < size; i++) {
+      if (keys[i]) {
+        long slot = limage_slot(w, keys[i]);
+        w->keys[slot] = keys[i];
+        w->offsets[slot] = offsets[i];
+        w->count++;
+      }
+    }
+    free(keys);
+    free(offsets);
+  }
+  long mask = w->table_size - 1;
+  long slot = ((uintptr_t)p >> 3) * 11400714819323198485UL & mask;
+  while (w->keys[slot] && w->keys[slot] != p) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+long limage_seen(limage_writer *w, void *p) {
+  long slot = limage_slot(w, p);
+  return w->keys[slot] ? w->offsets[slot] : 0;
+}
+
+void limage_remember(limage_writer *w, void *p, long off) {
+  long slot = limage_slot(w, p);
+  w->keys[slot] = p;
+  w->offsets[slot] = off;
+  w->count++;
+}
+
+long limage_record_new(limage_writer *w, int kind, long size) {
+  /**
+   * Add a record with room for size bytes.
+   *
+   * Returns:
+   * long: The offset of the object after the record.
+   */
+  long rec = limage_alloc(w, sizeof(limage_record) + size);
+  LIMAGE_AT(w, rec, limage_record)->kind = kind;
+  LIMAGE_AT(w, rec, limage_record)->size = w->size - rec;
+  return rec + sizeof(limage_record);
+}
+
+char *limage_builtin_name(limage_writer *w, lbuiltin func) {
+  /**
+   * A name a builtin is bound to, its own if it is one of lispy's or the
+   * one the host gave it in the global enviroment.
+   */
+  lenv *envs[2] = {w->names, linterp_self->env};
+  for (int j = 0; j < 2; j++) {
+    for (int i = 0; i < envs[j]->count; i++) {
+      lval *v = envs[j]->vals[i];
+      if (lval_type(v) == LVAL_FUN && v->builtin == func) {
+        return envs[j]->syms[i];
+      }
+    }
+  }
+  return NULL;
+}
+
+long limage_put_env(limage_writer *w, lenv *e, int root);
+
+lval *limage_put(limage_writer *w, lval *v) {
+  /**
+   * Write an lval and everything it holds to the image, once however many
+   * times it is shared.
+   *
+   * Returns:
+   * lval*: The lval as stored in a pointer to it, its offset or itself if
+   * it is a fixnum.
+   */
+  if (w->err || lval_is_fixnum(v)) {
+    return v;
+  }
+  // Objects in an image are never changed, so every symbol with the same
+  // name can be the same lval.
+  void *key = lval_type(v) == LVAL_SYM ? (void *)v->sym : v;
+  long off = limage_seen(w, key);
+  if (off) {
+    return (lval *)off;
+  }
+
+  char *str = NULL;
+  long extra = 0;
+  switch (v->type) {
+  case LVAL_STR:
+    str = v->str;
+    break;
+  case LVAL_ERR:
+    str = v->err;
+    break;
+  case LVAL_SYM:
+    str = v->sym;
+    break;
+  case LVAL_FUN:
+    if (v->builtin) {
+      str = limage_builtin_name(w, v->builtin);
+      if (!str) {
+        w->err = "a builtin with no name";
+        return v;
+      }
+    }
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (v->count) {
+      extra = offsetof(lcells, items) + sizeof(lval *) * v->count;
+    }
+    break;
+  case LVAL_FUT:
+    w->err = "a future";
+    return v;
+  }
+  if (str) {
+    extra = strlen(str) + 1;
+  }
+
+  off = limage_record_new(w, LIMAGE_LVAL, sizeof(lval) + extra);
+  long data = off + sizeof(lval);
+  limage_remember(w, key, off);
+  lval *x = LIMAGE_AT(w, off, lval);
+  x->type = v->type;
+  if (str) {
+    strcpy(LIMAGE_AT(w, data, char), str);
+  }
+
+  // Children are written after their parent, so x must be found again
+  // after each as the buffer may have moved.
+  switch (v->type) {
+  case LVAL_NUM:
+    x->num = v->num;
+    break;
+  case LVAL_STR:
+    x->str = (char *)data;
+    break;
+  case LVAL_ERR:
+    x->err = (char *)data;
+    break;
+  case LVAL_SYM:
+    x->sym = (char *)data;
+    x->hash = v->hash;
+    break;
+  case LVAL_FUN:
+    if (v->builtin) {
+      x->builtin = (lbuiltin)data;
+    } else {
+      long env = limage_put_env(w, v->env, 0);
+      LIMAGE_AT(w, off, lval)->env = (lenv *)env;
+      lval *formals = limage_put(w, v->formals);
+      LIMAGE_AT(w, off, lval)->formals = formals;
+      lval *body = limage_put(w, v->body);
+      LIMAGE_AT(w, off, lval)->body = body;
+    }
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    x->count = v->count;
+    if (v->count) {
+      long items = data + offsetof(lcells, items);
+      x->cells = (lcells *)data;
+      x->cell = (lval **)items;
+      lcells *c = LIMAGE_AT(w, data, lcells);
+      c->capacity = v->count;
+      c->shared = 1;
+      c->start = 0;
+      c->end = v->count;
+      for (int i = 0; i < v->count; i++) {
+        lval *child = limage_put(w, v->cell[i]);
+        LIMAGE_AT(w, items, lval *)[i] = child;
+      }
+    }
+    break;
+  }
+  return (lval *)off;
+}
+
+long limage_put_env(limage_writer *w, lenv *e, int root) {
+  /**
+   * Write an enviroment to the image. The global one leaves out the
+   * builtins still bound to their own names, as every interpreter has
+   * those.
+   *
+   * Returns:
+   * long: Its offset.
+   */
+  // Likewise lambdas with nothing bound yet can share one enviroment, which
+  // is remembered under the address of the writer.
+  void *key = e->count ? (void *)e : (void *)w;
+  long off = root ? 0 : limage_seen(w, key);
+  if (off) {
+    return off;
+  }
+
+  int *keep = lmalloc(sizeof(int) * (e->count + 1));
+  int count = 0;
+  long names = 0;
+  for (int i = 0; i < e->count; i++) {
+    lval *v = e->vals[i];
+    if (root && lval_type(v) == LVAL_FUN && v->builtin &&
+        limage_builtin_name(w, v->builtin) == e->syms[i]) {
+      continue;
+    }
+    keep[count++] = i;
+    names += strlen(e->syms[i]) + 1;
+  }
+  int table_size = root ? 0 : e->table_size;
+
+  long syms = sizeof(lenv);
+  long vals = syms + sizeof(char *) * count;
+  long hashes = vals + sizeof(lval *) * count;
+  long table = hashes + sizeof(unsigned long) * count;
+  long name = table + sizeof(int) * table_size;
+  off = limage_record_new(w, LIMAGE_LENV, name + names);
+  if (!root) {
+    limage_remember(w, key, off);
+  }
+
+  lenv *x = LIMAGE_AT(w, off, lenv);
+  x->count = count;
+  x->capacity = count;
+  x->table_size = table_size;
+  x->syms = (char **)(off + syms);
+  x->vals = (lval **)(off + vals);
+  x->hashes = (unsigned long *)(off + hashes);
+  x->table = table_size ? (int *)(off + table) : NULL;
+  if (table_size) {
+    memcpy(LIMAGE_AT(w, off + table, int), e->table,
+           sizeof(int) * table_size);
+  }
+  for (int j = 0; j < count; j++) {
+    char *sym = e->syms[keep[j]];
+    strcpy(LIMAGE_AT(w, off + name, char), sym);
+    LIMAGE_AT(w, off + syms, char *)[j] = (char *)(off + name);
+    LIMAGE_AT(w, off + hashes, unsigned long)[j] = e->hashes[keep[j]];
+    name += strlen(sym) + 1;
+  }
+  for (int j = 0; j < count; j++) {
+    lval *v = limage_put(w, e->vals[keep[j]]);
+    LIMAGE_AT(w, off + vals, lval *)[j] = v;
+  }
+  free(keep);
+  return off;
+}
+
+lval *builtin_save_image(lenv *env, lval *a) {
+  /**
+   * Write the global enviroment to a file, see linterp_load_image and
+   * "lispy --image". Everything bound in it can be saved but futures.
+   *
+   * Example usage:
+   *  save-image "prelude.img"
+   *
+   * lval* a: The arguments, the name of the file.
+   * Returns:
+   * lval*: An empty S-expression, or an error.
+   */
+  LASSERT_NUM("save-image", a, 1);
+  LASSERT_TYPE("save-image", a, 0, LVAL_STR);
+  LASSERT(a, !lthread_worker, "save-image can not be used inside pmap or future.");
+
+  limage_writer w = {0};
+  limage_alloc(&w, sizeof(limage_header));
+  w.names = lenv_new();
+  lenv_add_builtins(w.names);
+  long root = limage_put_env(&w, linterp_self->env, 1);
+  lenv_del(w.names);
+  free(w.keys);
+  free(w.offsets);
+
+  lval *result = NULL;
+  if (w.err) {
+    result = lval_err("save-image can not save %s.", w.err);
+  } else {
+    limage_header *h = LIMAGE_AT(&w, 0, limage_header);
+    memcpy(h->magic, LIMAGE_MAGIC, 8);
+    h->version = LIMAGE_VERSION;
+    h->lval_size = sizeof(lval);
+    h->lenv_size = sizeof(lenv);
+    h->lcells_size = sizeof(lcells);
+    h->size = w.size;
+    h->root = root;
+
+    FILE *f = fopen(a->cell[0]->str, "wb");
+    if (!f || fwrite(w.buf, 1, w.size, f) != (size_t)w.size) {
+      result = lval_err("Could not write image %s", a->cell[0]->str);
+    }
+    if (f && fclose(f) != 0 && !result) {
+      result = lval_err("Could not write image %s", a->cell[0]->str);
+    }
+  }
+  free(w.buf);
+  lval_del(a);
+  return result ? result : lval_sexpr();
+}
+
+static inline lval *limage_lval(char *base, lval *v) {
+  return !v || lval_is_fixnum(v) ? v : (lval *)(base + (uintptr_t)v);
+}
+
+#define LIMAGE_PTR(base, p, type) ((p) ? (type)((base) + (uintptr_t)(p)) : NULL)
+
+/**
+ * An image being checked before its offsets are turned into pointers, so
+ * that nothing in a damaged file is followed out of it.
+ */
+typedef struct {
+  char *base;
+  long size;
+  unsigned char *starts; // A bit for each 8 bytes, set where a record starts.
+} limage_reader;
+
+int limage_is(limage_reader *rd, uintptr_t off, int kind) {
+  /**
+   * Whether an offset is that of the object in a record of the given kind.
+   */
+  if (off < sizeof(limage_record) || off >= (uintptr_t)rd->size) {
+    return 0;
+  }
+  uintptr_t rec = off - sizeof(limage_record);
+  if (rec % 8 || !(rd->starts[rec / 64] & (1 << (rec / 8 % 8)))) {
+    return 0;
+  }
+  return ((limage_record *)(rd->base + rec))->kind == kind;
+}
+
+static inline int limage_ref(limage_reader *rd, lval *v) {
+  // Anything held by a value or bound in an enviroment is never NULL.
+  return v && (lval_is_fixnum(v) || limage_is(rd, (uintptr_t)v, LIMAGE_LVAL));
+}
+
+static inline int limage_span(void *p, size_t len, uintptr_t lo, uintptr_t hi,
+                              size_t align) {
+  // Whether len bytes at offset p lie inside [lo, hi).
+  uintptr_t off = (uintptr_t)p;
+  return off >= lo && off <= hi && len <= hi - off && off % align == 0;
+}
+
+static inline int limage_string(limage_reader *rd, void *p, uintptr_t lo,
+                                uintptr_t hi) {
+  // Whether a string at offset p ends inside [lo, hi).
+  uintptr_t off = (uintptr_t)p;
+  return off >= lo && off < hi && memchr(rd->base + off, '\0', hi - off);
+}
+
+int limage_valid(limage_reader *rd, long off) {
+  /**
+   * Whether the record at off is laid out as limage_put and limage_put_env
+   * write them. Every offset it holds must be inside the record, or be that
+   * of another record of the right kind.
+   */
+  limage_record *r = (limage_record *)(rd->base + off);
+  uintptr_t lo = off + sizeof(limage_record);
+  uintptr_t hi = off + r->size;
+
+  if (r->kind == LIMAGE_LENV) {
+    lenv *e = (lenv *)(r + 1);
+    if (hi - lo < sizeof(lenv) || e->parent || e->borrowed || e->count < 0 ||
+        e->table_size < 0 || (e->table_size & (e->table_size - 1))) {
+      return 0;
+    }
+    size_t count = e->count;
+    if (!limage_span(e->syms, sizeof(char *) * count, lo, hi, 8) ||
+        !limage_span(e->vals, sizeof(lval *) * count, lo, hi, 8) ||
+        !limage_span(e->hashes, sizeof(unsigned long) * count, lo, hi, 8)) {
+      return 0;
+    }
+    if (e->table_size
+            ? !limage_span(e->table, sizeof(int) * e->table_size, lo, hi, 4)
+            : e->table != NULL) {
+      return 0;
+    }
+    char **syms = LIMAGE_PTR(rd->base, e->syms, char **);
+    lval **vals = LIMAGE_PTR(rd->base, e->vals, lval **);
+    unsigned long *hashes = LIMAGE_PTR(rd->base, e->hashes, unsigned long *);
+    for (int i = 0; i < e->count; i++) {
+      if (!limage_string(rd, syms[i], lo, hi) ||
+          hashes[i] != lsym_hash(rd->base + (uintptr_t)syms[i]) ||
+          !limage_ref(rd, vals[i])) {
+        return 0;
+      }
+    }
+    int *table = LIMAGE_PTR(rd->base, e->table, int *);
+    for (int i = 0; i < e->table_size; i++) {
+      if (table[i] < -1 || table[i] >= e->count) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  lval *v = (lval *)(r + 1);
+  uintptr_t data = lo + sizeof(lval);
+  if (hi - lo < sizeof(lval)) {
+    return 0;
+  }
+  switch (v->type) {
+  case LVAL_NUM:
+    return 1;
+  case LVAL_STR:
+    return limage_string(rd, v->str, data, hi);
+  case LVAL_ERR:
+    return limage_string(rd, v->err, data, hi);
+  case LVAL_SYM:
+    return limage_string(rd, v->sym, data, hi) &&
+           v->hash == lsym_hash(rd->base + (uintptr_t)v->sym);
+  case LVAL_FUN:
+    if (v->builtin) {
+      return limage_string(rd, (void *)v->builtin, data, hi);
+    }
+    // The formals and body must be lvals of their own, see
+    // limage_valid_lambda.
+    return limage_is(rd, (uintptr_t)v->env, LIMAGE_LENV) &&
+           !lval_is_fixnum(v->formals) && limage_ref(rd, v->formals) &&
+           !lval_is_fixnum(v->body) && limage_ref(rd, v->body);
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (v->count < 0 || v->code) {
+      return 0;
+    }
+    if (v->count == 0) {
+      return !v->cells && !v->cell;
+    }
+    if ((uintptr_t)v->cells != data ||
+        (uintptr_t)v->cell != data + offsetof(lcells, items) ||
+        !limage_span(v->cell, sizeof(lval *) * (size_t)v->count, data, hi,
+                     8)) {
+      return 0;
+    }
+    lcells *c = (lcells *)(rd->base + data);
+    if (c->capacity != v->count || c->shared != 1 || c->start != 0 ||
+        c->end != v->count) {
+      return 0;
+    }
+    for (int i = 0; i < v->count; i++) {
+      if (!limage_ref(rd, c->items[i])) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  return 0;
+}
+
+int limage_valid_lambda(limage_reader *rd, lval *v) {
+  /**
+   * Whether a lambda holds a Q-Expression of symbols and a Q-Expression, as
+   * lval_call expects. Only asked once every record is known to be valid,
+   * as it looks into others.
+   */
+  lval *formals = (lval *)(rd->base + (uintptr_t)v->formals);
+  lval *body = (lval *)(rd->base + (uintptr_t)v->body);
+  if (formals->type != LVAL_QEXPR || body->type != LVAL_QEXPR) {
+    return 0;
+  }
+  lval **cell = (lval **)(rd->base + (uintptr_t)formals->cell);
+  for (int i = 0; i < formals->count; i++) {
+    if (lval_is_fixnum(cell[i]) ||
+        ((lval *)(rd->base + (uintptr_t)cell[i]))->type != LVAL_SYM) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+lval *limage_child(limage_reader *rd, lval *v, int i) {
+  /**
+   * The i-th lval an lval in an image holds, as an offset, for
+   * limage_acyclic. The children of an S-Expression or Q-Expression, or the
+   * formals and body of a lambda.
+   *
+   * Returns:
+   * lval*: The child, a fixnum or NULL past the last.
+   */
+  if (v->type == LVAL_FUN && !v->builtin) {
+    return i == 0 ? v->formals : i == 1 ? v->body : NULL;
+  }
+  if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && i < v->count) {
+    return ((lval **)(rd->base + (uintptr_t)v->cell))[i];
+  }
+  return NULL;
+}
+
+int limage_acyclic(limage_reader *rd) {
+  /**
+   * Whether no lval in an image holds itself. lispy can't make one, and
+   * compiling or printing one would never end. Only asked once every record
+   * is known to be valid, as it follows their offsets.
+   */
+  // 1 while an lval is on the path being followed, 2 once it is done.
+  unsigned char *state = calloc(rd->size / 8, 1);
+  uintptr_t *path = lmalloc(sizeof(uintptr_t) * (rd->size / 8));
+  int *next = lmalloc(sizeof(int) * (rd->size / 8));
+  int acyclic = 1;
+  for (long off = sizeof(limage_header); acyclic && off < rd->size;) {
+    limage_record *r = (limage_record *)(rd->base + off);
+    uintptr_t start = off + sizeof(limage_record);
+    off += r->size;
+    if (r->kind != LIMAGE_LVAL || state[start / 8]) {
+      continue;
+    }
+    long depth = 0;
+    path[depth] = start;
+    next[depth++] = 0;
+    state[start / 8] = 1;
+    while (acyclic && depth) {
+      lval *v = (lval *)(rd->base + path[depth - 1]);
+      lval *child = limage_child(rd, v, next[depth - 1]++);
+      if (!child) {
+        state[path[--depth] / 8] = 2;
+      } else if (!lval_is_fixnum(child)) {
+        uintptr_t c = (uintptr_t)child;
+        if (state[c / 8] == 1) {
+          acyclic = 0;
+        } else if (!state[c / 8]) {
+          state[c / 8] = 1;
+          path[depth] = c;
+          next[depth++] = 0;
+        }
+      }
+    }
+  }
+  free(state);
+  free(path);
+  free(next);
+  return acyclic;
+}
+
+int limage_check(char *base, long size, long root) {
+  /**
+   * Whether an image's records fill it exactly and are all valid, and its
+   * root is an enviroment. Nothing is changed, so a damaged image can be
+   * refused before any of it is used.
+   */
+  limage_reader rd = {base, size, calloc(size / 64 + 1, 1)};
+  int valid = 1;
+  for (long off = sizeof(limage_header); valid && off < size;) {
+    limage_record *r = (limage_record *)(base + off);
+    valid = size - off >= (long)sizeof(limage_record) &&
+            r->size >= (long)sizeof(limage_record) && r->size % 8 == 0 &&
+            r->size <= size - off &&
+            (r->kind == LIMAGE_LVAL || r->kind == LIMAGE_LENV);
+    if (valid) {
+      rd.starts[off / 64] |= 1 << (off / 8 % 8);
+      off += r->size;
+    }
+  }
+  valid = valid && limage_is(&rd, root, LIMAGE_LENV);
+  for (long off = sizeof(limage_header); valid && off < size;) {
+    valid = limage_valid(&rd, off);
+    off += ((limage_record *)(base + off))->size;
+  }
+  for (long off = sizeof(limage_header); valid && off < size;) {
+    limage_record *r = (limage_record *)(base + off);
+    lval *v = (lval *)(r + 1);
+    if (r->kind == LIMAGE_LVAL && v->type == LVAL_FUN && !v->builtin) {
+      valid = limage_valid_lambda(&rd, v);
+    }
+    off += r->size;
+  }
+  valid = valid && limage_acyclic(&rd);
+  free(rd.starts);
+  return valid;
+}
+
+char *limage_fix(char *base, limage_record *r) {
+  /**
+   * Turn the offsets in a record back into pointers, and names back into
+   * interned symbols and builtins.
+   *
+   * Returns:
+   * char*: NULL, or the name of a builtin this interpreter does not have.
+   */
+  if (r->kind == LIMAGE_LENV) {
+    lenv *e = (lenv *)(r + 1);
+    e->syms = LIMAGE_PTR(base, e->syms, char **);
+    e->vals = LIMAGE_PTR(base, e->vals, lval **);
+    e->hashes = LIMAGE_PTR(base, e->hashes, unsigned long *);
+    e->table = LIMAGE_PTR(base, e->table, int *);
+    for (int i = 0; i < e->count; i++) {
+      e->syms[i] = lsym_intern(base + (uintptr_t)e->syms[i], e->hashes[i]);
+      e->vals[i] = limage_lval(base, e->vals[i]);
+    }
+    return NULL;
+  }
+
+  lval *v = (lval *)(r + 1);
+  v->refs = LIMAGE_REFS;
+  switch (v->type) {
+  case LVAL_STR:
+    v->str = base + (uintptr_t)v->str;
+    break;
+  case LVAL_ERR:
+    v->err = base + (uintptr_t)v->err;
+    break;
+  case LVAL_SYM:
+    v->sym = lsym_intern(base + (uintptr_t)v->sym, v->hash);
+    break;
+  case LVAL_FUN:
+    if (v->builtin) {
+      char *name = base + (uintptr_t)v->builtin;
+      lval key = {.type = LVAL_SYM};
+      key.sym = lsym_intern(name, lsym_hash(name));
+      key.hash = lsym_hash(name);
+      int i = lenv_find(linterp_self->env, &key);
+      lval *f = i == -1 ? NULL : linterp_self->env->vals[i];
+      if (!f || lval_type(f) != LVAL_FUN || !f->builtin) {
+        return name;
+      }
+      v->builtin = f->builtin;
+    } else {
+      v->env = LIMAGE_PTR(base, v->env, lenv *);
+      v->formals = limage_lval(base, v->formals);
+      v->body = limage_lval(base, v->body);
+    }
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (v->cells) {
+      v->cells = LIMAGE_PTR(base, v->cells, lcells *);
+      v->cell = LIMAGE_PTR(base, v->cell, lval **);
+      v->cells->refs = LIMAGE_REFS;
+      for (int i = 0; i < v->count; i++) {
+        v->cell[i] = limage_lval(base, v->cell[i]);
+      }
+    }
+    break;
+  }
+  return NULL;
+}
+
+void limage_shadow(char *base, long root, limage_record *r, int n) {
+  /**
+   * Add n to the count of shadowing bindings of each name a fixed up record
+   * binds, if it is the enviroment of a lambda. Those shadow the global
+   * bindings, as lenv_copy would count them.
+   */
+  if (r->kind == LIMAGE_LENV && (char *)(r + 1) != base + root) {
+    lenv *e = (lenv *)(r + 1);
+    for (int i = 0; i < e->count; i++) {
+      LATOMIC_ADD(lsym_of(e->syms[i])->shadows, n);
+    }
+  }
+}
+
+lval *limage_load(char *filename) {
+  /**
+   * Map an image and bind what it holds in the global enviroment of the
+   * current interpreter, see linterp_load_image.
+   */
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return lval_err("Could not open image %s", filename);
+  }
+  struct stat st;
+  char *base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(limage_header)) {
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) {
+    return lval_err("Could not map image %s", filename);
+  }
+
+  limage_header *h = (limage_header *)base;
+  if (memcmp(h->magic, LIMAGE_MAGIC, 8) != 0 ||
+      h->version != LIMAGE_VERSION || h->lval_size != sizeof(lval) ||
+      h->lenv_size != sizeof(lenv) || h->lcells_size != sizeof(lcells) ||
+      h->size != st.st_size) {
+    munmap(base, st.st_size);
+    return lval_err("%s is not an image from this build of lispy", filename);
+  }
+
+  if (!limage_check(base, h->size, h->root)) {
+    munmap(base, st.st_size);
+    return lval_err("The image %s is damaged", filename);
+  }
+
+  // The one pass that changes the image. Bodies are compiled when first
+  // called, see lcode_of.
+  for (long off = sizeof(limage_header); off < h->size;) {
+    limage_record *r = (limage_record *)(base + off);
+    char *missing = limage_fix(base, r);
+    if (missing) {
+      lval *err = lval_err("The image %s uses the builtin %s which is not "
+                           "bound",
+                           filename, missing);
+      // Give back what the records before it counted.
+      for (long done = sizeof(limage_header); done < off;) {
+        limage_record *d = (limage_record *)(base + done);
+        limage_shadow(base, h->root, d, -1);
+        done += d->size;
+      }
+      munmap(base, st.st_size);
+      return err;
+    }
+    limage_shadow(base, h->root, r, 1);
+    off += r->size;
+  }
+
+  limage *m = lmalloc(sizeof(limage));
+  m->base = base;
+  m->size = h->size;
+  m->next = linterp_self->images;
+  linterp_self->images = m;
+
+  ltasks_settle();
+  lenv *root = (lenv *)(base + h->root);
+  for (int i = 0; i < root->count; i++) {
+    lval key = {.type = LVAL_SYM};
+    key.sym = root->syms[i];
+    key.hash = root->hashes[i];
+    lenv_put(linterp_self->env, &key, root->vals[i]);
+  }
+  return lval_sexpr();
+}
+
+int limage_owns(void *p) {
+  /**
+   * Whether an object is in one of the current interpreter's images.
+   */
+  for (limage *m = linterp_self ? linterp_self->images : NULL; m;
+       m = m->next) {
+    if ((char *)p >= m->base && (char *)p < m->base + m->size) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+#ifdef LISPY_GC
+void limage_mark(void) {
+  /**
+   * Mark the constants of the bytecode cached on bodies in the current
+   * interpreter's images. lgc_mark does not look inside image objects, and
+   * the constants, such as the () of an empty branch, are on the heap.
+   */
+  for (limage *m = linterp_self ? linterp_self->images : NULL; m;
+       m = m->next) {
+    for (long off = sizeof(limage_header); off < m->size;) {
+      limage_record *r = (limage_record *)(m->base + off);
+      lval *v = (lval *)(r + 1);
+      if (r->kind == LIMAGE_LVAL &&
+          (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->code) {
+        for (int i = 0; i < v->code->const_count; i++) {
+          lgc_mark(v->code->consts[i]);
+        }
+      }
+      off += r->size;
+    }
+  }
+}
+#endif
+
+void limage_unmap(limage *m) {
+  /**
+   * Free the bytecode compiled for bodies in an image and give back the
+   * bindings limage_load counted, then free the image.
+   */
+  limage_header *h = (limage_header *)m->base;
+  for (long off = sizeof(limage_header); off < m->size;) {
+    limage_record *r = (limage_record *)(m->base + off);
+    lval *v = (lval *)(r + 1);
+    if (r->kind == LIMAGE_LVAL &&
+        (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->code) {
+      lcode_del(v->code);
+    }
+    limage_shadow(m->base, h->root, r, -1);
+    off += r->size;
+  }
+  munmap(m->base, m->size);
+  free(m);
+}
+
+// INTERPRETER
+
+linterp *linterp_new(void) {
+  /**
+   * Create an interpreter, with its grammar built and the builtins bound in
+   * its global enviroment.
+   *
+   * Returns:
+   * linterp*: The interpreter, free it with linterp_del.
+   */
+  linterp *interp = lmalloc(sizeof(linterp));
+  interp->Number = mpc_new("number");
+  interp->Symbol = mpc_new("symbol");
+  interp->String = mpc_new("string");
+  interp->Comment = mpc_new("comment");
+  interp->Sexpr = mpc_new("sexpr");
+  interp->Qexpr = mpc_new("qexpr");
+  interp->Expr = mpc_new("expr");
+  interp->Lispy = mpc_new("lispy");
+
+  // Language definition
+  mpca_lang(MPCA_LANG_DEFAULT, "\
+				number: /-?[0-9]+/;\
+				symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;\
+				string: /\"(\\\\.|[^\"])*\"/ ;\
+        comment: /;[^\\r\\n]*/;\
+				sexpr: '(' <expr>* ')';\
+				qexpr: '{' <expr>* '}';\
+				expr: <number> | <symbol> | <sexpr> | \
+              <qexpr> | <string> | <comment>;\
+				lispy: /^/ <expr>+ /$/;\
+			",
+            interp->Number, interp->Symbol, interp->String, interp->Comment,
+            interp->Sexpr, interp->Qexpr, interp->Expr, interp->Lispy);
+
+  interp->env = NULL;
+  interp->syms.count = 0;
+  interp->syms.size = 0;
+  interp->syms.names = NULL;
+  interp->syms.hashes = NULL;
+  pthread_mutex_init(&interp->sym_lock, NULL);
+  interp->futures = 0;
+  interp->images = NULL;
+  interp->saved = NULL;
+  interp->saved_count = 0;
+
+  linterp *outer = linterp_enter(interp);
+  interp->ampersand = lsym_intern("&", lsym_hash("&"));
+  interp->sym_if = lsym_intern("if", lsym_hash("if"));
+  // Global enviroment.
+  interp->env = lenv_new();
+  // Bind builtin functions.
+  lenv_add_builtins(interp->env);
+  linterp_leave(outer);
+  return interp;
+}
+
+void linterp_del(linterp *interp) {
+  /**
+   * Delete an interpreter, its global enviroment and the names it interned.
+   * Values from it that the host still holds may only be deleted afterwards.
+   * Names still bound in their enviroments are freed once the last of those
+   * is deleted, the rest are freed now.
+   *
+   * linterp* interp: The interpreter, which must not be running.
+   */
+  linterp *outer = linterp_enter(interp);
+  ltasks_settle();
+  for (int i = 0; i < interp->saved_count; i++) {
+    lval_del(interp->saved[i]);
+  }
+  free(interp->saved);
+  interp->saved_count = 0;
+  lenv_del(interp->env);
+  linterp_leave(outer);
+#ifdef LISPY_GC
+  // Free its objects now, lenv_free_buffers needs the names freed below.
+  // No other interpreter runs on this thread, see lgc_roots.
+  linterp_self = interp;
+  lgc_collect();
+  linterp_self = outer;
+#endif
+
+  while (interp->images) {
+    limage *next = interp->images->next;
+    limage_unmap(interp->images);
+    interp->images = next;
+  }
+
+  mpc_cleanup(8, interp->Number, interp->Symbol, interp->String,
+              interp->Comment, interp->Sexpr, interp->Qexpr, interp->Expr,
+              interp->Lispy);
+  for (int i = 0; i < interp->syms.size; i++) {
+    lsym *sym = interp->syms.names[i] ? lsym_of(interp->syms.names[i]) : NULL;
+    if (sym && sym->shadows > 0) {
+      sym->orphaned = 1;
+    } else if (sym) {
+      free(sym);
+    }
+  }
+  free(interp->syms.names);
+  free(interp->syms.hashes);
+  pthread_mutex_destroy(&interp->sym_lock);
+  free(interp);
+}
+
+lval *linterp_eval(linterp *interp, char *input) {
+  /**
+   * Evaluate code as the REPL does, the whole input as one S-expression so
+   * "+ 1 2" and "(+ 1 2)" both give 3.
+   *
+   * linterp* interp: The interpreter.
+   * char* input: The code.
+   * Returns:
+   * lval*: The value, or an error if the input does not parse.
+   */
+  linterp *outer = linterp_enter(interp);
+  lval *x;
+  mpc_result_t r;
+  if (mpc_parse("<input>", input, interp->Lispy, &r)) {
+    x = lval_eval(interp->env, lval_read(r.output));
+    mpc_ast_delete(r.output);
+  } else {
+    char *err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    x = lval_err("%s", err_msg);
+    free(err_msg);
+  }
+  linterp_leave(outer);
+  return x;
+}
+
+lval *linterp_load_image(linterp *interp, char *filename) {
+  /**
+   * Bind everything from a heap image made by save-image in the global
+   * enviroment, see limage_load.
+   *
+   * linterp* interp: The interpreter.
+   * char* filename: The image.
+   * Returns:
+   * lval*: An empty S-expression, or an error if the image can't be used.
+   */
+  linterp *outer = linterp_enter(interp);
+  lval *x = limage_load(filename);
+  linterp_leave(outer);
+  return x;
+}
+
+lval *linterp_load(linterp *interp, char *filename) {
+  /**
+   * Run a file of code, see builtin_load.
+   *
+   * linterp* interp: The interpreter.
+   * char* filename: The file.
+   * Returns:
+   * lval*: An empty S-expression, or an error if the file does not parse.
+   */
+  linterp *outer = linterp_enter(interp);
+  lval *args = lval_add(lval_sexpr(), lval_str(filename));
+  lval *x = builtin_load(interp->env, args);
+  linterp_leave(outer);
+  return x;
+}
+
+void linterp_add_builtin(linterp *interp, char *name, lbuiltin func) {
+  /**
+   * Bind a C function in the global enviroment of an interpreter.
+   *
+   * linterp* interp: The interpreter.
+   * char* name: The name to bind it to.
+   * lbuiltin func: The function.
+   */
+  linterp *outer = linterp_enter(interp);
+  ltasks_settle();
+  lenv_add_builtin(interp->env, name, func);
+  linterp_leave(outer);
+}
+
+void linterp_settle(linterp *interp) {
+  /**
+   * Wait for every future an interpreter has started to finish, running
+   * those that are waiting on the current thread meanwhile. A process must
+   * do this before it forks, as the child has none of the pool's threads.
+   *
+   * linterp* interp: The interpreter.
+   */
+  linterp *outer = linterp_enter(interp);
+  ltask_wait(NULL);
+  linterp_leave(outer);
+}
+
+void linterp_snapshot(linterp *interp) {
+  /**
+   * Remember what the global enviroment binds, for linterp_restore. Taking
+   * another snapshot replaces the last.
+   *
+   * linterp* interp: The interpreter, which must not be running.
+   */
+  linterp *outer = linterp_enter(interp);
+  for (int i = 0; i < interp->saved_count; i++) {
+    lval_del(interp->saved[i]);
+  }
+  lenv *env = interp->env;
+  interp->saved = lrealloc(interp->saved, sizeof(lval *) * env->count);
+  for (int i = 0; i < env->count; i++) {
+    interp->saved[i] = lval_copy(env->vals[i]);
+  }
+  interp->saved_count = env->count;
+  linterp_leave(outer);
+}
+
+#ifdef LISPY_GC
+void linterp_mark_saved(void) {
+  /**
+   * Mark the values of the current interpreter's snapshot, which nothing
+   * else may hold.
+   */
+  for (int i = 0; linterp_self && i < linterp_self->saved_count; i++) {
+    lgc_mark(linterp_self->saved[i]);
+  }
+}
+#endif
+
+void linterp_restore(linterp *interp) {
+  /**
+   * Put the global enviroment back as it was at the last linterp_snapshot,
+   * waiting for the interpreter's futures first. Names bound since are
+   * unbound and those redefined get their old values back. The bindings
+   * are changed in place, so each name keeps its slot, see lsym.
+   *
+   * linterp* interp: The interpreter, which must not be running.
+   */
+  linterp *outer = linterp_enter(interp);
+  ltask_wait(NULL);
+  lenv *env = interp->env;
+  for (int i = 0; i < env->count; i++) {
+    lval_del(env->vals[i]);
+    if (i < interp->saved_count) {
+      env->vals[i] = lval_copy(interp->saved[i]);
+    } else {
+      lsym_of(env->syms[i])->global = -1;
+    }
+  }
+  if (env->count > interp->saved_count) {
+    env->count = interp->saved_count;
+    memset(env->table, -1, sizeof(int) * env->table_size);
+    for (int i = 0; i < env->count; i++) {
+      lenv_index(env, i);
+    }
+  }
+  linterp_leave(outer);
+}
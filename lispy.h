@@ -0,0 +1,178 @@
+#ifndef LISPY_H
+#define LISPY_H
+
+/**
+ * The interpreter as a library. A host program creates an interpreter with
+ * linterp_new, runs code in it with linterp_eval or linterp_load and adds
+ * its own functions with linterp_add_builtin.
+ *
+ * Every lval* returned to the host is owned by it and must be deleted with
+ * lval_del. A value may be deleted after linterp_del, but not otherwise
+ * used, and one from linterp_load_image must be deleted before. A builtin
+ * owns the S-expression of arguments it is given, must delete it, and
+ * returns a new lval, an error from lval_err on failure. The LASSERT macros
+ * check arguments that way.
+ *
+ * An interpreter may only be used by one thread at a time, but separate
+ * interpreters may run on separate threads. With -DLISPY_GC values are not
+ * reference counted, a value the host holds is only valid until its next
+ * call into the interpreter.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define LASSERT(args, cond, err, ...)                                          \
+  if (!(cond)) {                                                               \
+    lval *error = lval_err(err, ##__VA_ARGS__);                                \
+    lval_del(args);                                                            \
+    return error;                                                              \
+  }
+
+#define LASSERT_TYPE(func_name, a, index, intended_type)                       \
+  {                                                                            \
+    LASSERT(a, lval_type(a->cell[index]) == intended_type,                     \
+            "The function %s expected %s but got %s", func_name,               \
+            ltype_name(intended_type), ltype_name(lval_type(a->cell[index])));  \
+  }
+
+#define LASSERT_NUM(func_name, a, intended_num)                                \
+  {                                                                            \
+    LASSERT(a, a->count == intended_num,                                       \
+            "The function %s got the incorrect number of args."                \
+            "Got %i instead of %i.",                                           \
+            func_name, a->count, intended_num);                                \
+  }
+
+#define LASSERT_NOT_EMPTY(func_name, a)                                        \
+  {                                                                            \
+    LASSERT(a, a->count != 0, "The function %s was passed an empty expr.",     \
+            func_name)                                                         \
+  }
+
+// Forward definition of lval and lenv
+struct lval;
+struct lenv;
+struct lcode;
+struct lcells;
+struct ltask;
+struct linterp;
+typedef struct lval lval;
+typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lcells lcells;
+typedef struct ltask ltask;
+typedef struct linterp linterp;
+
+/**
+ * Define a function pointer to a function that takes an lenv* and an lval*
+ * and returns an lval*.
+ */
+typedef lval *(*lbuiltin)(lenv *, lval *);
+
+enum {
+  LVAL_NUM,
+  LVAL_STR,
+  LVAL_ERR,
+  LVAL_SYM,
+  LVAL_FUN,
+  LVAL_SEXPR,
+  LVAL_QEXPR,
+  LVAL_FUT
+};
+
+struct lval {
+  int type; // The type, one of the values from the above enum.
+  int refs; // The number of owners, the lval is freed when it drops to 0.
+
+  // Only the member for the current type is valid.
+  union {
+    long num;  // Used by LVAL_NUM.
+    char *err; // Used by LVAL_ERR.
+    char *str; // Used by LVAL_STR.
+
+    // Used by LVAL_SYM.
+    struct {
+      char *sym;          // Interned name.
+      unsigned long hash; // Cached hash of sym.
+    };
+
+    // Used by LVAL_FUN.
+    struct {
+      lbuiltin builtin; // NULL for lambdas.
+      lenv *env;
+      lval *formals;
+      lval *body;
+    };
+
+    // Used by LVAL_SEXPR and LVAL_QEXPR.
+    struct {
+      int count;     // The number of children.
+      lval **cell;   // The chilren, each child is an lval*.
+      lcells *cells; // The array cell points into, NULL if never allocated.
+      lcode *code;   // Bytecode when used as a lambda body, or NULL.
+    };
+
+    ltask *task; // Used by LVAL_FUT.
+  };
+};
+
+/**
+ * Numbers that fit in 63 bits are not allocated. They are stored in the
+ * lval* itself, shifted left one bit with the low bit set. Real lvals are
+ * always at least 2 byte aligned so their low bit is clear. Use lval_type
+ * and lval_num_of rather than reading type and num directly from an lval*
+ * that may be a number.
+ */
+#define LVAL_FIXNUM_MIN (INTPTR_MIN >> 1)
+#define LVAL_FIXNUM_MAX (INTPTR_MAX >> 1)
+
+static inline int lval_is_fixnum(lval *v) { return (uintptr_t)v & 1; }
+
+static inline lval *lval_fixnum(long x) {
+  return (lval *)(((uintptr_t)x << 1) | 1);
+}
+
+static inline int lval_type(lval *v) {
+  return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_num_of(lval *v) {
+  return lval_is_fixnum(v) ? (intptr_t)v >> 1 : v->num;
+}
+
+// Typed access to the value of an lval, check lval_type first.
+static inline char *lval_str_of(lval *v) { return v->str; }
+
+static inline char *lval_err_of(lval *v) { return v->err; }
+
+// INTERPRETER
+
+linterp *linterp_new(void);
+void linterp_del(linterp *interp);
+lval *linterp_eval(linterp *interp, char *input);
+lval *linterp_load(linterp *interp, char *filename);
+lval *linterp_load_image(linterp *interp, char *filename);
+void linterp_add_builtin(linterp *interp, char *name, lbuiltin func);
+void linterp_settle(linterp *interp);
+void linterp_snapshot(linterp *interp);
+void linterp_restore(linterp *interp);
+
+// VALUES
+
+char *ltype_name(int t);
+lval *lval_num(long x);
+lval *lval_str(char *str);
+lval *lval_err(char *format, ...);
+lval *lval_sexpr(void);
+lval *lval_qexpr(void);
+lval *lval_add(lval *v, lval *x);
+lval *lval_pop(lval *v, int i);
+lval *lval_take(lval *v, int i);
+lval *lval_copy(lval *v);
+void lval_del(lval *v);
+void lval_fprint(FILE *f, lval *v);
+void lval_print(lval *v);
+void lval_println(lval *v);
+
+#endif
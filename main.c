@@ -1,1337 +1,577 @@
 #include <editline/readline.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
-#include "mpc.h"
+#include "lispy.h"
 
-#define LASSERT(args, cond, err, ...)                                          \
-  if (!(cond)) {                                                               \
-    lval *error = lval_err(err, ##__VA_ARGS__);                                \
-    lval_del(args);                                                            \
-    return error;                                                              \
-  }
-
-#define LASSERT_TYPE(func_name, a, index, intended_type)                       \
-  {                                                                            \
-    LASSERT(a, a->cell[index]->type == intended_type,                          \
-            "The function %s expected %s but got %s", func_name,               \
-            ltype_name(intended_type), ltype_name(a->cell[index]->type));      \
-  }
-
-#define LASSERT_NUM(func_name, a, intended_num)                                \
-  {                                                                            \
-    LASSERT(a, a->count == intended_num,                                       \
-            "The function %s got the incorrect number of args."                \
-            "Got %i instead of %i.",                                           \
-            func_name, a->count, intended_num);                                \
-  }
-
-#define LASSERT_NOT_EMPTY(func_name, a)                                        \
-  {                                                                            \
-    LASSERT(a, a->count != 0, "The function %s was passed an empty expr.",     \
-            func_name)                                                         \
-  }
-mpc_parser_t *Number;
-mpc_parser_t *Symbol;
-mpc_parser_t *String;
-mpc_parser_t *Comment;
-mpc_parser_t *Sexpr;
-mpc_parser_t *Qexpr;
-mpc_parser_t *Expr;
-mpc_parser_t *Lispy;
-
-// Forward definition of lval and lenv
-struct lval;
-struct lenv;
-typedef struct lval lval;
-typedef struct lenv lenv;
+// SERVER
 
 /**
- * Define a function pointer to a function that takes an lenv* and an lval*
- * and returns an lval*.
+ * Requests and replies on the socket are frames, a 4 byte big endian length
+ * followed by that many bytes. A request is Lisp source, evaluated as the
+ * REPL would, and the reply is the printed result. A connection may send
+ * any number of requests and is served by one worker until it closes, or
+ * until it sends nothing for LSERVE_IDLE_SECONDS, so idle clients can't hold
+ * every worker.
+ *
+ * Each worker loads the files into an interpreter of its own and keeps it.
+ * What a request defines is seen by later requests on the same connection,
+ * and the interpreter goes back to how the files left it before the next
+ * connection, see linterp_restore.
  */
-typedef lval *(*lbuiltin)(lenv *, lval *);
-
-enum {
-  LVAL_NUM,
-  LVAL_STR,
-  LVAL_ERR,
-  LVAL_SYM,
-  LVAL_FUN,
-  LVAL_SEXPR,
-  LVAL_QEXPR
-};
-
-char *ltype_name(int t) {
-  switch (t) {
-  case LVAL_NUM:
-    return "Number";
-  case LVAL_STR:
-    return "String";
-  case LVAL_ERR:
-    return "Error";
-  case LVAL_SYM:
-    return "Symbol";
-  case LVAL_FUN:
-    return "Function";
-  case LVAL_SEXPR:
-    return "S-Expression";
-  case LVAL_QEXPR:
-    return "Q-Expression";
-  default:
-    return "Unknown";
-  }
-}
-struct lval {
-  int type;  // The type, one of the values from the above enum.
-  long num;  // Used by LVAL_NUM.
-  char *err; // Used by LVAL_ERR.
-  char *sym; // Used by LVAL_SYM.
-  char *str; // Used by LVAL_STR.
-
-  // Function
-  lbuiltin builtin; // Used by LVAL_FUN. Used by LVAL_SEXPR AND LVAL_QEXPR.
-  lenv *env;
-  lval *formals;
-  lval *body;
-
-  int count;   // The number of children.
-  lval **cell; // The chilren, each child is an lval*.
-};
-
-struct lenv {
-  lenv *parent;
+#define LSERVE_MAX_FRAME (1 << 20)
+#define LSERVE_MAX_WORKERS 64
+#ifndef LSERVE_IDLE_SECONDS
+#define LSERVE_IDLE_SECONDS 30
+#endif
+
+typedef struct {
+  int nfiles;
+  char **files;
+
+  // Accepted connections waiting for a worker.
+  int *conns;
+  int size;
+  int head;
   int count;
-  char **syms;
-  lval **vals;
-};
-
-// DECLARATIONS
-lval *lval_err(char *m, ...);
-lval *lval_fun(lbuiltin func);
-lval *lval_sym(char *name);
-lval *lval_copy(lval *v);
-lval *lval_read(mpc_ast_t *t);
-lval *lval_add(lval *v, lval *x);
-lval *lval_take(lval *v, int i);
-lval *builtin_op(lenv *env, lval *a, char *op);
-void lval_print(lval *v);
-lval *lval_pop(lval *v, int i);
-lval *lval_eval(lenv *env, lval *v);
-void lval_del(lval *v);
-lval *lval_eval_sexpr(lenv *env, lval *v);
-
-lval *builtin_load(lenv *env, lval *a);
-lval *builtin_lambda(lenv *e, lval *v);
-lval *builtin_join(lenv *env, lval *a);
-lval *builtin_head(lenv *env, lval *a);
-lval *builtin_tail(lenv *env, lval *a);
-lval *builtin_eval(lenv *env, lval *a);
-lval *builtin_list(lenv *env, lval *a);
-lval *builtin_neq(lenv *env, lval *a);
-lval *builtin_eq(lenv *env, lval *a);
-lval *builtin_if(lenv *env, lval *a);
-lval *builtin_print(lenv *env, lval *args);
-lval *builtin_error(lenv *env, lval *args);
-
-lval *builtin_var(lenv *env, lval *a, char *func);
-lval *builtin_def(lenv *env, lval *a);
-lval *builtin_put(lenv *env, lval *a);
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
 
-lval *builtin_mul(lenv *env, lval *a);
-lval *builtin_sub(lenv *env, lval *a);
-lval *builtin_add(lenv *env, lval *a);
-lval *builtin_div(lenv *env, lval *a);
+  int stopping; // Set once the server is shutting down.
+  int *active;  // The connection each worker is serving, or -1.
+  int next_id;  // The index into active of the next worker to start.
+} lserver;
 
-lval *builtin_ge(lenv *env, lval *a);
-lval *builtin_gt(lenv *env, lval *a);
-lval *builtin_le(lenv *env, lval *a);
-lval *builtin_lt(lenv *env, lval *a);
+// Set by SIGINT and SIGTERM to shut the server down.
+volatile sig_atomic_t lserve_stop = 0;
 
-lenv *lenv_new(void) {
-  /**
-   * Create a new enviroment.
-   *
-   * returns:
-   * lenv* The new enviroment.
-   */
-  lenv *enviroment = malloc(sizeof(lenv));
-  enviroment->parent = NULL;
-  enviroment->count = 0;
-  enviroment->syms = NULL;
-  enviroment->vals = NULL;
-  return enviroment;
-};
-
-void lenv_del(lenv *e) {
-  /**
-   * Deletes an lenv.
-   *
-   * lenv* e: the lenv to delete.
-   */
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
-  }
-  free(e->syms);
-  free(e->vals);
-  free(e);
+void lserve_on_signal(int sig) {
+  (void)sig;
+  lserve_stop = 1;
 }
 
-lenv *lenv_copy(lenv *env) {
+int lserve_io(int fd, char *buf, size_t len, int writing) {
   /**
-   * Make a copy of an enviroment.
+   * Read or write exactly len bytes.
    *
-   * lenv* env: The enviroment to copy.
    * Returns:
-   * lenv*: a pointer to the copy.
+   * int: 1 on success, 0 if the connection closed or failed.
    */
-  lenv *new = lenv_new();
-  new->parent = env->parent;
-  new->count = env->count;
-  new->syms = malloc(sizeof(char *) * new->count);
-  new->vals = malloc(sizeof(lval *) * new->count);
-  for (int i = 0; i < new->count; i++) {
-    new->syms[i] = malloc(strlen(env->syms[i]) + 1);
-    strcpy(new->syms[i], env->syms[i]);
-    new->vals[i] = lval_copy(env->vals[i]);
-  }
-  return new;
-}
-
-lval *lenv_get(lenv *env, lval *key) {
-  /**
-   * Get the value bound to a key in an given enviroment.
-   *
-   * lenv* env: The enviroment where to look for the value.
-   * lval* key: An lval* of type LVAL_SYM.
-   */
-  for (int i = 0; i < env->count; i++) {
-    if (strcmp(env->syms[i], key->sym) == 0) {
-      return lval_copy(env->vals[i]);
+  while (len > 0) {
+    ssize_t n = writing ? write(fd, buf, len) : read(fd, buf, len);
+    if (n <= 0) {
+      return 0;
     }
+    buf += n;
+    len -= n;
   }
-  if (env->parent) {
-    return lenv_get(env->parent, key);
-  }
-  return lval_err("Unbound symbol! '%s'", key->sym);
+  return 1;
 }
 
-void lenv_put(lenv *env, lval *key, lval *value) {
+char *lserve_read_frame(int fd) {
   /**
-   * Bound a new local variable.
-   * Copies the content so orignal memory can be freed.
+   * Read a request frame.
    *
-   * lenv* env: The enviroment to where variables are being stored.
-   * lval* key: The symbol, should be of type LVAL_SYM.
-   * lval* value: The value. Can be of any type?
+   * Returns:
+   * char*: The request as a string, or NULL if the connection closed or sent
+   * a frame over LSERVE_MAX_FRAME.
    */
-  for (int i = 0; i < env->count; i++) {
-    // If key already in the enviroment.
-    if (strcmp(env->syms[i], key->sym) == 0) {
-      // Delete the value.
-      lval_del(env->vals[i]);
-      // Replace the value with a copy of the new value.
-      env->vals[i] = lval_copy(value);
-      return;
-    }
+  unsigned char hdr[4];
+  if (!lserve_io(fd, (char *)hdr, 4, 0)) {
+    return NULL;
   }
-
-  // Allocate space for new entry.
-  env->count++;
-  env->vals = realloc(env->vals, sizeof(lval *) * env->count);
-  env->syms = realloc(env->syms, sizeof(char *) * env->count);
-
-  // Copy the contents into the new memory locations.
-  env->vals[env->count - 1] = lval_copy(value);
-  env->syms[env->count - 1] = malloc(strlen(key->sym) + 1);
-  strcpy(env->syms[env->count - 1], key->sym);
-}
-
-void lenv_def(lenv *env, lval *key, lval *value) {
-  /**
-   * Bound a new global variable.
-   * Copies the content so orignal memory can be freed.
-   *
-   * lenv* env: The enviroment to where variables are being stored.
-   * lval* key: The symbol, should be of type LVAL_SYM.
-   * lval* value: The value. Can be of any type?
-   */
-  // travese to the root of the tree of enviroments
-  while (env->parent) {
-    env = env->parent;
+  uint32_t len = (uint32_t)hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+  if (len > LSERVE_MAX_FRAME) {
+    return NULL;
   }
-  // define the varible in that eviroment
-  lenv_put(env, key, value);
-}
-
-void lenv_add_builtin(lenv *env, char *name, lbuiltin func) {
-  lval *key = lval_sym(name);
-  lval *value = lval_fun(func);
-
-  lenv_put(env, key, value);
-  lval_del(key);
-  lval_del(value);
-}
-
-void lenv_add_builtins(lenv *env) {
-  lenv_add_builtin(env, "tail", builtin_tail);
-  lenv_add_builtin(env, "head", builtin_head);
-  lenv_add_builtin(env, "eval", builtin_eval);
-  lenv_add_builtin(env, "join", builtin_join);
-  lenv_add_builtin(env, "list", builtin_list);
-  lenv_add_builtin(env, "def", builtin_def);
-  lenv_add_builtin(env, "=", builtin_put);
-
-  lenv_add_builtin(env, "plus", builtin_add);
-  lenv_add_builtin(env, "sub", builtin_sub);
-  lenv_add_builtin(env, "times", builtin_mul);
-  lenv_add_builtin(env, "div", builtin_div);
-
-  lenv_add_builtin(env, "+", builtin_add);
-  lenv_add_builtin(env, "-", builtin_sub);
-  lenv_add_builtin(env, "*", builtin_mul);
-  lenv_add_builtin(env, "/", builtin_div);
-
-  lenv_add_builtin(env, "==", builtin_eq);
-  lenv_add_builtin(env, "!=", builtin_neq);
-
-  lenv_add_builtin(env, ">", builtin_gt);
-  lenv_add_builtin(env, ">=", builtin_ge);
-  lenv_add_builtin(env, "<", builtin_lt);
-  lenv_add_builtin(env, "<=", builtin_le);
-
-  lenv_add_builtin(env, "if", builtin_if);
-  lenv_add_builtin(env, "\\", builtin_lambda);
-
-  lenv_add_builtin(env, "print", builtin_print);
-  lenv_add_builtin(env, "error", builtin_error);
-  // lenv_add_builtin(env, "load", builtin_load);
-}
-
-// LVAL CONSTRUCTORS
-
-lval *lval_lambda(lval *formals, lval *body) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-
-  // Set builtin to NULL as not builtin.
-  v->builtin = NULL;
-
-  // New enviroment.
-  v->env = lenv_new();
-
-  v->formals = formals;
-  v->body = body;
-  return v;
-}
-
-lval *lval_num(long x) {
-  /**
-   * Returns a pointer to a new lval of type LVAL_NUM.
-   *
-   * long x: The number to be represented.
-   */
-  // allocate memory the size of lval in the heap to store v
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
-  v->num = x;
-  return v;
-}
-
-lval *lval_str(char *str) {
-  /**
-   * Returns a pointer to a new lval of type LVAL_STR.
-   *
-   * char* str: The str to be represented.
-   */
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
-  v->str = malloc(strlen(str) + 1);
-  strcpy(v->str, str);
-  return v;
-}
-
-lval *lval_err(char *format, ...) {
-  /**
-   * Returns a pointer to a new lval of type LVAL_ERR
-   *
-   * char* format: The error message as a printf style format.
-   * ...: the varibles to be pushed into the string.
-   */
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
-
-  va_list va;
-  va_start(va, format);
-
-  v->err = malloc(512);
-
-  vsnprintf(v->err, 511, format, va);
-  v->err = realloc(v->err, strlen(v->err) + 1);
-  va_end(va);
-
-  return v;
-}
-
-lval *lval_sym(char *s) {
-  /**
-   * Returns a pointer to a new lval of type LVAL_SYM
-   *
-   * char* s: The body of the symbol.
-   */
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
-  return v;
-}
-
-// create a lval for a sexpr and return a pointer to it
-lval *lval_sexpr(void) {
-  /**
-   * Returns a pointer to a new lval of type LVAL_SEXPR
-   */
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
-  v->count = 0;
-  v->cell = NULL;
-  return v;
-}
-
-lval *lval_qexpr(void) {
-  /**
-   * Returns a pointer to a new lval of type LVAL_SEXPR
-   */
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
-  v->count = 0;
-  v->cell = NULL;
-  return v;
+  char *buf = malloc(len + 1);
+  if (!lserve_io(fd, buf, len, 0)) {
+    free(buf);
+    return NULL;
+  }
+  buf[len] = '\0';
+  return buf;
 }
 
-lval *lval_fun(lbuiltin func) {
-  /**
-   * Returns a pointer to a new lval of type LVAL_FUN
-   */
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-  v->builtin = func;
-  return v;
+int lserve_write_frame(int fd, char *buf, size_t len) {
+  unsigned char hdr[4] = {len >> 24, len >> 16, len >> 8, len};
+  return lserve_io(fd, (char *)hdr, 4, 1) && lserve_io(fd, buf, len, 1);
 }
 
-// LVAL UTIL FUNCTIONS/METHODS
-
-void lval_del(lval *v) {
+void lserve_conn(linterp *interp, int fd) {
   /**
-   * Deletes an lval* object. Works deeply i.e. also deletes all chilren.
-   *
-   * lval* v: The lval* to be deleted.
+   * Answer requests on a connection until it closes, or is shut down by
+   * lserve stopping. The caller closes fd.
    */
-  switch (v->type) {
-  case LVAL_NUM:
-    break;
-  case LVAL_STR:
-    free(v->str);
-    break;
-  case LVAL_ERR:
-    free(v->err);
-    break;
-  case LVAL_SYM:
-    free(v->sym);
-    break;
-  case LVAL_FUN:
-    if (!v->builtin) {
-      lenv_del(v->env);
-      lval_del(v->formals);
-      lval_del(v->body);
-    }
-    break;
-  case LVAL_SEXPR:
-  case LVAL_QEXPR:
-    for (int i = 0; i < v->count; i++) {
-      lval_del(v->cell[i]);
-    }
-    free(v->cell);
-    break;
-  }
-  free(v);
-}
+  char *input;
+  while ((input = lserve_read_frame(fd))) {
+    lval *x = linterp_eval(interp, input);
+    free(input);
 
-void lval_expr_print(lval *v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
+    char *out;
+    size_t len;
+    FILE *f = open_memstream(&out, &len);
+    lval_fprint(f, x);
+    fclose(f);
+    lval_del(x);
 
-    if (i != (v->count - 1)) {
-      putchar(' ');
+    int ok = lserve_write_frame(fd, out, len);
+    free(out);
+    if (!ok) {
+      break;
     }
   }
-  putchar(close);
-}
-void lval_print_str(lval *v) {
-  /**
-   * Escape a string and then print it.
-   *
-   * lval* v: Of type of LVAL_STR.
-   */
-  // Make a copy of the string.
-  char *escaped = malloc(strlen(v->str) + 1);
-  strcpy(escaped, v->str);
-  // Escape using an mpc function.
-  escaped = mpcf_escape(escaped);
-  // Print.
-  printf("\"%s\"", escaped);
-  // Delete the copy.
-  free(escaped);
-}
-
-void lval_print(lval *v) {
-  switch (v->type) {
-  case LVAL_NUM:
-    printf("%li", v->num);
-    break;
-  case LVAL_ERR:
-    printf("Error: %s", v->err);
-    break;
-  case LVAL_SYM:
-    printf("%s", v->sym);
-    break;
-  case LVAL_FUN:
-    if (v->builtin) {
-      printf("<builtin>");
-    } else {
-      printf("(\\");
-      lval_print(v->formals);
-      putchar(' ');
-      lval_print(v->body);
-      putchar(')');
-    }
-    break;
-  case LVAL_STR:
-    lval_print_str(v);
-    break;
-  case LVAL_SEXPR:
-    lval_expr_print(v, '(', ')');
-    break;
-  case LVAL_QEXPR:
-    lval_expr_print(v, '{', '}');
-  }
-}
-
-void lval_println(lval *v) {
-  lval_print(v);
-  putchar('\n');
-}
-
-lval *lval_read_num(mpc_ast_t *t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
 }
 
-lval *lval_copy(lval *v) {
+void *lserve_worker(void *arg) {
   /**
-   * Return a deepcopy or clone of a lval.
-   s
-   * lval* v: The lval* to copy.
-   *
-   * Returns: The copy.
+   * A worker owns one interpreter for its whole life, built and with the
+   * prelude files loaded before it takes its first connection, and put back
+   * to that state after each. It returns once the server is stopping and
+   * its connection is done.
    */
-
-  lval *x = malloc(sizeof(lval));
-  x->type = v->type;
-
-  switch (x->type) {
-  case LVAL_FUN:
-    if (v->builtin) {
-      x->builtin = v->builtin;
-    } else {
-      x->builtin = NULL;
-      x->env = lenv_copy(v->env); // to be defined
-      x->formals = lval_copy(v->formals);
-      x->body = lval_copy(v->body);
+  lserver *s = arg;
+  pthread_mutex_lock(&s->lock);
+  int id = s->next_id++;
+  pthread_mutex_unlock(&s->lock);
+  linterp *interp = linterp_new();
+  for (int i = 0; i < s->nfiles; i++) {
+    lval *x = linterp_load(interp, s->files[i]);
+    if (lval_type(x) == LVAL_ERR) {
+      lval_println(x);
     }
-    break;
-  case LVAL_NUM:
-    x->num = v->num;
-    break;
-  case LVAL_STR:
-    x->str = malloc(strlen(v->str) + 1);
-    strcpy(x->str, v->str);
-  case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym) + 1);
-    strcpy(x->sym, v->sym);
-    break;
-  case LVAL_ERR:
-    x->err = malloc(strlen(v->err) + 1);
-    strcpy(x->err, v->err);
-    break;
-  case LVAL_QEXPR:
-  case LVAL_SEXPR:
-    x->count = v->count;
-    x->cell = malloc(sizeof(lval *) * x->count);
-    for (int i = 0; i < x->count; i++) {
-      x->cell[i] = lval_copy(v->cell[i]);
-    }
-    break;
-  }
-  return x;
-}
-lval *lval_call(lenv *env, lval *function, lval *args) {
-  /**
-   * Call an the function represented by an lval* object of type
-   * LVAL_FUN. Returns a partially initialised fuction if (number of
-   * arguments) < (expected number of arguments).
-   *
-   * lenv* env: The global enviroment.
-   * lval* function: The function lval* of type LVAL_FUN.
-   * lval* args: The Q-expression representing the arguments.
-   *
-   * Returns:
-   * lval*: the result of the fuction call. Or the partially initialised
-   * 	     function
-   */
-  if (function->builtin) {
-    return function->builtin(env, args);
+    lval_del(x);
   }
+  linterp_snapshot(interp);
 
-  int given = args->count;
-  int total = function->formals->count;
-
-  while (args->count) {
-
-    // If no more arguments to bind.
-    if (function->formals->count == 0) {
-      lval_del(args);
-      return lval_err("Function passed too many arguments. "
-                      "Got %i expected %i. "
-                      "Evaluated %i.",
-                      given, total, given - (args->count));
+  while (1) {
+    pthread_mutex_lock(&s->lock);
+    while (s->count == 0 && !s->stopping) {
+      pthread_cond_wait(&s->ready, &s->lock);
     }
-
-    // Pop the next "formal".
-    lval *symbol = lval_pop(function->formals, 0);
-
-    // & means the function accepts a varible number of args.
-    if (strcmp(symbol->sym, "&")) {
-
-      if (function->formals->count != 0) {
-        lval_del(args);
-        return lval_err("The '&' symbol not followed by exactly one symbol.");
-      }
-
-      lval *next_symbol = lval_pop(function->formals, 0);
-      // The remaining args will still be in args;
-      lenv_put(function->env, next_symbol, builtin_list(env, args));
-      lval_del(args);
-      lval_del(next_symbol);
-    }
-
-    // Pop the next argument.
-    lval *arg = lval_pop(args, 0);
-
-    lenv_put(function->env, symbol, arg);
-
-    // Delete the symbols.
-    lval_del(symbol);
-    lval_del(arg);
-  }
-
-  // Delete the args lval* as all args have been evaluated.
-  lval_del(args);
-
-  // If there is no arguments left and there is '&' followed by a symbol.
-  if (function->formals->count > 0 &&
-      strcmp(function->formals->cell[0]->sym, "&") == 0) {
-
-    // If the & symbol is not followed by one symbol.
-    if (function->formals->count != 2) {
-      lval_del(args);
-      return lval_err("The '&' symbol not followed by exactly one symbol.");
+    if (s->stopping) {
+      pthread_mutex_unlock(&s->lock);
+      break;
     }
+    int fd = s->conns[s->head];
+    s->head = (s->head + 1) % s->size;
+    s->count--;
+    s->active[id] = fd;
+    pthread_mutex_unlock(&s->lock);
 
-    // Delete the lval represeting '&'.
-    lval_del(lval_pop(function->formals, 0));
-
-    lval *sym = lval_pop(function->formals, 0);
-    lval *value = lval_qexpr();
-
-    lenv_put(function->env, sym, value);
-    lval_del(sym);
-    lval_del(sym);
-  }
+    struct timeval idle = {LSERVE_IDLE_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    lserve_conn(interp, fd);
+    linterp_restore(interp);
 
-  if (function->formals->count == 0) {
-    function->env->parent = env;
-    return builtin_eval(function->env,
-                        lval_add(lval_sexpr(), lval_copy(function->body)));
-  } else {
-    return lval_copy(function);
+    // Cleared before the close so lserve never shuts down a reused fd.
+    pthread_mutex_lock(&s->lock);
+    s->active[id] = -1;
+    pthread_mutex_unlock(&s->lock);
+    close(fd);
   }
+  linterp_del(interp);
+  return NULL;
 }
 
-lval *lval_add(lval *v, lval *x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  v->cell[v->count - 1] = x;
-  return v;
-}
-
-lval *lval_join(lval *x, lval *y) {
+int lserve(char *path, int workers, int nfiles, char **files) {
   /**
-   * Move each child from y to x.
+   * Listen on a unix socket and serve requests with a pool of interpreters
+   * until SIGINT or SIGTERM. Then connections still waiting are closed,
+   * those being served are shut down once their request is answered, and
+   * the workers are joined and the socket removed.
    *
-   * lval* x: Lval to move from.
-   * lval* y: Lval to move to.
-   */
-
-  while (y->count) {
-    lval_add(x, lval_pop(y, 0));
-  }
-
-  lval_del(y);
-  return x;
-}
-
-int lval_eq(lval *x, lval *y) {
-  /**
-   * Compares two lval objects, returns 1 if they are equal
-   * and 0 if not.
-   *
-   * lval* x Lval to compare.
-   * lval* y Lval to compare.
+   * char* path: Where to create the socket, an existing file is replaced.
+   * int workers: How many interpreters, and so requests, run at once.
+   * int nfiles, char** files: Files every interpreter loads at the start.
    * Returns:
-   * int Whether the lvals are equal.
+   * int: 0 once stopped, 1 if the socket or the workers could not be set
+   * up.
    */
-
-  if (x->type != y->type) {
-    return 0;
-  }
-
-  switch (x->type) {
-  case LVAL_NUM:
-    return x->num == y->num;
-  case LVAL_STR:
-    return (strcmp("x->str", "y->str") == 0);
-  case LVAL_SYM:
-    return (strcmp("x->sym", "y->sym") == 0);
-  case LVAL_ERR:
-    return (strcmp("x->err", "y->err") == 0);
-  case LVAL_SEXPR:
-  case LVAL_QEXPR:
-    if (x->count != y->count) {
-      return 0;
-    }
-    for (int i = 0; i < x->count; i++) {
-      // If any pair of elements are not the same return false.
-      if (!lval_eq(x->cell[i], y->cell[i])) {
-        return 0;
-      }
-    }
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "lispy: socket path too long\n");
     return 1;
-  case LVAL_FUN:
-    if (x->builtin || y->builtin) {
-      return (x->builtin == y->builtin);
-    } else {
-      return (lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body));
-    }
-    break;
   }
-  return 0;
-}
+  strcpy(addr.sun_path, path);
 
-lval *builtin_print(lenv *env, lval *args) {
-  /**
-   * Print a string to the terminal.:
-   *
-   * lenv* env: The eniroment, won't be used.
-   * lval* args: An lval containing all the things to print.
-   */
-
-  for (int i = 0; i < args->count; i++) {
-    lval_print(args->cell[i]);
-    putchar(' ');
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, 128) < 0) {
+    perror("lispy");
+    return 1;
   }
-
-  putchar('\n');
-  lval_del(args);
-
-  return lval_sexpr();
-}
-
-lval *builtin_error(lenv *env, lval *args) {
-  /**
-   * Raise an error.
-   *
-   * lenv* env: The eniroment, won't be used.
-   * lval* args: An lval containing the error message.
-   */
-  LASSERT_NUM("error", args, 1);
-  LASSERT_TYPE("error", args, 0, LVAL_STR);
-
-  // Create an error with the given string.
-  lval *err = lval_err(args->cell[0]->str);
-
-  lval_del(args);
-  return err;
-}
-
-lval *builtin_load(lenv *env, lval *a) {
-  /**
-   * Load a "library" of code from a filename.
-   *
-   * lenv* env: The enviroment to use to evaluate the library.
-   * lval* a: An lval that should contain a single argument of type LVAL_STR
-   *          containing the filename.
-   * Returns:
-   *  lval* either an empty LVAL_SEXPR or an LVAL_ERR if an error occurs.
-   */
-
-  // Assert that has one arg of type LVAL_STR
-  LASSERT_NUM("load", a, 1);
-  LASSERT_TYPE("load", a, 0, LVAL_STR);
-
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-    lval *expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
-
-    // While still expressions to eval.
-    while (expr->count) {
-      // Evaluate the fist expr.
-      lval *x = lval_eval(env, lval_pop(expr, 0));
-
-      if (x->type == LVAL_ERR) {
-        lval_println(x);
-      }
-      lval_del(x);
+  // A client that hangs up early should not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+
+  // The stop signals are blocked everywhere but in pselect below, so the
+  // workers never take them and one can't arrive just before a wait.
+  struct sigaction stop = {.sa_handler = lserve_on_signal};
+  sigemptyset(&stop.sa_mask);
+  sigaction(SIGINT, &stop, NULL);
+  sigaction(SIGTERM, &stop, NULL);
+  sigset_t blocked, unblocked;
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &blocked, &unblocked);
+
+  lserver s = {.nfiles = nfiles, .files = files};
+  s.size = 1024;
+  s.conns = malloc(sizeof(int) * s.size);
+  s.active = malloc(sizeof(int) * workers);
+  for (int i = 0; i < workers; i++) {
+    s.active[i] = -1;
+  }
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.ready, NULL);
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+  int started = 0;
+  for (; started < workers; started++) {
+    int err = pthread_create(&threads[started], NULL, lserve_worker, &s);
+    if (err != 0) {
+      errno = err;
+      perror("lispy");
+      break;
     }
-
-    // Clean up
-    lval_del(expr);
-    lval_del(a);
-
-    // return an empty sexpr
-    return lval_sexpr();
-
-  } else {
-    char *err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
-
-    lval *err = lval_err("Could not load library %s", err_msg);
-    free(err_msg);
-    lval_del(a);
-
-    return err;
   }
-}
 
-lval *builtin_if(lenv *env, lval *a) {
-  /**
-   * A bulitin if function. Works like the terniary operator in c.
-   *
-   * Example usage:
-   *  if (a == b) {def {a} 1} {def {a} 2}
-   *
-   * lenv* env: The enviroment where to
-   * lval* a: The arguments. Should be made up of LVAL_NUM,
-   * 					LVAL_QEXPR, LVAL_QEXPR. Where the
-   * LVAL_NUM represents a boolean value.
-   */
-
-  // Check for correct number of args.
-  LASSERT_NUM("if", a, 3);
-  // Check for correct types
-  LASSERT_TYPE("if", a, 0, LVAL_NUM);
-  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
-
-  lval *x;
-  // Change the qexpr to sexpr so they can be executed.
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
-
-  // execute cell[1]
-  if (a->cell[0]->num) {
-    x = lval_eval(env, lval_pop(a, 1));
-  }
-  // execute cell[2]
-  else {
-    x = lval_eval(env, lval_pop(a, 2));
-  }
-
-  lval_del(a);
-  return x;
-}
-
-lval *builtin_ord(lenv *env, lval *a, char *op) {
-  LASSERT_NUM(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
-  int r;
-
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >= a->cell[1]->num);
-  }
-  if (strcmp(op, ">") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
-  }
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <= a->cell[1]->num);
-  }
-  if (strcmp(op, "<") == 0) {
-    r = (a->cell[0]->num < a->cell[1]->num);
-  }
-
-  lval_del(a);
-  return lval_num(r);
-}
-
-lval *builtin_ge(lenv *env, lval *a) { return builtin_ord(env, a, ">="); }
-
-lval *builtin_gt(lenv *env, lval *a) { return builtin_ord(env, a, ">"); }
-
-lval *builtin_le(lenv *env, lval *a) { return builtin_ord(env, a, "<="); }
-
-lval *builtin_lt(lenv *env, lval *a) { return builtin_ord(env, a, "<"); }
-
-lval *builtin_cmp(lenv *env, lval *a, char *op) {
-  /**
-   * Function to compare two arguments, used for
-   * builtin_eq and builtin_neq.
-   *
-   * lenv* env: The enviroment where to exectute.
-   * lval* a: The arguments passed.
-   * char* op: One of '>', '>=', '<' and '<='.
-   */
-  LASSERT_NUM(op, a, 2);
-  int r;
-  lval *x = lval_pop(a, 0);
-  lval *y = lval_pop(a, 0);
-
-  if (strcmp(op, "==") == 0) {
-    r = lval_eq(x, y);
+  // With no workers nothing would answer, so stop straight away.
+  while (started && !lserve_stop) {
+    fd_set ready;
+    FD_ZERO(&ready);
+    FD_SET(sock, &ready);
+    if (pselect(sock + 1, &ready, NULL, NULL, NULL, &unblocked) <= 0) {
+      continue;
+    }
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    pthread_mutex_lock(&s.lock);
+    if (s.count == s.size) {
+      // Too many waiting connections, turn this one away.
+      pthread_mutex_unlock(&s.lock);
+      close(fd);
+      continue;
+    }
+    s.conns[(s.head + s.count) % s.size] = fd;
+    s.count++;
+    pthread_cond_signal(&s.ready);
+    pthread_mutex_unlock(&s.lock);
+  }
+
+  pthread_mutex_lock(&s.lock);
+  s.stopping = 1;
+  for (; s.count > 0; s.count--) {
+    close(s.conns[s.head]);
+    s.head = (s.head + 1) % s.size;
+  }
+  // The worker's next read of the connection ends it.
+  for (int i = 0; i < workers; i++) {
+    if (s.active[i] >= 0) {
+      shutdown(s.active[i], SHUT_RD);
+    }
   }
-  if (strcmp(op, "!=") == 0) {
-    r = !lval_eq(x, y);
+  pthread_cond_broadcast(&s.ready);
+  pthread_mutex_unlock(&s.lock);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
   }
 
-  lval_del(x);
-  lval_del(y);
-  lval_del(a);
-
-  return lval_num(r);
+  close(sock);
+  unlink(path);
+  pthread_sigmask(SIG_SETMASK, &unblocked, NULL);
+  pthread_mutex_destroy(&s.lock);
+  pthread_cond_destroy(&s.ready);
+  free(threads);
+  free(s.active);
+  free(s.conns);
+  return started ? 0 : 1;
 }
 
-lval *builtin_eq(lenv *env, lval *a) { return builtin_cmp(env, a, "=="); }
-
-lval *builtin_neq(lenv *env, lval *a) { return builtin_cmp(env, a, "!="); }
-
-lval *builtin_def(lenv *env, lval *a) {
-  /**
-   */
-
-  return builtin_var(env, a, "def");
-}
-
-lval *builtin_put(lenv *env, lval *a) {
-  /**
-   */
-  return builtin_var(env, a, "=");
-}
-
-lval *builtin_lambda(lenv *e, lval *v) {
-  /**
-   * Takes an lval* representing a lambda and returns a new
-   * lval of type LVAL_FUN.
-   *
-   * lenv* e: The enviroment.
-   * lval* v: The lval of type LVAL_SEXPR.
-   *
-   * Returns:
-   * lval*: An lval* of type LVAL_FUN.
-   */
-
-  // Check that the lval has 2 children both of which are Q-Expressions
-  LASSERT_NUM("//", v, 2);
-  LASSERT_TYPE("//", v, 0, LVAL_QEXPR);
-  LASSERT_TYPE("//", v, 1, LVAL_QEXPR);
+// PREFORK
 
-  // Check each of the formals is a Symbol
-  for (int i = 0; i < v->cell[0]->count; i++) {
-    LASSERT(v, (v->cell[0]->cell[i]->type) == LVAL_SYM,
-            "Cannot define non-symbol. Got %s expected %s.",
-            ltype_name(v->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+/**
+ * The parent loads the files once and forks the workers, which start with
+ * its global enviroment in pages shared copy-on-write. Jobs are lines of
+ * stdin, each the name of a script for one worker to run. A worker keeps
+ * what its scripts def, other workers do not see it.
+ */
+#define LPREFORK_MAX_JOB 4096
+
+typedef struct {
+  pid_t pid;
+  int jobs;
+} lprefork_done;
+
+// What lprefork knows of a worker while waiting for the reports.
+enum { LPREFORK_RUNNING, LPREFORK_REPORTED, LPREFORK_DIED };
+
+void lprefork_mem(pid_t pid, long *rss, long *pss, long *shared) {
+  /**
+   * Read the memory use of a process from /proc, in kB. Pss splits each
+   * shared page between the processes sharing it, so it is the fair size of
+   * one worker.
+   */
+  char path[64];
+  char line[256];
+  long kb;
+  *rss = *pss = *shared = 0;
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "Rss: %ld", &kb) == 1) {
+      *rss = kb;
+    } else if (sscanf(line, "Pss: %ld", &kb) == 1) {
+      *pss = kb;
+    } else if (sscanf(line, "Shared_Clean: %ld", &kb) == 1 ||
+               sscanf(line, "Shared_Dirty: %ld", &kb) == 1) {
+      *shared += kb;
+    }
   }
-
-  lval *formals = lval_pop(v, 0);
-  lval *body = lval_pop(v, 0);
-  lval_del(v);
-
-  return lval_lambda(formals, body);
+  fclose(f);
 }
 
-lval *builtin_var(lenv *env, lval *a, char *func) {
+void lprefork_worker(linterp *interp, int jobs, int done, int release) {
   /**
-   * Bind a list (q-expression) of symbols to the corresponding
-   * arguments.
-   *
-   * lenv* env: The enviroment where to execute.
-   * lval a: The arguemnts.
-   * char* func: Either "=" or "def" determines which scope to define vars in
-   * 						 local or global respectively.
+   * Run scripts until the parent runs out of jobs, then report and wait for
+   * the parent to read the memory use before exiting.
    */
-  // checks the first value is a q-expression
-  LASSERT_TYPE("def", a, 0, LVAL_QEXPR);
-
-  lval_print(a);
-  // list of symbols
-  lval *syms = a->cell[0];
-
-  // Check all the elements are symbols.
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT_TYPE("def", syms, i, LVAL_SYM);
-  }
-
-  LASSERT(a, syms->count == a->count - 1,
-          "There are a different number of values to symbols."
-          "Got %i and expected %i.",
-          syms->count, a->count - 1);
-
-  for (int i = 0; i < syms->count; i++) {
-    if (strcmp(func, "def") == 0) {
-      lenv_def(env, syms->cell[i], a->cell[i + 1]);
-    } else if (strcmp(func, "=") == 0) {
-      lenv_put(env, syms->cell[i], a->cell[i + 1]);
+  char job[LPREFORK_MAX_JOB + 1];
+  ssize_t n;
+  lprefork_done report = {getpid(), 0};
+  while ((n = recv(jobs, job, LPREFORK_MAX_JOB, 0)) > 0) {
+    job[n] = '\0';
+    lval *x = linterp_load(interp, job);
+    if (lval_type(x) == LVAL_ERR) {
+      printf("%s: ", job);
+      lval_println(x);
     }
+    lval_del(x);
+    fflush(stdout);
+    report.jobs++;
   }
 
-  lval_del(a);
-  return lval_sexpr();
-}
-
-lval *lval_read_str(mpc_ast_t *t) {
-  /**
-   * Read a string into an lval_str. Unescapes the string.
-   *
-   * mpc_ast_t* t: The string node from the mpc library.
-   */
-  t->contents[strlen(t->contents) - 1] = '\0';
-  char *unescaped = malloc(strlen(t->contents + 1) + 1);
-  strcpy(unescaped, t->contents + 1);
-  unescaped = mpcf_unescape(unescaped);
-  lval *str = lval_str(unescaped);
-
-  free(unescaped);
-  return str;
-}
-
-lval *builtin_join(lenv *env, lval *a) {
-  /**
-   * Take a q-expression and join each child into the first.
-   *
-   * lenv* env: The enviroment.
-   * lval* a: q-expression containing all of the chilren to be evaluated.
-   */
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+  // The report is smaller than PIPE_BUF, so it is written whole or not at
+  // all.
+  ssize_t written;
+  do {
+    written = write(done, &report, sizeof(report));
+  } while (written < 0 && errno == EINTR);
+  if (written != sizeof(report)) {
+    perror("lispy: worker could not report");
+    return;
   }
-
-  lval *x = lval_pop(a, 0);
-
-  while (a->count) {
-    x = lval_join(x, lval_pop(a, 0));
+  // The parent closes release once it has read the memory use.
+  char c;
+  ssize_t got;
+  do {
+    got = read(release, &c, 1);
+  } while (got < 0 && errno == EINTR);
+  if (got < 0) {
+    perror("lispy: worker could not wait for release");
   }
-
-  lval_del(a);
-  return x;
 }
 
-lval *builtin_head(lenv *e, lval *a) {
-  /**
-   * Take a q-expression and return a q-expression with a sigular child
-   * representing the first index.
-   *
-   * lenv* env: The enviroment.
-   * lval* a: q-expression to find the head of.
-   */
-  LASSERT_NUM("head", a, 1);
-  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-  LASSERT(a, a->cell[0]->count != 0, "Passed {} to head");
-  LASSERT_NOT_EMPTY("head", a);
-
-  // take the first child from a and del a
-  lval *v = lval_take(a, 0);
-  while (v->count > 1) {
-    lval_del(lval_pop(v, 1));
-  }
-  return v;
+double lprefork_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
 }
 
-lval *builtin_tail(lenv *env, lval *a) {
+int lprefork(int workers, int nfiles, char **files) {
   /**
-   * Take a q-expression and return a q-expression with the first index
-   * removed
+   * Load the files, fork the workers and hand them the jobs from stdin.
+   * Memory use of the parent and each worker goes to stderr at the end.
    *
-   * lenv* env: The enviroment.
-   * lval* a: q-expression to find the head of.
-   */
-  LASSERT_NUM("tail", a, 1);
-  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("head", a);
-
-  lval *v = lval_take(a, 0);
-  lval_del(lval_pop(v, 0));
-  return v;
-}
-
-lval *builtin_list(lenv *env, lval *a) {
-  printf("list\n");
-  a->type = LVAL_QEXPR;
-  return a;
-}
-
-lval *builtin_eval(lenv *env, lval *a) {
-  LASSERT_NUM("eval", a, 1);
-  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-
-  // take the first child from a and delete a
-  lval *v = lval_take(a, 0);
-  // set the type of v to S-expression
-  v->type = LVAL_SEXPR;
-  // evaluate the S-expression
-  return lval_eval(env, v);
-}
-
-lval *builtin_add(lenv *env, lval *a) { return builtin_op(env, a, "+"); }
-
-lval *builtin_sub(lenv *env, lval *a) { return builtin_op(env, a, "-"); }
-
-lval *builtin_div(lenv *env, lval *a) { return builtin_op(env, a, "/"); }
-
-lval *builtin_mul(lenv *env, lval *a) { return builtin_op(env, a, "*"); }
-
-lval *builtin_op(lenv *env, lval *a, char *op) {
-  for (int i = 0; i < a->count; i++) {
-    if (a->cell[i]->type != LVAL_NUM) {
-      lval_del(a);
-      return lval_err("Cannot operate on non-number");
+   * int workers: How many processes to fork.
+   * int nfiles, char** files: Files to load before forking.
+   * Returns:
+   * int: The exit status, 1 if the workers could not be started.
+   */
+  double start = lprefork_now();
+  linterp *interp = linterp_new();
+  for (int i = 0; i < nfiles; i++) {
+    lval *x = linterp_load(interp, files[i]);
+    if (lval_type(x) == LVAL_ERR) {
+      lval_println(x);
     }
+    lval_del(x);
   }
+  // The children would wait forever for futures the parent's threads run.
+  linterp_settle(interp);
+  double loaded = lprefork_now() - start;
 
-  lval *x = lval_pop(a, 0);
-
-  // if only one expression and - then negate
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
+  // Each message on a SOCK_SEQPACKET socket is read whole by one worker.
+  int jobs[2], done[2], release[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, jobs) < 0 || pipe(done) < 0 ||
+      pipe(release) < 0) {
+    perror("lispy");
+    return 1;
   }
 
-  while (a->count > 0) {
-    lval *y = lval_pop(a, 0);
-
-    if (strcmp(op, "+") == 0) {
-      x->num += y->num;
-    }
-    if (strcmp(op, "-") == 0) {
-      x->num -= y->num;
+  fflush(stdout);
+  fflush(stderr);
+  pid_t *pids = malloc(sizeof(pid_t) * workers);
+  int started = 0;
+  for (; started < workers; started++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("lispy");
+      break;
     }
-    if (strcmp(op, "*") == 0) {
-      x->num *= y->num;
+    if (pid == 0) {
+      close(jobs[0]);
+      close(done[0]);
+      close(release[1]);
+      lprefork_worker(interp, jobs[1], done[1], release[0]);
+      exit(0);
     }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division By Zero!");
-        break;
-      }
-      x->num /= y->num;
+    pids[started] = pid;
+  }
+  close(jobs[1]);
+  close(done[1]);
+  close(release[0]);
+
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while (started && (len = getline(&line, &cap, stdin)) > 0) {
+    if (line[len - 1] == '\n') {
+      line[--len] = '\0';
     }
-    lval_del(y);
-  }
-  lval_del(a);
-  return x;
-}
-
-lval *builtin(lenv *env, lval *a, char *func) {
-  if (strcmp("list", func) == 0) {
-    return builtin_list(env, a);
-  }
-  if (strcmp("eval", func) == 0) {
-    return builtin_eval(env, a);
-  }
-  if (strcmp("head", func) == 0) {
-    return builtin_head(env, a);
-  }
-  if (strcmp("tail", func) == 0) {
-    return builtin_tail(env, a);
-  }
-  if (strcmp("join", func) == 0) {
-    return builtin_join(env, a);
-  }
-  if (strstr("+-*/", func)) {
-    return builtin_op(env, a, func);
-  }
-  lval_del(a);
-  return lval_err("Unkown function");
-}
-
-lval *lval_read(mpc_ast_t *t) {
-
-  if (strstr(t->tag, "number")) {
-    return lval_read_num(t);
-  }
-  if (strstr(t->tag, "symbol")) {
-    return lval_sym(t->contents);
-  }
-  if (strstr(t->tag, "string")) {
-    return lval_read_str(t);
-  }
-
-  lval *x = NULL;
-  if (strcmp(t->tag, ">") == 0) {
-    x = lval_sexpr();
-  }
-  if (strstr(t->tag, "sexpr")) {
-    x = lval_sexpr();
-  }
-  if (strstr(t->tag, "qexpr")) {
-    x = lval_qexpr();
-  }
-
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) {
+    if (len == 0) {
       continue;
     }
-    if (strcmp(t->children[i]->contents, ")") == 0) {
+    if (len > LPREFORK_MAX_JOB) {
+      fprintf(stderr, "lispy: job name too long\n");
       continue;
     }
-    if (strcmp(t->children[i]->contents, "{") == 0) {
-      continue;
-    }
-    if (strcmp(t->children[i]->contents, "}") == 0) {
-      continue;
+    send(jobs[0], line, len, 0);
+  }
+  free(line);
+  shutdown(jobs[0], SHUT_WR);
+
+  long rss, pss, shared;
+  lprefork_mem(getpid(), &rss, &pss, &shared);
+  fprintf(stderr, "parent %d: loaded in %.1fms rss %ldkB pss %ldkB\n",
+          (int)getpid(), loaded * 1000, rss, pss);
+
+  // Read each worker while all of them are still alive, so the shared
+  // pages are split between all of them. A worker that dies never reports,
+  // and the others hold done open, so the wait is broken up to reap it.
+  int *counts = calloc(started, sizeof(int));
+  int *states = calloc(started, sizeof(int));
+  int waiting = started;
+  lprefork_done report;
+  while (waiting) {
+    fd_set ready;
+    FD_ZERO(&ready);
+    FD_SET(done[0], &ready);
+    struct timeval tick = {0, 100000};
+    if (select(done[0] + 1, &ready, NULL, NULL, &tick) > 0) {
+      if (read(done[0], &report, sizeof(report)) != sizeof(report)) {
+        break;
+      }
+      for (int j = 0; j < started; j++) {
+        if (pids[j] == report.pid && states[j] == LPREFORK_RUNNING) {
+          counts[j] = report.jobs;
+          states[j] = LPREFORK_REPORTED;
+          waiting--;
+        }
+      }
     }
-    if (strcmp(t->children[i]->tag, "regex") == 0) {
-      continue;
+    for (int j = 0; j < started; j++) {
+      if (states[j] == LPREFORK_RUNNING &&
+          waitpid(pids[j], NULL, WNOHANG) == pids[j]) {
+        states[j] = LPREFORK_DIED;
+        waiting--;
+      }
     }
-    if (strstr(t->children[i]->tag, "comment")) {
+  }
+  for (int i = 0; i < started; i++) {
+    if (states[i] == LPREFORK_DIED) {
+      fprintf(stderr, "worker %d: died before reporting\n", (int)pids[i]);
       continue;
     }
-    x = lval_add(x, lval_read(t->children[i]));
+    lprefork_mem(pids[i], &rss, &pss, &shared);
+    fprintf(stderr, "worker %d: jobs %d rss %ldkB pss %ldkB shared %ldkB\n",
+            (int)pids[i], counts[i], rss, pss, shared);
   }
-  return x;
-}
-
-lval *lval_pop(lval *v, int i) {
-  lval *x = v->cell[i];
+  free(counts);
 
-  memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
-  v->count--;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  return x;
-}
-
-lval *lval_take(lval *v, int i) {
-  lval *x = lval_pop(v, i);
-  lval_del(v);
-  return x;
-}
-
-lval *lval_eval(lenv *env, lval *v) {
-  /**
-   * Evaluate an lval within the context of an enviroment.
-   *
-   * lenv* env: The enviroment to get variables from.
-   * lval* v: The lval to evaluate.
-   */
-  if (v->type == LVAL_SYM) {
-    lval *x = lenv_get(env, v);
-    lval_del(v); // delete the LVAL_SYM as its been replaced
-    return x;
-  }
-  if (v->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(env, v);
+  close(release[1]);
+  for (int i = 0; i < started; i++) {
+    if (states[i] != LPREFORK_DIED) {
+      waitpid(pids[i], NULL, 0);
+    }
   }
-  return v;
+  free(states);
+  free(pids);
+  linterp_del(interp);
+  return started ? 0 : 1;
 }
 
-lval *lval_eval_sexpr(lenv *env, lval *v) {
-
-  // eval all chilren
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(env, v->cell[i]);
-    //		printf("Evaluated : ");
-    //		lval_println(v->cell[i]);
-  }
-
-  // if a child throws error
-  // take take that (del from v)
-  // and return
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) {
-      return lval_take(v, i);
+int main(int argc, char **argv) {
+  // "lispy --serve path workers [file ...]" runs as a server. Each
+  // connection starts from the files as loaded, and is closed after
+  // LSERVE_IDLE_SECONDS without a request.
+  if (argc >= 4 && strcmp(argv[1], "--serve") == 0) {
+    int workers = atoi(argv[3]);
+    if (workers < 1 || workers > LSERVE_MAX_WORKERS) {
+      fprintf(stderr, "lispy: workers must be from 1 to %d\n",
+              LSERVE_MAX_WORKERS);
+      return 1;
     }
+    return lserve(argv[2], workers, argc - 4, argv + 4);
+  }
+  // "lispy --prefork workers [file ...] < jobs" runs scripts in forked
+  // workers.
+  if (argc >= 3 && strcmp(argv[1], "--prefork") == 0) {
+    int workers = atoi(argv[2]);
+    if (workers < 1 || workers > LSERVE_MAX_WORKERS) {
+      fprintf(stderr, "lispy: workers must be from 1 to %d\n",
+              LSERVE_MAX_WORKERS);
+      return 1;
+    }
+    return lprefork(workers, argc - 3, argv + 3);
   }
 
-  // if v has no chilren
-  if (v->count == 0) {
-    return v;
-  }
-
-  // if v has one child take and return that
-  if (v->count == 1) {
-    return lval_take(v, 0);
-  }
+  linterp *interp = linterp_new();
 
-  // get first expre
-  lval *f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval *err = lval_err("S-Expression starts with the incorrect type"
-                         "Got %s but expected %s.",
-                         ltype_name(f->type), ltype_name(LVAL_FUN));
-    lval_del(f);
-    lval_del(v);
-    return err;
+  // "lispy --image file ..." starts from a heap image made by save-image.
+  if (argc >= 3 && strcmp(argv[1], "--image") == 0) {
+    lval *x = linterp_load_image(interp, argv[2]);
+    if (lval_type(x) == LVAL_ERR) {
+      lval_println(x);
+      lval_del(x);
+      linterp_del(interp);
+      return 1;
+    }
+    lval_del(x);
+    argv += 2;
+    argc -= 2;
   }
 
-  // evaluate using builtin
-  lval *result = lval_call(env, f, v);
-  lval_del(f);
-  return result;
-}
-
-int main(int argc, char **argv) {
-  Number = mpc_new("number");
-  Symbol = mpc_new("symbol");
-  String = mpc_new("string");
-  Comment = mpc_new("comment");
-  Sexpr = mpc_new("sexpr");
-  Qexpr = mpc_new("qexpr");
-  Expr = mpc_new("expr");
-  Lispy = mpc_new("lispy");
-
-  // Language definition
-  mpca_lang(MPCA_LANG_DEFAULT, "\
-				number: /-?[0-9]+/;\
-				symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;\
-				string: /\"(\\\\.|[^\"])*\"/ ;\
-        comment: /;[^\\r\\n]*/;\
-				sexpr: '(' <expr>* ')';\
-				qexpr: '{' <expr>* '}';\
-				expr: <number> | <symbol> | <sexpr> | \
-              <qexpr> | <string> | <comment>;\
-				lispy: /^/ <expr>+ /$/;\
-			",
-            Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-
-  // Global enviroment.
-  lenv *env = lenv_new();
-  // Bind builtin functions.
-  lenv_add_builtins(env);
-
   // If nothing is passed run in interactive mode
   if (argc == 1) {
     puts("Lispy Version 0.0.0.1");
@@ -1342,18 +582,9 @@ int main(int argc, char **argv) {
       char *input = readline("lispy >");
       add_history(input);
 
-      mpc_result_t r;
-      if (mpc_parse("<stdin>", input, Lispy, &r)) {
-        lval *x = lval_eval(env, lval_read(r.output));
-
-        lval_println(x);
-        lval_del(x);
-
-        mpc_ast_delete(r.output);
-      } else {
-        mpc_err_print(r.error);
-        mpc_err_delete(r.error);
-      }
+      lval *x = linterp_eval(interp, input);
+      lval_println(x);
+      lval_del(x);
 
       free(input);
     }
@@ -1364,19 +595,16 @@ int main(int argc, char **argv) {
   if (argc >= 2) {
     // For each arg
     for (int i = 1; i < argc; i++) {
-      // Create a new lval containing only the passed str.
-      lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
       // Try to run the passed thing as a library.
-      lval *x = builtin_load(env, args);
+      lval *x = linterp_load(interp, argv[i]);
       // If the result is an error print that.
-      if (x->type == LVAL_ERR) {
+      if (lval_type(x) == LVAL_ERR) {
         lval_println(x);
       }
 
       lval_del(x);
     }
   }
-  lenv_del(env);
-  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  linterp_del(interp);
   return 0;
 }
@@ -6,6 +6,13 @@ Copyright (c) 2013, Daniel Holden All rights reserved.
 
 #include "mpc.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /*
 ** State Type
 */
@@ -81,6 +88,22 @@ typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+/*
+** A memoized parser's result at one position, see mpc_parse_memo.
+*/
+
+typedef struct mpc_memo_t {
+  mpc_parser_t *parser;
+  long pos;
+  char flags;
+  char success;
+  char last;
+  mpc_state_t state;
+  void *result;
+  mpc_err_t *error;
+  struct mpc_memo_t *next;
+} mpc_memo_t;
+
 typedef struct {
 
   int type;
@@ -90,6 +113,16 @@ typedef struct {
   char *string;
   char *buffer;
   FILE *file;
+  size_t mapped;
+
+  /*
+  ** Pipe input keeps what it has read from the oldest mark on, so it can
+  ** rewind, in a ring buffer. The character at position pos is at
+  ** buffer[pos & (buffer_size - 1)] while buffer_start <= pos < buffer_end.
+  */
+  size_t buffer_size;
+  long buffer_start;
+  long buffer_end;
 
   int suppress;
   int backtrack;
@@ -100,6 +133,27 @@ typedef struct {
   char *lasts;
   char last;
 
+  /*
+  ** Results of memoized parsers, chained in buckets by parser and position,
+  ** and how often they were looked up and reused.
+  */
+  mpc_memo_t **memo;
+  size_t memo_slots;
+  size_t memo_num;
+  size_t memo_bytes;
+  long memo_hits;
+  long memo_misses;
+
+  /*
+  ** Regexes compiled to a DFA match straight from the string and `or`
+  ** dispatch tables skip alternatives that cannot match. Neither builds
+  ** the errors the combinators would, so a failed parse that used one is
+  ** parsed again with them turned off, from fast_start.
+  */
+  int fast_off;
+  int fast_used;
+  long fast_start;
+
   size_t mem_index;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
@@ -120,6 +174,10 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   strcpy(i->string, string);
   i->buffer = NULL;
   i->file = NULL;
+  i->mapped = 0;
+  i->buffer_size = 0;
+  i->buffer_start = 0;
+  i->buffer_end = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -129,6 +187,17 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_bytes = 0;
+  i->memo_hits = 0;
+  i->memo_misses = 0;
+
+  i->fast_off = 0;
+  i->fast_start = 0;
+  i->fast_used = 0;
+
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
@@ -150,6 +219,10 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->string[length] = '\0';
   i->buffer = NULL;
   i->file = NULL;
+  i->mapped = 0;
+  i->buffer_size = 0;
+  i->buffer_start = 0;
+  i->buffer_end = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -159,6 +232,17 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_bytes = 0;
+  i->memo_hits = 0;
+  i->memo_misses = 0;
+
+  i->fast_off = 0;
+  i->fast_start = 0;
+  i->fast_used = 0;
+
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
@@ -179,6 +263,10 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = pipe;
+  i->mapped = 0;
+  i->buffer_size = 0;
+  i->buffer_start = 0;
+  i->buffer_end = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -188,6 +276,17 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_bytes = 0;
+  i->memo_hits = 0;
+  i->memo_misses = 0;
+
+  i->fast_off = 0;
+  i->fast_start = 0;
+  i->fast_used = 0;
+
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
@@ -207,6 +306,10 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = file;
+  i->mapped = 0;
+  i->buffer_size = 0;
+  i->buffer_start = 0;
+  i->buffer_end = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -216,18 +319,88 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_bytes = 0;
+  i->memo_hits = 0;
+  i->memo_misses = 0;
+
+  i->fast_off = 0;
+  i->fast_start = 0;
+  i->fast_used = 0;
+
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
 }
 
+#ifndef _WIN32
+static mpc_input_t *mpc_input_new_mapped(const char *filename, int fd, size_t length) {
+
+  /*
+  ** The file is mapped over the start of a larger anonymous mapping, so the
+  ** byte after its end is always a zero terminating it like a string,
+  ** even when the length is a multiple of the page size.
+  */
+
+  mpc_input_t *i;
+  char *string = mmap(NULL, length + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (string == MAP_FAILED) { return NULL; }
+  if (mmap(string, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(string, length + 1);
+    return NULL;
+  }
+
+  i = mpc_input_new_nstring(filename, "", 0);
+  free(i->string);
+  i->string = string;
+  i->mapped = length + 1;
+  return i;
+}
+#endif
+
+static void mpc_memo_delete(mpc_input_t *i) {
+
+  size_t j;
+  mpc_memo_t *m, *n;
+
+  for (j = 0; j < i->memo_slots; j++) {
+    for (m = i->memo[j]; m != NULL; m = n) {
+      n = m->next;
+      if (m->success) { mpc_ast_delete(m->result); }
+      else if (m->result) { mpc_err_delete(m->result); }
+      if (m->error) { mpc_err_delete(m->error); }
+      free(m);
+    }
+  }
+  free(i->memo);
+
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_bytes = 0;
+
+}
+
 static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
+  mpc_memo_delete(i);
 
+#ifndef _WIN32
+  if (i->mapped) { munmap(i->string, i->mapped); i->string = NULL; }
+#endif
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  if (i->type == MPC_INPUT_PIPE) {
+    /* Give back what was read past the end of the parse. */
+    while (i->buffer_end > i->state.pos) {
+      i->buffer_end--;
+      ungetc(i->buffer[i->buffer_end & (i->buffer_size - 1)], i->file);
+    }
+    free(i->buffer);
+  }
 
   free(i->marks);
   free(i->lasts);
@@ -319,14 +492,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -341,14 +509,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
@@ -365,12 +525,51 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+
+  /*
+  ** Make sure the character at the current position is in the buffer,
+  ** reading it from the pipe if needed. Returns 0 at the end of input.
+  */
+
+  int c;
+  long p, keep;
+  char *buffer;
+  size_t size;
+
+  if (i->state.pos < i->buffer_end) { return 1; }
+
+  c = getc(i->file);
+  if (c == EOF) { return 0; }
+
+  /*
+  ** Nothing before the oldest mark can be rewound to, so it is dropped.
+  ** While the fast paths are on, a failed parse may be run again from its
+  ** start, so that is kept too. Predictive grammars take no marks.
+  */
+  keep = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+  if (!i->fast_off && i->fast_start < keep) { keep = i->fast_start; }
+  if (keep > i->buffer_start) { i->buffer_start = keep; }
+
+  if ((size_t)(i->buffer_end - i->buffer_start) == i->buffer_size) {
+    size = i->buffer_size ? i->buffer_size * 2 : 4096;
+    buffer = malloc(size);
+    for (p = i->buffer_start; p < i->buffer_end; p++) {
+      buffer[p & (size - 1)] = i->buffer[p & (i->buffer_size - 1)];
+    }
+    free(i->buffer);
+    i->buffer = buffer;
+    i->buffer_size = size;
+  }
+
+  i->buffer[i->buffer_end & (i->buffer_size - 1)] = c;
+  i->buffer_end++;
+  return 1;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  if (!mpc_input_buffer_fill(i)) { return '\0'; }
+  return i->buffer[i->state.pos & (i->buffer_size - 1)];
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
@@ -381,17 +580,7 @@ static char mpc_input_getc(mpc_input_t *i) {
 
     case MPC_INPUT_STRING: return i->string[i->state.pos];
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
 
     default: return c;
   }
@@ -411,23 +600,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
       fseek(i->file, -1, SEEK_CUR);
       return c;
 
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
 
     default: return c;
   }
@@ -443,16 +616,8 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
   switch (i->type) {
     case MPC_INPUT_STRING: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
+    /* The character is still in the buffer, at the same position. */
+    case MPC_INPUT_PIPE: { break; }
     default: { break; }
   }
   return 0;
@@ -460,13 +625,6 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -546,6 +704,42 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   return 1;
 }
 
+static int mpc_input_dfa(mpc_input_t *i, int n, const unsigned char *table, char **o) {
+
+  /*
+  ** Run a regex DFA over the string. Each state has a row of 256 next
+  ** states, zero when the character can't be matched, followed at the end
+  ** of the table by a flag per state saying if the match may stop there.
+  */
+
+  const unsigned char *s = (const unsigned char*)i->string + i->state.pos;
+  const unsigned char *accept = table + (size_t)n * 256;
+  long j, len = 0;
+  unsigned char q = 0, t;
+
+  while ((t = table[(size_t)q * 256 + s[len]]) != 0) {
+    q = t;
+    len++;
+  }
+
+  if (!accept[q]) { return 0; }
+
+  for (j = 0; j < len; j++) {
+    i->state.col++;
+    if (s[j] == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
+  }
+  i->state.pos += len;
+  if (len > 0) { i->last = (char)s[len-1]; }
+
+  *o = mpc_malloc(i, len + 1);
+  memcpy(*o, s, len);
+  (*o)[len] = '\0';
+  return 1;
+}
+
 static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char), char **o) {
   *o = NULL;
   return f(i->last, mpc_input_peekc(i));
@@ -922,7 +1116,9 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_DFA        = 29
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -940,8 +1136,9 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; ch
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *jump; int *alts; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; int n; unsigned char *table; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -961,6 +1158,7 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -968,6 +1166,10 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char memoize;
+  long memo_hits;
+  long memo_misses;
+  size_t memo_bytes;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -1052,9 +1254,12 @@ enum {
 
 #define MPC_MAX_RECURSION_DEPTH 1000
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
+
+static int mpc_parse_step(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-  int j = 0, k = 0;
+  int j = 0, k = 0, alts_n = 0;
+  int *alts = NULL;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
   mpc_result_t *results;
   int results_slots = MPC_PARSE_STACK_MIN;
@@ -1079,6 +1284,17 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
     case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
 
+    case MPC_TYPE_DFA:
+      if (i->type == MPC_INPUT_STRING && !i->fast_off) {
+        i->fast_used = 1;
+        MPC_PRIMITIVE(mpc_input_dfa(i, p->data.dfa.n, p->data.dfa.table, (char**)&r->output));
+      }
+      if (mpc_parse_run(i, p->data.dfa.x, r, e, depth+1)) {
+        MPC_SUCCESS(r->output);
+      } else {
+        MPC_FAILURE(r->error);
+      }
+
     /* Other parsers */
 
     case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
@@ -1233,16 +1449,19 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
         : results_stk;
 
+      mpc_input_mark(i);
       while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
         j++;
         if (j == p->data.repeat.n) { break; }
       }
 
       if (j == p->data.repeat.n) {
+        mpc_input_unmark(i);
         MPC_SUCCESS(
           mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
           if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
       } else {
+        mpc_input_rewind(i);
         for (k = 0; k < j; k++) {
           mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
         }
@@ -1261,8 +1480,17 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
         : results_stk;
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
+      /* Only try the alternatives that can start with the next character */
+      alts_n = p->data.or.n;
+      if (p->data.or.jump && !i->fast_off) {
+        k = p->data.or.jump[(unsigned char)mpc_input_peekc(i)];
+        alts = p->data.or.alts + p->data.or.alts[k];
+        alts_n = p->data.or.alts[k+1] - p->data.or.alts[k];
+        if (alts_n < p->data.or.n) { i->fast_used = 1; }
+      }
+
+      for (j = 0; j < alts_n; j++) {
+        if (mpc_parse_run(i, p->data.or.xs[alts ? alts[j] : j], &results[j], e, depth+1)) {
           MPC_SUCCESS(results[j].output;
             if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
         } else {
@@ -1312,17 +1540,198 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
+/*
+** Packrat Memoization
+*/
+
+enum {
+  MPC_MEMO_SLOTS_MIN = 64
+};
+
+static size_t mpc_memo_hash(mpc_parser_t *p, long pos) {
+  return (((size_t)p) >> 4) ^ ((size_t)pos * 2654435761u);
+}
+
+static mpc_err_t *mpc_err_copy(mpc_err_t *x, size_t *bytes) {
+
+  int j;
+  mpc_err_t *y;
+
+  if (x == NULL) { return NULL; }
+
+  y = malloc(sizeof(mpc_err_t));
+  memcpy(y, x, sizeof(mpc_err_t));
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+    if (bytes) { *bytes += sizeof(char*) + strlen(x->expected[j]) + 1; }
+  }
+
+  if (bytes) {
+    *bytes += sizeof(mpc_err_t) + strlen(x->filename) + 1;
+    if (x->failure) { *bytes += strlen(x->failure) + 1; }
+  }
+
+  return y;
+}
+
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a, size_t *bytes) {
+
+  int j;
+  mpc_ast_t *b;
+
+  if (a == NULL) { return NULL; }
+
+  b = malloc(sizeof(mpc_ast_t));
+  b->tag = malloc(strlen(a->tag) + 1);
+  strcpy(b->tag, a->tag);
+  b->contents = malloc(strlen(a->contents) + 1);
+  strcpy(b->contents, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  for (j = 0; j < a->children_num; j++) {
+    b->children[j] = mpc_ast_copy(a->children[j], bytes);
+  }
+
+  if (bytes) {
+    *bytes += sizeof(mpc_ast_t) + strlen(a->tag) + strlen(a->contents) + 2
+      + sizeof(mpc_ast_t*) * a->children_num;
+  }
+
+  return b;
+}
+
+static void mpc_memo_grow(mpc_input_t *i) {
+
+  size_t j, h, slots;
+  mpc_memo_t **memo, *m, *n;
+
+  slots = i->memo_slots ? i->memo_slots * 2 : MPC_MEMO_SLOTS_MIN;
+  memo = calloc(slots, sizeof(mpc_memo_t*));
+
+  for (j = 0; j < i->memo_slots; j++) {
+    for (m = i->memo[j]; m != NULL; m = n) {
+      n = m->next;
+      h = mpc_memo_hash(m->parser, m->pos) & (slots - 1);
+      m->next = memo[h];
+      memo[h] = m;
+    }
+  }
+
+  i->memo_bytes += (slots - i->memo_slots) * sizeof(mpc_memo_t*);
+  free(i->memo);
+  i->memo = memo;
+  i->memo_slots = slots;
+}
+
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+
+  /*
+  ** The first time a memoized parser runs at a position, what it returned,
+  ** where it stopped and the furthest error it saw on the way are recorded.
+  ** When backtracking brings it back to that position they are replayed
+  ** instead of parsing again, so each rule runs at most once per position.
+  ** Results are copied in and out of the table, which means this is only
+  ** for parsers returning an mpc_ast_t, as the rules of mpca_lang do.
+  */
+
+  int x;
+  size_t h;
+  mpc_memo_t *m;
+  mpc_err_t *f = NULL;
+  char flags = (char)((i->suppress > 0) | ((i->backtrack > 0) << 1));
+
+  if (i->memo_slots) {
+    h = mpc_memo_hash(p, i->state.pos) & (i->memo_slots - 1);
+    for (m = i->memo[h]; m != NULL; m = m->next) {
+      if (m->parser != p || m->pos != i->state.pos || m->flags != flags) { continue; }
+
+      i->memo_hits++;
+      i->state = m->state;
+      i->last = m->last;
+      if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+      if (m->error) { *e = mpc_err_merge(i, *e, mpc_err_copy(m->error, NULL)); }
+
+      if (m->success) {
+        r->output = mpc_ast_copy(m->result, NULL);
+        return 1;
+      } else {
+        r->error = mpc_err_copy(m->result, NULL);
+        return 0;
+      }
+    }
+  }
+
+  i->memo_misses++;
+
+  m = malloc(sizeof(mpc_memo_t));
+  m->parser = p;
+  m->pos = i->state.pos;
+  m->flags = flags;
+
+  x = mpc_parse_step(i, p, r, &f, depth);
+
+  m->success = (char)x;
+  m->last = i->last;
+  m->state = i->state;
+  m->result = x
+    ? (void*)mpc_ast_copy(r->output, &i->memo_bytes)
+    : (void*)mpc_err_copy(r->error, &i->memo_bytes);
+  m->error = mpc_err_copy(f, &i->memo_bytes);
+  *e = mpc_err_merge(i, *e, f);
+
+  if (i->memo_num >= i->memo_slots) { mpc_memo_grow(i); }
+  h = mpc_memo_hash(p, m->pos) & (i->memo_slots - 1);
+  m->next = i->memo[h];
+  i->memo[h] = m;
+  i->memo_num++;
+  i->memo_bytes += sizeof(mpc_memo_t);
+
+  return x;
+}
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+  /* At depth zero the parse is over once the parser returns, so nothing is kept */
+  if (p->memoize && depth > 0) { return mpc_parse_memo(i, p, r, e, depth); }
+  return mpc_parse_step(i, p, r, e, depth);
+}
+
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
+  mpc_state_t start = i->state;
+  char last = i->last;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
+  i->fast_start = start.pos;
   x = mpc_parse_run(i, p, r, &e, 0);
+  if (!x && i->fast_used) {
+    mpc_err_delete_internal(i, mpc_err_merge(i, e, r->error));
+    mpc_memo_delete(i);
+    i->state = start;
+    i->last = last;
+    i->fast_off = 1;
+    e = mpc_err_fail(i, "Unknown Error");
+    e->state = mpc_state_invalid();
+    x = mpc_parse_run(i, p, r, &e, 0);
+  }
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
   } else {
     r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
   }
+  p->memo_hits += i->memo_hits;
+  p->memo_misses += i->memo_misses;
+  if (i->memo_bytes > p->memo_bytes) { p->memo_bytes = i->memo_bytes; }
   return x;
 }
 
@@ -1358,10 +1767,46 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+int mpc_parse_mapped(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+
+  /*
+  ** Parse a file by mapping it into memory and reading it as a string,
+  ** without the stdio call per character of mpc_parse_file. Returns -1 if
+  ** the file could not be mapped, for instance if it is a pipe.
+  */
+
+#ifndef _WIN32
+  int x, fd;
+  struct stat st;
+  mpc_input_t *i = NULL;
+
+  /* Opening a FIFO would take its writer, so only regular files are opened. */
+  if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) { return -1; }
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) { return -1; }
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    i = mpc_input_new_mapped(filename, fd, st.st_size);
+  }
+  close(fd);
+  if (i == NULL) { return -1; }
+
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+#else
+  (void)filename; (void)p; (void)r;
+  return -1;
+#endif
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
-  FILE *f = fopen(filename, "rb");
-  int res;
+  FILE *f;
+  int res = mpc_parse_mapped(filename, p, r);
+  if (res != -1) { return res; }
+
+  f = fopen(filename, "rb");
 
   if (f == NULL) {
     r->output = NULL;
@@ -1369,6 +1814,18 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
 
+#ifndef _WIN32
+  {
+    /* Pipes can't seek back, so they are read with mpc_parse_pipe. */
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0 && !S_ISREG(st.st_mode)) {
+      res = mpc_parse_pipe(filename, f, p, r);
+      fclose(f);
+      return res;
+    }
+  }
+#endif
+
   res = mpc_parse_file(filename, f, p, r);
   fclose(f);
   return res;
@@ -1387,6 +1844,8 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.jump);
+  free(p->data.or.alts);
 
 }
 
@@ -1419,6 +1878,11 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
 
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      free(p->data.dfa.table);
+      break;
+
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
       mpc_undefine_unretained(p->data.not.x, 0);
@@ -1494,7 +1958,7 @@ mpc_parser_t *mpc_new(const char *name) {
 }
 
 mpc_parser_t *mpc_copy(mpc_parser_t *a) {
-  int i = 0;
+  int i = 0, n = 0;
   mpc_parser_t *p;
 
   if (a->retained) { return a; }
@@ -1527,6 +1991,12 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
 
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.table = malloc((size_t)a->data.dfa.n * 257);
+      memcpy(p->data.dfa.table, a->data.dfa.table, (size_t)a->data.dfa.n * 257);
+      break;
+
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
       p->data.not.x = mpc_copy(a->data.not.x);
@@ -1549,6 +2019,15 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      if (a->data.or.jump) {
+        for (i = 0, n = 0; i < 256; i++) {
+          if (a->data.or.jump[i] >= n) { n = a->data.or.jump[i] + 1; }
+        }
+        p->data.or.jump = malloc(256);
+        memcpy(p->data.or.jump, a->data.or.jump, 256);
+        p->data.or.alts = malloc(sizeof(int) * a->data.or.alts[n]);
+        memcpy(p->data.or.alts, a->data.or.alts, sizeof(int) * a->data.or.alts[n]);
+      }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1888,6 +2367,11 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_memoize(mpc_parser_t *a) {
+  a->memoize = 1;
+  return a;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2364,6 +2848,552 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** Regular Expression DFAs
+**
+** Regexes in mpc are matched like the rest of a grammar, which is not
+** like most regex engines: `|` takes the first alternative that matches
+** and `*`, `+` and `?` never give back what they matched. So compiling a
+** regex to a DFA means compiling those rules, not the usual ones. The
+** regex is first turned into a small tree of character classes and
+** operators, and then each state of the DFA is a character class of that
+** tree, whose row says which class matches each next character in the
+** order the combinators would try them.
+**
+** That only gives the combinators' answer if no choice ever has to be
+** undone, so alternatives starting with overlapping classes are factored
+** first, and regexes where a choice could still fail after matching a
+** character keep their combinators. So do anchors and anything else a
+** DFA can't express.
+*/
+
+enum {
+  MPC_DFA_CLASS = 0,
+  MPC_DFA_EMPTY = 1,
+  MPC_DFA_SEQ   = 2,
+  MPC_DFA_ALT   = 3,
+  MPC_DFA_STAR  = 4,
+  MPC_DFA_MAYBE = 5
+};
+
+enum {
+  MPC_DFA_STATES_MAX = 255,
+  MPC_DFA_NODES_MAX  = 4096
+};
+
+typedef struct mpc_dfa_node_t {
+  int type;
+  int n;
+  int index;
+  int state;
+  unsigned char set[32];
+  struct mpc_dfa_node_t **xs;
+  struct mpc_dfa_node_t *parent;
+} mpc_dfa_node_t;
+
+static int mpc_dfa_has(const unsigned char *set, int c) {
+  return (set[c >> 3] >> (c & 7)) & 1;
+}
+
+static mpc_dfa_node_t *mpc_dfa_node_new(int type, int n, int *count) {
+  mpc_dfa_node_t *a = calloc(1, sizeof(mpc_dfa_node_t));
+  a->type = type;
+  a->n = n;
+  a->xs = n ? calloc(n, sizeof(mpc_dfa_node_t*)) : NULL;
+  (*count)++;
+  return a;
+}
+
+static void mpc_dfa_node_delete(mpc_dfa_node_t *a) {
+  int j;
+  if (a == NULL) { return; }
+  for (j = 0; j < a->n; j++) { mpc_dfa_node_delete(a->xs[j]); }
+  free(a->xs);
+  free(a);
+}
+
+static mpc_dfa_node_t *mpc_dfa_node_copy(mpc_dfa_node_t *a, int *count) {
+  int j;
+  mpc_dfa_node_t *b = mpc_dfa_node_new(a->type, a->n, count);
+  memcpy(b->set, a->set, sizeof(b->set));
+  for (j = 0; j < a->n; j++) { b->xs[j] = mpc_dfa_node_copy(a->xs[j], count); }
+  return b;
+}
+
+static void mpc_dfa_set(mpc_parser_t *p, unsigned char *set) {
+
+  int c, in = 0;
+  char x;
+
+  /* The end of the input is never matched, so neither is the '\0' at it */
+  for (c = 1; c < 256; c++) {
+    x = (char)c;
+    switch (p->type) {
+      case MPC_TYPE_ANY:     in = 1; break;
+      case MPC_TYPE_SINGLE:  in = x == p->data.single.x; break;
+      case MPC_TYPE_RANGE:   in = x >= p->data.range.x && x <= p->data.range.y; break;
+      case MPC_TYPE_ONEOF:   in = strchr(p->data.string.x, x) != NULL; break;
+      case MPC_TYPE_NONEOF:  in = strchr(p->data.string.x, x) == NULL; break;
+      case MPC_TYPE_SATISFY: in = p->data.satisfy.f(x); break;
+      default: break;
+    }
+    if (in) { set[c >> 3] |= (unsigned char)(1 << (c & 7)); }
+  }
+
+}
+
+static mpc_dfa_node_t *mpc_dfa_class(mpc_parser_t *p, int *count) {
+  mpc_dfa_node_t *a = mpc_dfa_node_new(MPC_DFA_CLASS, 0, count);
+  mpc_dfa_set(p, a->set);
+  return a;
+}
+
+static mpc_dfa_node_t *mpc_dfa_from(mpc_parser_t *p, int *count) {
+
+  int j, n, c;
+  mpc_dfa_node_t *a, *x;
+
+  if (*count > MPC_DFA_NODES_MAX) { return NULL; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+      return mpc_dfa_class(p, count);
+
+    case MPC_TYPE_EXPECT:
+      return mpc_dfa_from(p->data.expect.x, count);
+
+    case MPC_TYPE_LIFT:
+      if (p->data.lift.lf != mpcf_ctor_str) { return NULL; }
+      return mpc_dfa_node_new(MPC_DFA_EMPTY, 0, count);
+
+    case MPC_TYPE_STRING:
+      n = (int)strlen(p->data.string.x);
+      a = mpc_dfa_node_new(MPC_DFA_SEQ, n, count);
+      for (j = 0; j < n; j++) {
+        c = (unsigned char)p->data.string.x[j];
+        a->xs[j] = mpc_dfa_node_new(MPC_DFA_CLASS, 0, count);
+        a->xs[j]->set[c >> 3] |= (unsigned char)(1 << (c & 7));
+      }
+      return a;
+
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return NULL; }
+      x = mpc_dfa_from(p->data.not.x, count);
+      if (x == NULL) { return NULL; }
+      a = mpc_dfa_node_new(MPC_DFA_MAYBE, 1, count);
+      a->xs[0] = x;
+      return a;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold) { return NULL; }
+      n = p->type == MPC_TYPE_COUNT ? p->data.repeat.n : p->type == MPC_TYPE_MANY1 ? 2 : 1;
+      a = mpc_dfa_node_new(MPC_DFA_SEQ, n, count);
+      for (j = 0; j < n; j++) {
+        x = mpc_dfa_from(p->data.repeat.x, count);
+        if (x == NULL) { mpc_dfa_node_delete(a); return NULL; }
+        if (p->type != MPC_TYPE_COUNT && j == n-1) {
+          a->xs[j] = mpc_dfa_node_new(MPC_DFA_STAR, 1, count);
+          a->xs[j]->xs[0] = x;
+        } else {
+          a->xs[j] = x;
+        }
+      }
+      return a;
+
+    case MPC_TYPE_AND:
+    case MPC_TYPE_OR:
+      if (p->type == MPC_TYPE_AND && p->data.and.f != mpcf_strfold) { return NULL; }
+      n = p->type == MPC_TYPE_AND ? p->data.and.n : p->data.or.n;
+      a = mpc_dfa_node_new(p->type == MPC_TYPE_AND ? MPC_DFA_SEQ : MPC_DFA_ALT, n, count);
+      for (j = 0; j < n; j++) {
+        x = mpc_dfa_from(p->type == MPC_TYPE_AND ? p->data.and.xs[j] : p->data.or.xs[j], count);
+        if (x == NULL) { mpc_dfa_node_delete(a); return NULL; }
+        a->xs[j] = x;
+      }
+      return a;
+
+    default:
+      return NULL;
+  }
+
+}
+
+static mpc_dfa_node_t *mpc_dfa_flatten(mpc_dfa_node_t *a) {
+
+  /* Splice nested sequences and choices into their parent and drop empty steps */
+
+  int j, k, n;
+  mpc_dfa_node_t **xs, *x;
+
+  if (a->type != MPC_DFA_SEQ && a->type != MPC_DFA_ALT) { return a; }
+
+  n = 0;
+  for (j = 0; j < a->n; j++) {
+    x = a->xs[j];
+    if (x->type == a->type) { n += x->n; }
+    else if (!(a->type == MPC_DFA_SEQ && x->type == MPC_DFA_EMPTY)) { n++; }
+  }
+
+  xs = n ? malloc(sizeof(mpc_dfa_node_t*) * n) : NULL;
+  n = 0;
+  for (j = 0; j < a->n; j++) {
+    x = a->xs[j];
+    if (x->type == a->type) {
+      for (k = 0; k < x->n; k++) { xs[n++] = x->xs[k]; }
+      x->n = 0;
+      mpc_dfa_node_delete(x);
+    } else if (a->type == MPC_DFA_SEQ && x->type == MPC_DFA_EMPTY) {
+      mpc_dfa_node_delete(x);
+    } else {
+      xs[n++] = x;
+    }
+  }
+
+  free(a->xs);
+  a->xs = xs;
+  a->n = n;
+
+  if (n == 0) { a->type = MPC_DFA_EMPTY; }
+  if (n == 1) { x = xs[0]; free(xs); free(a); return x; }
+  return a;
+}
+
+static mpc_dfa_node_t *mpc_dfa_normalise(mpc_dfa_node_t *a, int *count);
+
+static mpc_dfa_node_t *mpc_dfa_factor(mpc_dfa_node_t *a, int *count) {
+
+  /*
+  ** Alternatives that start with overlapping classes would have to be
+  ** undone when the first fails further on, so they are rewritten to match
+  ** each character once and then choose among what follows it, which
+  ** the combinators would do the same way:
+  **
+  **   ab|[a-z]c  ->  a(b|c)|[b-z]c
+  **
+  ** Only the leading alternatives starting with a class are factored,
+  ** since ordered choice is associative and the rest can stay behind.
+  */
+
+  int j, k, c, m, n, groups;
+  unsigned long sig[256], seen[256];
+  mpc_dfa_node_t *b, *g, *alt, **xs;
+
+  for (n = 0; n < a->n && n < 32; n++) {
+    b = a->xs[n];
+    if (b->type != MPC_DFA_CLASS
+    && !(b->type == MPC_DFA_SEQ && b->xs[0]->type == MPC_DFA_CLASS)) { break; }
+  }
+
+  memset(sig, 0, sizeof(sig));
+  k = 0;
+  for (j = 0; j < n; j++) {
+    b = a->xs[j]->type == MPC_DFA_CLASS ? a->xs[j] : a->xs[j]->xs[0];
+    for (c = 1; c < 256; c++) {
+      if (!mpc_dfa_has(b->set, c)) { continue; }
+      if (sig[c]) { k = 1; }
+      sig[c] |= 1ul << j;
+    }
+  }
+  if (!k) { return a; }
+
+  /* One alternative for each set of alternatives a character can start */
+  groups = 0;
+  xs = malloc(sizeof(mpc_dfa_node_t*) * (255 + a->n - n));
+  for (c = 1; c < 256; c++) {
+
+    if (!sig[c]) { continue; }
+    for (j = 0; j < groups; j++) { if (seen[j] == sig[c]) { break; } }
+    if (j < groups) {
+      xs[j]->xs[0]->set[c >> 3] |= (unsigned char)(1 << (c & 7));
+      continue;
+    }
+
+    m = 0;
+    for (j = 0; j < n; j++) { if (sig[c] & (1ul << j)) { m++; } }
+
+    alt = mpc_dfa_node_new(MPC_DFA_ALT, m, count);
+    for (j = 0, m = 0; j < n; j++) {
+      if (!(sig[c] & (1ul << j))) { continue; }
+      b = a->xs[j];
+      if (b->type == MPC_DFA_CLASS) {
+        alt->xs[m++] = mpc_dfa_node_new(MPC_DFA_EMPTY, 0, count);
+      } else {
+        alt->xs[m] = mpc_dfa_node_new(MPC_DFA_SEQ, b->n - 1, count);
+        for (k = 1; k < b->n; k++) {
+          alt->xs[m]->xs[k-1] = mpc_dfa_node_copy(b->xs[k], count);
+        }
+        m++;
+      }
+    }
+
+    g = mpc_dfa_node_new(MPC_DFA_SEQ, 2, count);
+    g->xs[0] = mpc_dfa_node_new(MPC_DFA_CLASS, 0, count);
+    g->xs[0]->set[c >> 3] |= (unsigned char)(1 << (c & 7));
+    g->xs[1] = alt;
+
+    seen[groups] = sig[c];
+    xs[groups++] = g;
+  }
+
+  for (j = 0; j < n; j++) { mpc_dfa_node_delete(a->xs[j]); }
+  for (j = n, m = groups; j < a->n; j++) { xs[m++] = a->xs[j]; }
+  free(a->xs);
+  a->xs = xs;
+  a->n = m;
+
+  /* What follows each character may need factoring in turn */
+  for (j = 0; j < groups && *count <= MPC_DFA_NODES_MAX; j++) {
+    a->xs[j] = mpc_dfa_normalise(a->xs[j], count);
+  }
+
+  return a;
+}
+
+static mpc_dfa_node_t *mpc_dfa_normalise(mpc_dfa_node_t *a, int *count) {
+  int j;
+  for (j = 0; j < a->n && *count <= MPC_DFA_NODES_MAX; j++) {
+    a->xs[j] = mpc_dfa_normalise(a->xs[j], count);
+  }
+  a = mpc_dfa_flatten(a);
+  if (a->type == MPC_DFA_ALT && *count <= MPC_DFA_NODES_MAX) {
+    a = mpc_dfa_flatten(mpc_dfa_factor(a, count));
+  }
+  return a;
+}
+static int mpc_dfa_nullable(mpc_dfa_node_t *a) {
+  int j;
+  switch (a->type) {
+    case MPC_DFA_CLASS: return 0;
+    case MPC_DFA_SEQ:
+      for (j = 0; j < a->n; j++) { if (!mpc_dfa_nullable(a->xs[j])) { return 0; } }
+      return 1;
+    case MPC_DFA_ALT:
+      for (j = 0; j < a->n; j++) { if (mpc_dfa_nullable(a->xs[j])) { return 1; } }
+      return 0;
+    default: return 1;
+  }
+}
+
+static void mpc_dfa_first(mpc_dfa_node_t *a, unsigned char *set) {
+  int j;
+  switch (a->type) {
+    case MPC_DFA_CLASS:
+      for (j = 0; j < 32; j++) { set[j] |= a->set[j]; }
+      break;
+    case MPC_DFA_SEQ:
+    case MPC_DFA_ALT:
+      /* Alternatives after one that can match nothing are never tried */
+      for (j = 0; j < a->n; j++) {
+        mpc_dfa_first(a->xs[j], set);
+        if (mpc_dfa_nullable(a->xs[j]) != (a->type == MPC_DFA_SEQ)) { break; }
+      }
+      break;
+    case MPC_DFA_STAR:
+    case MPC_DFA_MAYBE:
+      mpc_dfa_first(a->xs[0], set);
+      break;
+    default: break;
+  }
+}
+
+static int mpc_dfa_reachable(mpc_dfa_node_t *a) {
+  int j;
+  for (j = 0; j < a->n - 1; j++) { if (mpc_dfa_nullable(a->xs[j])) { break; } }
+  return j + 1;
+}
+
+static int mpc_dfa_total(mpc_dfa_node_t *a);
+
+static int mpc_dfa_safe(mpc_dfa_node_t *a) {
+
+  /* Once it has matched a character, it can't fail */
+
+  int j, k;
+
+  switch (a->type) {
+    case MPC_DFA_SEQ:
+      for (j = 0; j < a->n; j++) {
+        if (!mpc_dfa_safe(a->xs[j])) { return 0; }
+        for (k = j+1; k < a->n; k++) { if (!mpc_dfa_total(a->xs[k])) { return 0; } }
+        if (!mpc_dfa_nullable(a->xs[j])) { break; }
+      }
+      return 1;
+    case MPC_DFA_ALT:
+      for (j = 0; j < mpc_dfa_reachable(a); j++) { if (!mpc_dfa_safe(a->xs[j])) { return 0; } }
+      return 1;
+    case MPC_DFA_STAR:
+      return !mpc_dfa_nullable(a->xs[0]) && mpc_dfa_safe(a->xs[0]);
+    case MPC_DFA_MAYBE:
+      return mpc_dfa_safe(a->xs[0]);
+    default: return 1;
+  }
+}
+
+static int mpc_dfa_total(mpc_dfa_node_t *a) {
+
+  /* It never fails at all */
+
+  int j, n;
+
+  switch (a->type) {
+    case MPC_DFA_CLASS: return 0;
+    case MPC_DFA_SEQ:
+      for (j = 0; j < a->n; j++) { if (!mpc_dfa_total(a->xs[j])) { return 0; } }
+      return 1;
+    case MPC_DFA_ALT:
+      n = mpc_dfa_reachable(a);
+      return mpc_dfa_safe(a) && mpc_dfa_total(a->xs[n-1]);
+    case MPC_DFA_STAR:
+    case MPC_DFA_MAYBE:
+      return mpc_dfa_safe(a);
+    default: return 1;
+  }
+}
+
+static int mpc_dfa_check(mpc_dfa_node_t *a) {
+
+  /*
+  ** A failure outside of any `*`, `+` or `?` just fails the whole regex,
+  ** which the DFA does too, so out here an alternative may fail after
+  ** matching a character as long as none of those after it could have
+  ** matched that character or nothing at all.
+  */
+
+  int j, k, n, c;
+  unsigned char x[32], y[32];
+
+  switch (a->type) {
+    case MPC_DFA_SEQ:
+      for (j = 0; j < a->n; j++) { if (!mpc_dfa_check(a->xs[j])) { return 0; } }
+      return 1;
+    case MPC_DFA_ALT:
+      n = mpc_dfa_reachable(a);
+      for (j = 0; j < n; j++) {
+        if (!mpc_dfa_check(a->xs[j])) { return 0; }
+        if (j == n-1 || mpc_dfa_safe(a->xs[j])) { continue; }
+        memset(x, 0, sizeof(x));
+        mpc_dfa_first(a->xs[j], x);
+        for (k = j+1; k < n; k++) {
+          if (mpc_dfa_nullable(a->xs[k])) { return 0; }
+          memset(y, 0, sizeof(y));
+          mpc_dfa_first(a->xs[k], y);
+          for (c = 0; c < 32; c++) { if (x[c] & y[c]) { return 0; } }
+        }
+      }
+      return 1;
+    case MPC_DFA_STAR:
+    case MPC_DFA_MAYBE:
+      return mpc_dfa_total(a);
+    default: return 1;
+  }
+}
+
+static int mpc_dfa_number(mpc_dfa_node_t *a, mpc_dfa_node_t *parent, int index, mpc_dfa_node_t **states, int n) {
+  int j;
+  a->parent = parent;
+  a->index = index;
+  if (a->type == MPC_DFA_CLASS) {
+    if (n >= MPC_DFA_STATES_MAX) { return n + 1; }
+    a->state = n;
+    states[n] = a;
+    return n + 1;
+  }
+  for (j = 0; j < a->n; j++) { n = mpc_dfa_number(a->xs[j], a, j, states, n); }
+  return n;
+}
+
+static int mpc_dfa_start(mpc_dfa_node_t *a, unsigned char *row) {
+
+  /*
+  ** Fill in the moves for starting to match a, in the order they are
+  ** tried, so a character already taken by an earlier move keeps it.
+  ** Returns if a can also finish without matching anything.
+  */
+
+  int j, c;
+
+  switch (a->type) {
+    case MPC_DFA_CLASS:
+      for (c = 1; c < 256; c++) {
+        if (mpc_dfa_has(a->set, c) && row[c] == 0) { row[c] = (unsigned char)a->state; }
+      }
+      return 0;
+    case MPC_DFA_SEQ:
+      for (j = 0; j < a->n; j++) { if (!mpc_dfa_start(a->xs[j], row)) { return 0; } }
+      return 1;
+    case MPC_DFA_ALT:
+      for (j = 0; j < a->n; j++) { if (mpc_dfa_start(a->xs[j], row)) { return 1; } }
+      return 0;
+    case MPC_DFA_STAR:
+    case MPC_DFA_MAYBE:
+      mpc_dfa_start(a->xs[0], row);
+      return 1;
+    default: return 1;
+  }
+}
+
+static int mpc_dfa_after(mpc_dfa_node_t *a, unsigned char *row) {
+
+  /* Fill in the moves for once a has matched. Returns if the regex can stop there */
+
+  int j;
+  mpc_dfa_node_t *p = a->parent;
+
+  if (p == NULL) { return 1; }
+
+  switch (p->type) {
+    case MPC_DFA_SEQ:
+      for (j = a->index+1; j < p->n; j++) { if (!mpc_dfa_start(p->xs[j], row)) { return 0; } }
+      return mpc_dfa_after(p, row);
+    case MPC_DFA_STAR:
+      mpc_dfa_start(p->xs[0], row);
+      return mpc_dfa_after(p, row);
+    default:
+      return mpc_dfa_after(p, row);
+  }
+}
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *x) {
+
+  int j, n, count = 0;
+  unsigned char *table;
+  mpc_dfa_node_t *a, *states[MPC_DFA_STATES_MAX];
+  mpc_parser_t *p;
+
+  a = mpc_dfa_from(x, &count);
+  if (a == NULL) { return x; }
+  a = mpc_dfa_normalise(a, &count);
+
+  n = mpc_dfa_number(a, NULL, 0, states, 1);
+  if (count > MPC_DFA_NODES_MAX || n > MPC_DFA_STATES_MAX || !mpc_dfa_check(a)) {
+    mpc_dfa_node_delete(a);
+    return x;
+  }
+
+  /* The rows of the states, then whether each can end the match */
+  table = calloc((size_t)n * 257, 1);
+  table[(size_t)n * 256] = (unsigned char)mpc_dfa_start(a, table);
+  for (j = 1; j < n; j++) {
+    table[(size_t)n * 256 + j] = (unsigned char)mpc_dfa_after(states[j], table + (size_t)j * 256);
+  }
+  mpc_dfa_node_delete(a);
+
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = x;
+  p->data.dfa.n = n;
+  p->data.dfa.table = table;
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   return mpc_re_mode(re, MPC_RE_DEFAULT);
 }
@@ -2431,7 +3461,7 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   mpc_optimise(r.output);
 
-  return r.output;
+  return mpc_re_dfa(r.output);
 
 }
 
@@ -2764,6 +3794,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -3644,26 +4675,36 @@ static void mpca_stmt_list_delete(mpc_val_t *x) {
 
 }
 
+static void mpc_optimise_unretained(mpc_parser_t *p, int force);
+static void mpc_optimise_dispatch(mpc_parser_t *p, int force);
+
 static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
 
   mpca_grammar_st_t *st = s;
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
   mpc_parser_t *left;
+  int i;
 
   while(*stmts) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
-    mpc_optimise(stmt->grammar);
+    mpc_optimise_unretained(stmt->grammar, 1);
     mpc_define(left, stmt->grammar);
+    if (st->flags & MPCA_LANG_MEMOIZE) { mpc_memoize(left); }
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
     stmts++;
   }
 
+  /* Dispatch tables look through rules, so wait until all are defined */
+  for (i = 0; i < st->parsers_num; i++) {
+    if (st->parsers[i]) { mpc_optimise_dispatch(st->parsers[i], 1); }
+  }
+
   free(x);
 
   return NULL;
@@ -3850,6 +4891,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3882,9 +4924,15 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 }
 
 void mpc_stats(mpc_parser_t* p) {
+  long lookups = p->memo_hits + p->memo_misses;
   printf("Stats\n");
   printf("=====\n");
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  if (lookups > 0) {
+    printf("Memo Hits: %li of %li (%.1f%%)\n",
+      p->memo_hits, lookups, 100.0 * p->memo_hits / lookups);
+    printf("Memo Peak Bytes: %lu\n", (unsigned long)p->memo_bytes);
+  }
 }
 
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
@@ -3933,7 +4981,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.jump); free(t->data.or.alts); free(t->name); free(t);
       continue;
     }
 
@@ -3947,7 +4995,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.jump); free(t->data.or.alts); free(t->name); free(t);
       continue;
     }
 
@@ -4056,7 +5104,213 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 
 }
 
+/*
+** First Sets
+**
+** The characters a parser can start with, and whether it can succeed
+** without consuming any. `or` parsers use them to build a table from the
+** next character to the alternatives worth trying. A parser that cannot be
+** looked into claims every character and is nullable, so it is always tried.
+*/
+
+enum {
+  MPC_FIRST_DEPTH_MAX = 64,
+  MPC_FIRST_STEPS_MAX = 4096
+};
+
+static int mpc_first(mpc_parser_t *p, unsigned char *set, mpc_parser_t **stack, int depth, int *steps) {
+
+  int j, c, nullable;
+
+  /* Left recursion or a very deep grammar */
+  for (j = 0; j < depth; j++) {
+    if (stack[j] == p) { break; }
+  }
+  if (j < depth || depth == MPC_FIRST_DEPTH_MAX || (*steps)++ >= MPC_FIRST_STEPS_MAX) {
+    memset(set, 0xFF, 32);
+    return 1;
+  }
+  stack[depth] = p;
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+      mpc_dfa_set(p, set);
+      return 0;
+
+    case MPC_TYPE_STRING:
+      c = (unsigned char)p->data.string.x[0];
+      if (c == 0) { return 1; }
+      set[c >> 3] |= (unsigned char)(1 << (c & 7));
+      return 0;
+
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_NOT:
+      return 1;
+
+    case MPC_TYPE_FAIL:
+      return 0;
+
+    case MPC_TYPE_EXPECT:     return mpc_first(p->data.expect.x, set, stack, depth+1, steps);
+    case MPC_TYPE_APPLY:      return mpc_first(p->data.apply.x, set, stack, depth+1, steps);
+    case MPC_TYPE_APPLY_TO:   return mpc_first(p->data.apply_to.x, set, stack, depth+1, steps);
+    case MPC_TYPE_CHECK:      return mpc_first(p->data.check.x, set, stack, depth+1, steps);
+    case MPC_TYPE_CHECK_WITH: return mpc_first(p->data.check_with.x, set, stack, depth+1, steps);
+    case MPC_TYPE_PREDICT:    return mpc_first(p->data.predict.x, set, stack, depth+1, steps);
+    case MPC_TYPE_DFA:        return mpc_first(p->data.dfa.x, set, stack, depth+1, steps);
+    case MPC_TYPE_MANY1:      return mpc_first(p->data.repeat.x, set, stack, depth+1, steps);
+
+    case MPC_TYPE_MAYBE:
+      mpc_first(p->data.not.x, set, stack, depth+1, steps);
+      return 1;
+
+    case MPC_TYPE_MANY:
+      mpc_first(p->data.repeat.x, set, stack, depth+1, steps);
+      return 1;
+
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n <= 0) { return 1; }
+      return mpc_first(p->data.repeat.x, set, stack, depth+1, steps);
+
+    case MPC_TYPE_OR:
+      nullable = 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        nullable |= mpc_first(p->data.or.xs[j], set, stack, depth+1, steps);
+      }
+      return nullable;
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_first(p->data.and.xs[j], set, stack, depth+1, steps)) { return 0; }
+      }
+      return 1;
+
+    default:
+      memset(set, 0xFF, 32);
+      return 1;
+  }
+
+}
+
+static void mpc_optimise_dispatch_or(mpc_parser_t *p) {
+
+  /*
+  ** Alternatives are grouped by the characters that share the same list of
+  ** them to try. `jump` maps each character to its group and the lists are
+  ** stored after the group offsets in `alts`. The '\0' at the end of the
+  ** input only gets the nullable alternatives.
+  */
+
+  int j, k, c, m, n = p->data.or.n, w = (n + 7) / 8;
+  int groups = 0, total = 0, pruned = 0, steps = 0;
+  int reps[256];
+  unsigned char *sets, *nullable, *rows;
+  mpc_parser_t *stack[MPC_FIRST_DEPTH_MAX];
+
+  free(p->data.or.jump); p->data.or.jump = NULL;
+  free(p->data.or.alts); p->data.or.alts = NULL;
+  if (n == 0) { return; }
+
+  sets = calloc((size_t)n, 32);
+  nullable = malloc((size_t)n);
+  rows = calloc(256, (size_t)w);
+
+  stack[0] = p;
+  for (j = 0; j < n; j++) {
+    nullable[j] = (unsigned char)mpc_first(p->data.or.xs[j], sets + 32 * j, stack, 1, &steps);
+  }
+
+  p->data.or.jump = malloc(256);
+
+  for (c = 0; c < 256; c++) {
+
+    m = 0;
+    for (j = 0; j < n; j++) {
+      if (nullable[j] || (c && sets[32 * j + (c >> 3)] & (1 << (c & 7)))) {
+        rows[c * w + (j >> 3)] |= (unsigned char)(1 << (j & 7));
+        m++;
+      }
+    }
+    if (m < n) { pruned = 1; }
+
+    for (k = 0; k < groups; k++) {
+      if (memcmp(rows + reps[k] * w, rows + c * w, (size_t)w) == 0) { break; }
+    }
+    if (k == groups) {
+      reps[groups] = c;
+      total += m;
+      groups++;
+    }
+    p->data.or.jump[c] = (unsigned char)k;
+  }
+
+  if (pruned) {
+    p->data.or.alts = malloc(sizeof(int) * (groups + 1 + total));
+    m = groups + 1;
+    for (k = 0; k < groups; k++) {
+      p->data.or.alts[k] = m;
+      for (j = 0; j < n; j++) {
+        if (rows[reps[k] * w + (j >> 3)] & (1 << (j & 7))) { p->data.or.alts[m++] = j; }
+      }
+    }
+    p->data.or.alts[groups] = m;
+  } else {
+    free(p->data.or.jump);
+    p->data.or.jump = NULL;
+  }
+
+  free(sets);
+  free(nullable);
+  free(rows);
+}
+
+static void mpc_optimise_dispatch(mpc_parser_t *p, int force) {
+
+  int i;
+
+  if (p->retained && !force) { return; }
+
+  if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_dispatch(p->data.expect.x, 0); }
+  if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_dispatch(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_dispatch(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_dispatch(p->data.check.x, 0); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_dispatch(p->data.check_with.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_dispatch(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)        { mpc_optimise_dispatch(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_NOT)        { mpc_optimise_dispatch(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_dispatch(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MANY)       { mpc_optimise_dispatch(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_dispatch(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_dispatch(p->data.repeat.x, 0); }
+
+  if (p->type == MPC_TYPE_OR) {
+    for (i = 0; i < p->data.or.n; i++) {
+      mpc_optimise_dispatch(p->data.or.xs[i], 0);
+    }
+    mpc_optimise_dispatch_or(p);
+  }
+
+  if (p->type == MPC_TYPE_AND) {
+    for (i = 0; i < p->data.and.n; i++) {
+      mpc_optimise_dispatch(p->data.and.xs[i], 0);
+    }
+  }
+
+}
+
 void mpc_optimise(mpc_parser_t *p) {
   mpc_optimise_unretained(p, 1);
+  mpc_optimise_dispatch(p, 1);
 }
 
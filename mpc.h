@@ -69,6 +69,7 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_mapped(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
 /*
@@ -147,6 +148,7 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_memoize(mpc_parser_t *a);
 
 /*
 ** Common Parsers
@@ -353,7 +355,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_MEMOIZE              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
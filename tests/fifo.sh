@@ -0,0 +1,15 @@
+#!/bin/sh
+# Load a file that is a named pipe, which is read as it arrives rather than
+# mapped.
+#
+#   tests/fifo.sh lispy
+
+lispy=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mkfifo "$tmp/in.lspy"
+printf '(print (+ 1 2))\n(print "from a pipe")\n' >"$tmp/in.lspy" &
+timeout 10 "$lispy" "$tmp/in.lspy"
+echo "exit $?"
+wait
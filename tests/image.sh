@@ -0,0 +1,58 @@
+#!/bin/sh
+# Save a heap image, then damage each 8 bytes of it in turn and check lispy
+# refuses or loads it rather than crashing.
+#
+#   tests/image.sh lispy
+
+lispy=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+cat >"$tmp/save.lspy" <<EOF
+(def {greeting} "hello")
+(def {nums} {1 2 {3 4} 4611686018427387904})
+(def {add} +)
+(def {twice} (\\ {f x} {f (f x)}))
+(def {inc} (\\ {x} {add x 1}))
+(def {quoted} {a b "c"})
+(def {empty} (\\ {x} {if x {1} {}}))
+(save-image "$tmp/good.img")
+EOF
+cat >"$tmp/use.lspy" <<EOF
+(print greeting)
+(print nums)
+(print (twice inc 40))
+(print quoted)
+EOF
+# The () of the empty branch is only held by the bytecode of the body, and
+# must outlive a collection in a build with -DLISPY_GC.
+cat >"$tmp/collect.lspy" <<EOF
+(print (empty 0))
+(def {churn} (\\ {n} {if (== n 0) {0} {churn (- (len (list n "s" {a})) (- 3 n) 1)}}))
+(print (churn 5000))
+(print (empty 0))
+EOF
+
+"$lispy" "$tmp/save.lspy"
+"$lispy" --image "$tmp/good.img" "$tmp/use.lspy"
+"$lispy" --image "$tmp/good.img" "$tmp/collect.lspy"
+
+# The header ends with the offset of the global enviroment.
+cp "$tmp/good.img" "$tmp/bad.img"
+printf '\003' | dd of="$tmp/bad.img" bs=1 seek=32 conv=notrunc 2>/dev/null
+"$lispy" --image "$tmp/bad.img" "$tmp/use.lspy" | sed "s|$tmp/||"
+
+size=$(wc -c <"$tmp/good.img")
+off=40
+while [ "$off" -lt "$size" ]; do
+  for bytes in '\377\377\377\377\377\377\377\377' '\000\000\000\000\000\000\000\000' '\030'; do
+    cp "$tmp/good.img" "$tmp/bad.img"
+    printf "$bytes" | dd of="$tmp/bad.img" bs=1 seek="$off" conv=notrunc 2>/dev/null
+    "$lispy" --image "$tmp/bad.img" "$tmp/use.lspy" >/dev/null 2>&1
+    if [ $? -ge 128 ]; then
+      printf 'crashed with %s at %s\n' "$bytes" "$off"
+    fi
+  done
+  off=$((off + 8))
+done
+echo "damaged images done"
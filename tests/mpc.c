@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpc.h"
+
+/**
+ * Parse the same input as a string and as a pipe with each grammar, and
+ * print whether they agree. They must give the same AST, or the same error
+ * at the same position, whatever the fast paths and the buffering of pipes
+ * do.
+ *
+ * tests/mpc.sh builds and runs this.
+ */
+
+char *parse_string(mpc_parser_t *p, char *input) {
+  mpc_result_t r;
+  char *out;
+  size_t len;
+  FILE *f = open_memstream(&out, &len);
+  if (mpc_parse("<input>", input, p, &r)) {
+    mpc_ast_print_to(r.output, f);
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print_to(r.error, f);
+    mpc_err_delete(r.error);
+  }
+  fclose(f);
+  return out;
+}
+
+char *parse_pipe(mpc_parser_t *p, char *input) {
+  // mpc_parse_pipe never seeks, so a temporary file reads as a pipe would.
+  FILE *in = tmpfile();
+  fputs(input, in);
+  rewind(in);
+  mpc_result_t r;
+  char *out;
+  size_t len;
+  FILE *f = open_memstream(&out, &len);
+  if (mpc_parse_pipe("<input>", in, p, &r)) {
+    mpc_ast_print_to(r.output, f);
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print_to(r.error, f);
+    mpc_err_delete(r.error);
+  }
+  fclose(f);
+  fclose(in);
+  return out;
+}
+
+void compare(char *name, mpc_parser_t *p, char *input) {
+  char *a = parse_string(p, input);
+  char *b = parse_pipe(p, input);
+  if (strcmp(a, b) == 0) {
+    printf("%s: same\n", name);
+  } else {
+    printf("%s: string\n%spipe\n%s", name, a, b);
+  }
+  free(a);
+  free(b);
+}
+
+char *random_items(int n, char *end) {
+  char *s = malloc(n + strlen(end) + 1);
+  for (int i = 0; i < n; i++) {
+    s[i] = "abc"[rand() % 3];
+  }
+  strcpy(s + n, end);
+  return s;
+}
+
+int main(void) {
+  srand(1);
+  int flags[] = {MPCA_LANG_DEFAULT, MPCA_LANG_PREDICTIVE};
+  char *names[] = {"default", "predictive"};
+  for (int f = 0; f < 2; f++) {
+    mpc_parser_t *top = mpc_new("top");
+    mpc_parser_t *item = mpc_new("item");
+    mpca_lang(flags[f],
+              "top : <item>* '!' ; item : 'a' | 'b' | 'c' | \"de\" ;", top,
+              item);
+    // Failing after more input than a ring buffer first holds.
+    int sizes[] = {10, 5000, 20000};
+    for (int s = 0; s < 3; s++) {
+      char name[64];
+      for (int fail = 0; fail < 2; fail++) {
+        char *input = random_items(sizes[s], fail ? "x" : "de!");
+        snprintf(name, sizeof(name), "%s %d %s", names[f], sizes[s],
+                 fail ? "fails" : "parses");
+        compare(name, top, input);
+        free(input);
+      }
+    }
+    mpc_cleanup(2, top, item);
+  }
+  return 0;
+}
@@ -0,0 +1,12 @@
+#!/bin/sh
+# Build tests/mpc.c against the mpc beside it and run it. It parses each
+# input as a string and as a pipe, which must agree.
+#
+#   tests/mpc.sh [lispy]
+
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+${CC:-cc} -O2 -I"$dir/.." "$dir/mpc.c" "$dir/../mpc.c" -lm -o "$tmp/mpc" &&
+  "$tmp/mpc"
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Fork workers from a parent whose prelude left a future running, and check
+# they can def and start futures of their own rather than hang.
+#
+#   tests/prefork.sh lispy
+
+lispy=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+cat >"$tmp/pre.lspy" <<EOF
+(def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))
+(future {fib 25})
+(fib 15)
+EOF
+cat >"$tmp/def.lspy" <<EOF
+(def {z} 1)
+(print z)
+EOF
+cat >"$tmp/future.lspy" <<EOF
+(print (await (future {fib 15})))
+EOF
+
+# The workers take the jobs in any order, so only what they print is
+# compared.
+for threads in 1 2; do
+  printf '%s\n' "$tmp/def.lspy" "$tmp/future.lspy" "$tmp/def.lspy" |
+    LISPY_THREADS=$threads timeout 60 "$lispy" --prefork 2 "$tmp/pre.lspy" \
+      >"$tmp/out" 2>/dev/null
+  echo "threads $threads exit $?"
+  sort "$tmp/out"
+done
+
+# A worker that dies never reports, the parent must not wait for it.
+cat >"$tmp/deep.lspy" <<EOF
+(def {down} (\\ {n} {if (== n 0) {0} {+ 1 (down (- n 1))}}))
+(down 10000000)
+EOF
+cat >"$tmp/ok.lspy" <<EOF
+(print "ok")
+EOF
+printf '%s\n' "$tmp/deep.lspy" "$tmp/ok.lspy" "$tmp/ok.lspy" |
+  timeout 60 "$lispy" --prefork 2 >"$tmp/out" 2>/dev/null
+echo "dead worker exit $?"
+sort "$tmp/out"
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Run each tests/*.lspy with the lispy given, ./lispy by default, and compare
+# what it prints with the .out file beside it. Each runs with 1 and with 4
+# threads for pmap and future. Memory is limited to 64MB and C stack to 1MB,
+# so a loop that should run in bounded space fails instead of growing. The
+# 10 million tail calls of tail.lspy could not keep 8 bytes each. The other
+# tests/*.sh scripts are given the lispy to run and compared the same way.
+#
+#   tests/run.sh [lispy]
+
+lispy=${1:-./lispy}
+dir=$(dirname "$0")
+failed=0
+
+check() {
+  test=$1
+  shift
+  if "$@" 2>&1 | diff -u "${test%.*}.out" - >/dev/null; then
+    echo "ok   $test"
+  else
+    echo "FAIL $test"
+    "$@" 2>&1 | diff -u "${test%.*}.out" - | head -20
+    failed=1
+  fi
+}
+
+limited() {
+  (ulimit -v 65536; ulimit -s 1024; "$@")
+}
+
+for threads in 1 4; do
+  echo "LISPY_THREADS=$threads"
+  export LISPY_THREADS=$threads
+  for test in "$dir"/*.lspy; do
+    check "$test" limited "$lispy" "$test"
+  done
+done
+unset LISPY_THREADS
+for test in "$dir"/*.sh; do
+  if [ "${test##*/}" != run.sh ]; then
+    check "$test" sh "$test" "$lispy"
+  fi
+done
+exit $failed